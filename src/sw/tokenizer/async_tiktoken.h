@@ -0,0 +1,344 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+#ifndef SEWENEW_TOKENIZER_ASYNC_TIKTOKEN_H
+#define SEWENEW_TOKENIZER_ASYNC_TIKTOKEN_H
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "sw/tokenizer/errors.h"
+#include "sw/tokenizer/tiktoken.h"
+
+namespace sw::tokenizer {
+
+enum class Priority {
+    // Latency sensitive requests, always taken before LOW ones.
+    HIGH = 0,
+
+    // Bulk requests.
+    LOW,
+
+    // Not a priority, but the number of priorities.
+    NUM
+};
+
+struct AsyncOptions {
+    // Number of worker threads. 0 means the number of hardware threads.
+    std::size_t workers = 0;
+
+    // Max number of pending requests of each priority.
+    std::size_t queue_capacity = 1024;
+
+    // Requests no longer than this are HIGH priority, unless specified explicitly.
+    std::size_t small_request_size = 4096;
+
+    // After taking this number of HIGH priority requests in a row, a worker takes a LOW
+    // priority one, if any, so that bulk requests are not starved.
+    std::size_t high_priority_burst = 16;
+};
+
+struct AsyncMetrics {
+    // Current number of pending requests of each priority.
+    std::array<std::size_t, static_cast<std::size_t>(Priority::NUM)> queue_depth = {};
+
+    std::size_t submitted = 0;
+
+    // Requests rejected by `try_submit` because of a full queue.
+    std::size_t rejected = 0;
+
+    // Requests taken by workers.
+    std::size_t started = 0;
+
+    std::size_t completed = 0;
+
+    // Time between submission and being taken by a worker, of started requests.
+    std::chrono::microseconds total_wait_time{0};
+    std::chrono::microseconds max_wait_time{0};
+
+    std::chrono::microseconds avg_wait_time() const {
+        return started == 0 ? std::chrono::microseconds(0) : total_wait_time / static_cast<std::chrono::microseconds::rep>(started);
+    }
+};
+
+// Encode texts with a thread pool, so that event loops never block on large inputs.
+// Requests are queued in a bounded queue per priority. `submit` blocks when the queue is
+// full, while `try_submit` returns immediately, so that callers can apply backpressure,
+// e.g. reject or defer the request.
+class AsyncTiktoken {
+public:
+    using Tokens = std::vector<uint64_t>;
+
+    // On failure, `tokens` is empty and `err` is set.
+    using Callback = std::function<void (Tokens tokens, std::exception_ptr err)>;
+
+    AsyncTiktoken(TiktokenSPtr tiktoken, AsyncOptions opts = {}) :
+        _tiktoken(std::move(tiktoken)), _opts(opts) {
+        if (!_tiktoken) {
+            throw Error("null tiktoken");
+        }
+
+        if (_opts.queue_capacity == 0) {
+            throw Error("queue capacity must be positive");
+        }
+
+        if (_opts.workers == 0) {
+            _opts.workers = std::max(1U, std::thread::hardware_concurrency());
+        }
+
+        try {
+            for (std::size_t idx = 0; idx < _opts.workers; ++idx) {
+                _workers.emplace_back([this]() { _work(); });
+            }
+        } catch (...) {
+            // Destroying a joinable thread terminates the process, so stop started ones.
+            _stop();
+            throw;
+        }
+    }
+
+    AsyncTiktoken(const AsyncTiktoken &) = delete;
+    AsyncTiktoken& operator=(const AsyncTiktoken &) = delete;
+
+    AsyncTiktoken(AsyncTiktoken &&) = delete;
+    AsyncTiktoken& operator=(AsyncTiktoken &&) = delete;
+
+    // Pending requests are finished before it returns.
+    ~AsyncTiktoken() {
+        _stop();
+    }
+
+    // Block until there's room in the queue.
+    std::future<Tokens> submit(std::string text, bool with_special_token = true) {
+        auto priority = _priority(text);
+        return submit(std::move(text), priority, with_special_token);
+    }
+
+    std::future<Tokens> submit(std::string text, Priority priority, bool with_special_token = true) {
+        auto [callback, future] = _promise();
+        _push(Job{std::move(text), with_special_token, std::move(callback), {}}, priority, true);
+        return std::move(future);
+    }
+
+    void submit(std::string text, Callback callback, bool with_special_token = true) {
+        auto priority = _priority(text);
+        submit(std::move(text), std::move(callback), priority, with_special_token);
+    }
+
+    // The callback is called in a worker thread.
+    void submit(std::string text, Callback callback, Priority priority, bool with_special_token = true) {
+        _push(Job{std::move(text), with_special_token, std::move(callback), {}}, priority, true);
+    }
+
+    // Returns std::nullopt, if the queue is full.
+    std::optional<std::future<Tokens>> try_submit(std::string text, bool with_special_token = true) {
+        auto priority = _priority(text);
+        return try_submit(std::move(text), priority, with_special_token);
+    }
+
+    std::optional<std::future<Tokens>> try_submit(std::string text,
+            Priority priority,
+            bool with_special_token = true) {
+        auto [callback, future] = _promise();
+        if (!_push(Job{std::move(text), with_special_token, std::move(callback), {}}, priority, false)) {
+            return std::nullopt;
+        }
+
+        return std::move(future);
+    }
+
+    // Returns false, if the queue is full, and the callback won't be called.
+    bool try_submit(std::string text, Callback callback, bool with_special_token = true) {
+        auto priority = _priority(text);
+        return try_submit(std::move(text), std::move(callback), priority, with_special_token);
+    }
+
+    bool try_submit(std::string text, Callback callback, Priority priority, bool with_special_token = true) {
+        return _push(Job{std::move(text), with_special_token, std::move(callback), {}}, priority, false);
+    }
+
+    AsyncMetrics metrics() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        auto metrics = _metrics;
+        for (std::size_t idx = 0; idx < _queues.size(); ++idx) {
+            metrics.queue_depth[idx] = _queues[idx].size();
+        }
+
+        return metrics;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Job {
+        std::string text;
+        bool with_special_token;
+        Callback callback;
+        Clock::time_point submit_time;
+    };
+
+    Priority _priority(const std::string &text) const {
+        return text.size() <= _opts.small_request_size ? Priority::HIGH : Priority::LOW;
+    }
+
+    static std::pair<Callback, std::future<Tokens>> _promise() {
+        auto promise = std::make_shared<std::promise<Tokens>>();
+        auto future = promise->get_future();
+        Callback callback = [promise](Tokens tokens, std::exception_ptr err) {
+            if (err) {
+                promise->set_exception(err);
+            } else {
+                promise->set_value(std::move(tokens));
+            }
+        };
+
+        return {std::move(callback), std::move(future)};
+    }
+
+    bool _push(Job job, Priority priority, bool wait) {
+        if (priority >= Priority::NUM) {
+            throw Error("invalid priority");
+        }
+
+        auto &queue = _queues[static_cast<std::size_t>(priority)];
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (wait) {
+                _not_full.wait(lock,
+                        [this, &queue]() { return _stopping || queue.size() < _opts.queue_capacity; });
+            } else if (queue.size() >= _opts.queue_capacity) {
+                ++_metrics.rejected;
+                return false;
+            }
+
+            if (_stopping) {
+                throw Error("async tiktoken is stopping");
+            }
+
+            job.submit_time = Clock::now();
+            queue.push_back(std::move(job));
+            ++_metrics.submitted;
+        }
+
+        _not_empty.notify_one();
+
+        return true;
+    }
+
+    // Workers finish pending requests before they exit.
+    void _stop() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _not_empty.notify_all();
+        _not_full.notify_all();
+
+        for (auto &worker : _workers) {
+            worker.join();
+        }
+    }
+
+    void _work() {
+        std::size_t high_in_row = 0;
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _not_empty.wait(lock, [this]() { return _stopping || !_empty(); });
+                if (_empty()) {
+                    // Stopping, and all requests have been done.
+                    break;
+                }
+
+                auto &high = _queues[static_cast<std::size_t>(Priority::HIGH)];
+                auto &low = _queues[static_cast<std::size_t>(Priority::LOW)];
+                auto take_low = high.empty() || (high_in_row >= _opts.high_priority_burst && !low.empty());
+                auto &queue = take_low ? low : high;
+                high_in_row = take_low ? 0 : high_in_row + 1;
+
+                job = std::move(queue.front());
+                queue.pop_front();
+
+                auto wait_time = std::chrono::duration_cast<std::chrono::microseconds>(
+                        Clock::now() - job.submit_time);
+                ++_metrics.started;
+                _metrics.total_wait_time += wait_time;
+                _metrics.max_wait_time = std::max(_metrics.max_wait_time, wait_time);
+            }
+
+            _not_full.notify_all();
+
+            Tokens tokens;
+            std::exception_ptr err;
+            try {
+                tokens = _tiktoken->encode(job.text, job.with_special_token);
+            } catch (...) {
+                err = std::current_exception();
+            }
+
+            try {
+                job.callback(std::move(tokens), err);
+            } catch (...) {
+                // Exceptions from user callbacks cannot be reported to anyone, ignore them.
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                ++_metrics.completed;
+            }
+        }
+    }
+
+    bool _empty() const {
+        return std::all_of(_queues.begin(), _queues.end(), [](const auto &queue) { return queue.empty(); });
+    }
+
+    TiktokenSPtr _tiktoken;
+
+    AsyncOptions _opts;
+
+    mutable std::mutex _mutex;
+
+    std::condition_variable _not_empty;
+
+    std::condition_variable _not_full;
+
+    std::array<std::deque<Job>, static_cast<std::size_t>(Priority::NUM)> _queues;
+
+    AsyncMetrics _metrics;
+
+    bool _stopping = false;
+
+    std::vector<std::thread> _workers;
+};
+
+}
+
+#endif // end SEWENEW_TOKENIZER_ASYNC_TIKTOKEN_H
@@ -0,0 +1,365 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+#ifndef SEWENEW_TOKENIZER_BACKTRACK_ENCODER_H
+#define SEWENEW_TOKENIZER_BACKTRACK_ENCODER_H
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "sw/tokenizer/errors.h"
+
+namespace sw::tokenizer {
+
+// BPE encoder that doesn't merge byte pairs at all. Instead, it walks a trie of the
+// vocabulary, greedily picks the longest token, and backtracks to a shorter one only
+// if the chosen token cannot follow the previous one in a valid BPE encoding. So it
+// takes roughly linear time, no matter how adversarial the input is.
+//
+// The result is the same as `Tiktoken::_byte_pair_merge`, as long as the vocabulary
+// is trained the way BPE does, i.e. each token is merged from two tokens with lower
+// ranks, and all single bytes are tokens.
+class BacktrackEncoder {
+public:
+    explicit BacktrackEncoder(const std::unordered_map<std::string, uint64_t> &ranks) {
+        _build_tokens(ranks);
+        _build_trie();
+        _build_next_prefix();
+        _build_splits();
+    }
+
+    // Append ranks of the BPE encoding of `piece` to `tokens`. Scratch memory comes from `resource`.
+    template <typename Tokens>
+    void encode(std::string_view piece,
+            Tokens &tokens,
+            std::pmr::memory_resource *resource = std::pmr::get_default_resource()) const {
+        if (piece.empty()) {
+            return;
+        }
+
+        std::pmr::vector<uint32_t> ids(resource);
+        ids.reserve(piece.size());
+
+        // Whether a valid encoding of the rest might start from the position.
+        std::pmr::vector<bool> reachable(piece.size() + 1, true, resource);
+
+        std::size_t pos = 0;
+        auto next = _longest_match(piece, 0);
+        while (next != NONE) {
+            auto token = next;
+            auto last = ids.empty() ? NONE : ids.back();
+            while (true) {
+                auto end = pos + _size(token);
+                if (reachable[end] && (last == NONE || _is_valid_pair(last, token))) {
+                    ids.push_back(token);
+                    pos = end;
+                    next = _longest_match(piece, end);
+                    break;
+                }
+
+                auto shorter = _next_prefix[token];
+                if (shorter != NONE) {
+                    token = shorter;
+                    continue;
+                }
+
+                // No token at `pos` works, try shorter ones for the previous token.
+                assert(last != NONE);
+                reachable[pos] = false;
+                ids.pop_back();
+                pos -= _size(last);
+                next = last;
+                break;
+            }
+        }
+
+        assert(pos == piece.size());
+
+        for (auto id : ids) {
+            tokens.push_back(_ranks[id]);
+        }
+    }
+
+private:
+    static constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
+
+    struct Node {
+        // Id of the token ending at this node, or NONE.
+        uint32_t token = NONE;
+
+        // Children are stored in [first, first + count), and sorted by their labels.
+        uint32_t first = 0;
+        uint32_t count = 0;
+    };
+
+    // Tokens are given dense ids in rank order, so comparing ids is comparing ranks.
+    void _build_tokens(const std::unordered_map<std::string, uint64_t> &ranks) {
+        std::vector<std::pair<uint64_t, const std::string*>> tokens;
+        tokens.reserve(ranks.size());
+        for (const auto &[token, rank] : ranks) {
+            if (token.empty()) {
+                throw Error("empty token in vocabulary");
+            }
+            tokens.emplace_back(rank, &token);
+        }
+
+        if (tokens.size() >= NONE) {
+            throw Error("too many tokens in vocabulary");
+        }
+
+        std::sort(tokens.begin(), tokens.end());
+
+        _ranks.reserve(tokens.size());
+        _offsets.reserve(tokens.size() + 1);
+        _offsets.push_back(0);
+        for (const auto &[rank, token] : tokens) {
+            _ranks.push_back(rank);
+            _bytes += *token;
+            _offsets.push_back(static_cast<uint32_t>(_bytes.size()));
+        }
+    }
+
+    void _build_trie() {
+        auto cnt = static_cast<uint32_t>(_ranks.size());
+        std::vector<uint32_t> order(cnt);
+        for (uint32_t id = 0; id < cnt; ++id) {
+            order[id] = id;
+        }
+        std::sort(order.begin(), order.end(),
+                [this](uint32_t a, uint32_t b) { return _token(a) < _token(b); });
+
+        struct Task {
+            uint32_t node;
+            std::size_t begin;
+            std::size_t end;
+            std::size_t depth;
+        };
+
+        _nodes.emplace_back();
+        _labels.push_back(0);
+        std::vector<Task> tasks = {{0, 0, order.size(), 0}};
+        while (!tasks.empty()) {
+            auto task = tasks.back();
+            tasks.pop_back();
+
+            // Tokens in [begin, end) share the same prefix of `depth` bytes,
+            // and the shortest one comes first.
+            auto idx = task.begin;
+            if (idx < task.end && _size(order[idx]) == task.depth) {
+                _nodes[task.node].token = order[idx];
+                ++idx;
+            }
+
+            auto first = static_cast<uint32_t>(_nodes.size());
+            uint32_t count = 0;
+            while (idx < task.end) {
+                auto label = _byte(order[idx], task.depth);
+                auto next = idx;
+                while (next < task.end && _byte(order[next], task.depth) == label) {
+                    ++next;
+                }
+
+                _nodes.emplace_back();
+                _labels.push_back(label);
+                tasks.push_back({first + count, idx, next, task.depth + 1});
+                ++count;
+
+                idx = next;
+            }
+
+            _nodes[task.node].first = first;
+            _nodes[task.node].count = count;
+        }
+
+        _root.fill(NONE);
+        const auto &root = _nodes.front();
+        for (auto child = root.first; child < root.first + root.count; ++child) {
+            _root[_labels[child]] = child;
+        }
+
+        for (auto b = 0U; b < _root.size(); ++b) {
+            if (_root[b] == NONE || _nodes[_root[b]].token == NONE) {
+                throw Error("backtracking BPE requires all single bytes to be tokens");
+            }
+        }
+    }
+
+    void _build_next_prefix() {
+        _next_prefix.assign(_ranks.size(), NONE);
+        for (uint32_t id = 0; id < _ranks.size(); ++id) {
+            auto token = _token(id);
+            auto prefix = NONE;
+            auto node = _child(0, static_cast<unsigned char>(token[0]));
+            for (std::size_t idx = 1; idx < token.size() && node != NONE; ++idx) {
+                if (_nodes[node].token != NONE) {
+                    prefix = _nodes[node].token;
+                }
+                node = _child(node, static_cast<unsigned char>(token[idx]));
+            }
+            _next_prefix[id] = prefix;
+        }
+    }
+
+    // Find the pair of tokens each token is merged from, in the same way as BPE would
+    // encode the token itself. Tokens which cannot be split are paired with themselves.
+    void _build_splits() {
+        _splits.reserve(_ranks.size());
+        for (uint32_t id = 0; id < _ranks.size(); ++id) {
+            auto token = _token(id);
+            auto split = std::make_pair(id, id);
+            for (auto first = _next_prefix[id]; first != NONE; first = _next_prefix[first]) {
+                auto second = _find(token.substr(_size(first)));
+                if (second != NONE && first < id && second < id && _is_valid_pair(first, second)) {
+                    _pairs.emplace(_pair_key(first, second), id);
+                    split = std::make_pair(first, second);
+                    break;
+                }
+            }
+            _splits.push_back(split);
+        }
+    }
+
+    // Check whether BPE would keep the boundary between `first` and `second`, i.e. there's
+    // no merge across the boundary whose rank is lower than the merges building them.
+    bool _is_valid_pair(uint32_t first, uint32_t second) const {
+        auto limit = NONE;
+        while (true) {
+            auto iter = _pairs.find(_pair_key(first, second));
+            if (iter != _pairs.end() && iter->second < limit) {
+                return false;
+            }
+
+            if (first > second) {
+                limit = first;
+                first = _splits[first].second;
+                if (first == limit) {
+                    limit = second + 1;
+                    second = _splits[second].first;
+                    if (second + 1 == limit) {
+                        return true;
+                    }
+                }
+            } else {
+                limit = second + 1;
+                second = _splits[second].first;
+                if (second + 1 == limit) {
+                    limit = first;
+                    first = _splits[first].second;
+                    if (first == limit) {
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+
+    // Returns the longest token which is a prefix of `text.substr(pos)`.
+    uint32_t _longest_match(std::string_view text, std::size_t pos) const {
+        if (pos >= text.size()) {
+            return NONE;
+        }
+
+        auto node = _root[static_cast<unsigned char>(text[pos])];
+        auto token = _nodes[node].token;
+        for (++pos; pos < text.size(); ++pos) {
+            node = _child(node, static_cast<unsigned char>(text[pos]));
+            if (node == NONE) {
+                break;
+            }
+
+            if (_nodes[node].token != NONE) {
+                token = _nodes[node].token;
+            }
+        }
+
+        return token;
+    }
+
+    uint32_t _find(std::string_view bytes) const {
+        uint32_t node = 0;
+        for (auto c : bytes) {
+            node = _child(node, static_cast<unsigned char>(c));
+            if (node == NONE) {
+                return NONE;
+            }
+        }
+
+        return _nodes[node].token;
+    }
+
+    uint32_t _child(uint32_t node, unsigned char label) const {
+        const auto &n = _nodes[node];
+        auto begin = _labels.begin() + n.first;
+        auto end = begin + n.count;
+        auto iter = std::lower_bound(begin, end, label);
+        if (iter == end || *iter != label) {
+            return NONE;
+        }
+
+        return static_cast<uint32_t>(iter - _labels.begin());
+    }
+
+    std::string_view _token(uint32_t id) const {
+        return std::string_view(_bytes).substr(_offsets[id], _offsets[id + 1] - _offsets[id]);
+    }
+
+    std::size_t _size(uint32_t id) const {
+        return _offsets[id + 1] - _offsets[id];
+    }
+
+    unsigned char _byte(uint32_t id, std::size_t idx) const {
+        return static_cast<unsigned char>(_bytes[_offsets[id] + idx]);
+    }
+
+    static uint64_t _pair_key(uint32_t first, uint32_t second) {
+        return (static_cast<uint64_t>(first) << 32) | second;
+    }
+
+    // Token id -> rank.
+    std::vector<uint64_t> _ranks;
+
+    // Bytes of token `id` are stored in [_offsets[id], _offsets[id + 1]) of `_bytes`.
+    std::string _bytes;
+    std::vector<uint32_t> _offsets;
+
+    std::vector<Node> _nodes;
+
+    // Label of the edge leading to each node.
+    std::vector<unsigned char> _labels;
+
+    // Children of root indexed by label.
+    std::array<uint32_t, 256> _root;
+
+    // The longest token which is a strict prefix of each token.
+    std::vector<uint32_t> _next_prefix;
+
+    std::vector<std::pair<uint32_t, uint32_t>> _splits;
+
+    // (first, second) -> the token merged from them.
+    std::unordered_map<uint64_t, uint32_t> _pairs;
+};
+
+}
+
+#endif // end SEWENEW_TOKENIZER_BACKTRACK_ENCODER_H
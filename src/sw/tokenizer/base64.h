@@ -18,6 +18,7 @@
 #define SEWENEW_TIKTOKEN_BASE64_H
 
 #include <cassert>
+#include <cstdint>
 #include <string>
 #include <string_view>
 #include "sw/tokenizer/errors.h"
@@ -146,6 +147,38 @@ inline std::string decode(const std::string_view &input) {
     return output;
 }
 
+inline std::string encode(const std::string_view &input) {
+    constexpr char ENCODE_TABLE[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    std::string output;
+    output.reserve((input.size() + 2) / 3 * 4);
+    auto idx = 0U;
+    for (; idx + 3 <= input.size(); idx += 3) {
+        uint32_t val = (static_cast<uint8_t>(input[idx]) << 16)
+            | (static_cast<uint8_t>(input[idx + 1]) << 8)
+            | static_cast<uint8_t>(input[idx + 2]);
+        output.push_back(ENCODE_TABLE[(val >> 18) & 0x3F]);
+        output.push_back(ENCODE_TABLE[(val >> 12) & 0x3F]);
+        output.push_back(ENCODE_TABLE[(val >> 6) & 0x3F]);
+        output.push_back(ENCODE_TABLE[val & 0x3F]);
+    }
+
+    // Last 1 or 2 bytes with paddings.
+    auto left = input.size() - idx;
+    if (left > 0) {
+        uint32_t val = static_cast<uint8_t>(input[idx]) << 16;
+        if (left == 2) {
+            val |= static_cast<uint8_t>(input[idx + 1]) << 8;
+        }
+        output.push_back(ENCODE_TABLE[(val >> 18) & 0x3F]);
+        output.push_back(ENCODE_TABLE[(val >> 12) & 0x3F]);
+        output.push_back(left == 2 ? ENCODE_TABLE[(val >> 6) & 0x3F] : '=');
+        output.push_back('=');
+    }
+
+    return output;
+}
+
 }
 
 #endif // end SEWENEW_TIKTOKEN_BASE64_H
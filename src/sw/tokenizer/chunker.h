@@ -0,0 +1,303 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+#ifndef SEWENEW_TOKENIZER_CHUNKER_H
+#define SEWENEW_TOKENIZER_CHUNKER_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <istream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "sw/tokenizer/errors.h"
+#include "sw/tokenizer/tiktoken.h"
+
+namespace sw::tokenizer {
+
+// Where a chunk prefers to end.
+enum class ChunkBoundary {
+    // Exactly `ChunkOptions::size` tokens, except the last chunk.
+    TOKEN = 0,
+
+    // The end of a piece, so that words are not split.
+    PIECE,
+
+    // After a newline, or the end of a piece if there's no newline.
+    NEWLINE
+};
+
+struct ChunkOptions {
+    // Max number of tokens of a chunk.
+    std::size_t size = 512;
+
+    // Number of tokens shared by adjacent chunks. It must be less than `size`.
+    std::size_t overlap = 0;
+
+    ChunkBoundary boundary = ChunkBoundary::TOKEN;
+
+    bool with_special_token = true;
+
+    // Max number of bytes held back for the next block, e.g. a long run of letters or
+    // spaces, which is a single piece. Beyond that, the text is cut at a token boundary,
+    // and tokens around the cut might differ from `Tiktoken::encode`. 0 means no limit.
+    std::size_t max_tail = 64 * 1024;
+};
+
+struct Chunk {
+    std::vector<uint64_t> tokens;
+
+    // The chunk's tokens are decoded into [begin, end) of the source text.
+    std::size_t begin = 0;
+    std::size_t end = 0;
+};
+
+// Split a text into chunks of tokens in a single pass, e.g. for embeddings. The text
+// is fed in blocks, and chunks are passed to the callback as soon as they're complete,
+// so that memory usage is bounded by the block size and the chunk size, instead of the
+// text size. The result equals slicing `Tiktoken::encode(text)` into windows, unless
+// a piece is longer than `ChunkOptions::max_tail`.
+//
+// Pieces at the end of a block might change with the next block, e.g. a word split by
+// blocks, or '\n' followed by spaces, which become part of a longer piece if the next block
+// starts with '\n'. So the last two pieces of a block, and the bytes which might be the
+// prefix of a special token, are kept and encoded again with the next block. Kept text is
+// encoded again only after it doubles, so that a long piece fed in small blocks costs
+// linear time instead of quadratic time.
+class Chunker {
+public:
+    // `chunk` is reused for the next chunk, copy it if needed.
+    using Callback = std::function<void (const Chunk &chunk)>;
+
+    Chunker(const Tiktoken &tiktoken, ChunkOptions opts, Callback callback) :
+        _tiktoken(tiktoken), _opts(opts), _callback(std::move(callback)) {
+        if (_opts.size == 0) {
+            throw Error("chunk size must be positive");
+        }
+
+        if (_opts.overlap >= _opts.size) {
+            throw Error("chunk overlap must be less than chunk size");
+        }
+
+        if (!_callback) {
+            throw Error("null chunk callback");
+        }
+    }
+
+    Chunker(const Chunker &) = delete;
+    Chunker& operator=(const Chunker &) = delete;
+
+    Chunker(Chunker &&) = delete;
+    Chunker& operator=(Chunker &&) = delete;
+
+    void feed(std::string_view data) {
+        if (_finished) {
+            throw Error("chunker has been finished");
+        }
+
+        _buffer.append(data.data(), data.size());
+        _encode(false);
+        _emit(false);
+    }
+
+    // Feed all data of `input`, reading `block_size` bytes at a time.
+    void feed(std::istream &input, std::size_t block_size = 64 * 1024) {
+        std::string block(std::max<std::size_t>(block_size, 1), '\0');
+        while (input) {
+            input.read(block.data(), block.size());
+            feed(std::string_view(block.data(), static_cast<std::size_t>(input.gcount())));
+        }
+
+        if (input.bad()) {
+            throw Error("failed to read input");
+        }
+    }
+
+    // Encode the remaining text, and emit the last chunk.
+    void finish() {
+        if (_finished) {
+            return;
+        }
+
+        _finished = true;
+        _encode(true);
+        _emit(true);
+    }
+
+private:
+    struct Token {
+        uint64_t token;
+
+        // Offset of the token's bytes in the source text.
+        std::size_t begin;
+        std::size_t end;
+
+        // Whether the token ends a piece, or ends with a newline.
+        bool piece_end;
+        bool newline_end;
+    };
+
+    void _encode(bool last) {
+        if (_buffer.empty() || (!last && _buffer.size() < _retry_size)) {
+            return;
+        }
+
+        auto encoding = _tiktoken.encode_incremental(_buffer, _opts.with_special_token);
+        const auto &piece_ends = encoding.piece_ends;
+        const auto &token_ends = encoding.token_ends;
+
+        auto cnt = piece_ends.size();
+
+        // Tokens ending after `cut` are kept for the next block.
+        auto cut = _buffer.size();
+        if (!last) {
+            // A special token might start in the last `max_special_token_size - 1` bytes.
+            auto safe = _buffer.size();
+            if (_opts.with_special_token && _tiktoken.max_special_token_size() > 0) {
+                safe -= std::min(safe, _tiktoken.max_special_token_size() - 1);
+            }
+
+            // A piece is final, if the next two pieces are complete.
+            cnt = 0;
+            while (cnt + 2 < piece_ends.size() && piece_ends[cnt + 2] <= safe) {
+                ++cnt;
+            }
+            cut = (cnt == 0) ? 0 : piece_ends[cnt - 1];
+
+            if (_opts.max_tail > 0 && _buffer.size() - cut > _opts.max_tail) {
+                // Force a cut inside the pieces, and keep half of the limit, so that
+                // the next forced cut is far away.
+                cnt = piece_ends.size();
+                cut = std::min(safe, _buffer.size() - _opts.max_tail / 2);
+            }
+        }
+
+        std::size_t token_begin = 0;
+        std::size_t consumed = 0;
+        for (std::size_t idx = 0; idx < cnt && consumed < cut; ++idx) {
+            // Tokens of a piece are decoded into the piece, so locate them from the piece end.
+            auto token_end = token_ends[idx];
+            auto pos = piece_ends[idx];
+            for (auto tok = token_end; tok > token_begin; --tok) {
+                pos -= _tiktoken.token_bytes(encoding.tokens[tok - 1]).size();
+            }
+
+            for (auto tok = token_begin; tok < token_end; ++tok) {
+                auto size = _tiktoken.token_bytes(encoding.tokens[tok]).size();
+                if (pos + size > cut) {
+                    break;
+                }
+
+                auto newline_end = size > 0 && _buffer[pos + size - 1] == '\n';
+                _pending.push_back(Token{encoding.tokens[tok],
+                                            _offset + pos,
+                                            _offset + pos + size,
+                                            tok + 1 == token_end,
+                                            newline_end});
+                pos += size;
+                consumed = pos;
+            }
+
+            token_begin = token_end;
+        }
+
+        _buffer.erase(0, consumed);
+        _offset += consumed;
+        _retry_size = last ? 0 : _buffer.size() * 2;
+    }
+
+    void _emit(bool last) {
+        while (_pending.size() >= _opts.size) {
+            auto cnt = _cut();
+            _emit_chunk(cnt);
+
+            // Keep the overlap for the next chunk.
+            _pending.erase(_pending.begin(), _pending.begin() + (cnt - _opts.overlap));
+            _emitted = _opts.overlap;
+        }
+
+        if (last && _pending.size() > _emitted) {
+            _emit_chunk(_pending.size());
+            _pending.clear();
+            _emitted = 0;
+        }
+    }
+
+    // Number of tokens of the next chunk. It's more than the overlap, so that chunks
+    // always move forward.
+    std::size_t _cut() const {
+        auto size = _opts.size;
+        if (_opts.boundary == ChunkBoundary::NEWLINE) {
+            for (auto cnt = size; cnt > _opts.overlap; --cnt) {
+                if (_pending[cnt - 1].newline_end) {
+                    return cnt;
+                }
+            }
+        }
+
+        if (_opts.boundary != ChunkBoundary::TOKEN) {
+            for (auto cnt = size; cnt > _opts.overlap; --cnt) {
+                if (_pending[cnt - 1].piece_end) {
+                    return cnt;
+                }
+            }
+        }
+
+        return size;
+    }
+
+    void _emit_chunk(std::size_t cnt) {
+        assert(cnt > 0 && cnt <= _pending.size());
+
+        _chunk.tokens.clear();
+        for (std::size_t idx = 0; idx < cnt; ++idx) {
+            _chunk.tokens.push_back(_pending[idx].token);
+        }
+        _chunk.begin = _pending.front().begin;
+        _chunk.end = _pending[cnt - 1].end;
+
+        _callback(_chunk);
+    }
+
+    const Tiktoken &_tiktoken;
+
+    ChunkOptions _opts;
+
+    Callback _callback;
+
+    // Text which hasn't been encoded, and its offset in the source text.
+    std::string _buffer;
+    std::size_t _offset = 0;
+
+    // `_buffer` is encoded again once it reaches this size.
+    std::size_t _retry_size = 0;
+
+    // Tokens which haven't been emitted, except the first `_emitted` ones, which are
+    // the overlap with the last chunk.
+    std::deque<Token> _pending;
+    std::size_t _emitted = 0;
+
+    Chunk _chunk;
+
+    bool _finished = false;
+};
+
+}
+
+#endif // end SEWENEW_TOKENIZER_CHUNKER_H
@@ -0,0 +1,152 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+#ifndef SEWENEW_TOKENIZER_CLIENT_H
+#define SEWENEW_TOKENIZER_CLIENT_H
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "sw/tokenizer/errors.h"
+#include "sw/tokenizer/protocol.h"
+
+namespace sw::tokenizer {
+
+// Client of TokenizerServer. Not thread-safe, use one client per thread.
+class TokenizerClient {
+public:
+    explicit TokenizerClient(const std::string &path) {
+        _fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (_fd < 0) {
+            throw Error(std::string("failed to create socket: ") + std::strerror(errno));
+        }
+
+        auto addr = protocol::make_address(path);
+        if (::connect(_fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0) {
+            auto err = std::string(std::strerror(errno));
+            ::close(_fd);
+            throw Error("failed to connect to " + path + ": " + err);
+        }
+    }
+
+    TokenizerClient(const TokenizerClient &) = delete;
+    TokenizerClient& operator=(const TokenizerClient &) = delete;
+
+    TokenizerClient(TokenizerClient &&) = delete;
+    TokenizerClient& operator=(TokenizerClient &&) = delete;
+
+    ~TokenizerClient() {
+        ::close(_fd);
+    }
+
+    std::vector<uint64_t> encode(const std::string &encoding,
+            const std::string &text,
+            bool with_special_token = true) {
+        auto resp = _call(protocol::Op::ENCODE, encoding, text, with_special_token);
+        return protocol::get_tokens(resp.payload);
+    }
+
+    std::string decode(const std::string &encoding, const std::vector<uint64_t> &tokens) {
+        std::string payload;
+        protocol::put_tokens(payload, tokens);
+        return _call(protocol::Op::DECODE, encoding, payload, false).payload;
+    }
+
+    std::size_t count_tokens(const std::string &encoding,
+            const std::string &text,
+            bool with_special_token = true) {
+        auto resp = _call(protocol::Op::COUNT, encoding, text, with_special_token);
+        if (resp.payload.size() != 8) {
+            throw Error("invalid count response");
+        }
+        return protocol::get_u64(resp.payload.data());
+    }
+
+    // Send a request without waiting for its response, so that requests can be pipelined.
+    // Returns the request id. Pipelined requests might be handled by different workers,
+    // so match responses to requests by id, instead of by order.
+    uint32_t send(protocol::Op op,
+            const std::string &encoding,
+            std::string payload,
+            uint8_t flags = 0) {
+        protocol::Request req;
+        req.id = _next_id++;
+        req.op = op;
+        req.flags = flags;
+        req.encoding = encoding;
+        req.payload = std::move(payload);
+
+        std::string buf;
+        protocol::serialize(req, buf);
+        protocol::write_all(_fd, buf.data(), buf.size());
+
+        return req.id;
+    }
+
+    protocol::Response receive() {
+        std::string frame;
+        while (!_reader.next(frame)) {
+            char buf[64 * 1024];
+            auto n = ::read(_fd, buf, sizeof(buf));
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw Error(std::string("failed to read socket: ") + std::strerror(errno));
+            }
+
+            if (n == 0) {
+                throw Error("connection closed by server");
+            }
+
+            _reader.append(buf, static_cast<std::size_t>(n));
+        }
+
+        return protocol::parse_response(frame);
+    }
+
+private:
+    protocol::Response _call(protocol::Op op,
+            const std::string &encoding,
+            const std::string &payload,
+            bool with_special_token) {
+        auto id = send(op, encoding, payload, with_special_token ? protocol::FLAG_ALLOW_SPECIAL : 0);
+        auto resp = receive();
+        if (resp.id != id) {
+            throw Error("response out of order");
+        }
+
+        if (resp.status != protocol::Status::OK) {
+            throw Error("server error: " + resp.payload);
+        }
+
+        return resp;
+    }
+
+    int _fd = -1;
+
+    uint32_t _next_id = 0;
+
+    protocol::FrameReader _reader;
+};
+
+}
+
+#endif // end SEWENEW_TOKENIZER_CLIENT_H
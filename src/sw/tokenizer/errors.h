@@ -17,6 +17,7 @@
 #ifndef SEWENEW_TOKENIZER_ERRORS_H
 #define SEWENEW_TOKENIZER_ERRORS_H
 
+#include <cstddef>
 #include <exception>
 #include <string>
 
@@ -42,6 +43,27 @@ private:
     std::string _msg;
 };
 
+// Invalid UTF-8 sequence at `offset()` of the decoded text.
+class Utf8Error : public Error {
+public:
+    Utf8Error(const std::string &msg, std::size_t offset) : Error(msg), _offset(offset) {}
+
+    Utf8Error(const Utf8Error &) = default;
+    Utf8Error& operator=(const Utf8Error &) = default;
+
+    Utf8Error(Utf8Error &&) = default;
+    Utf8Error& operator=(Utf8Error &&) = default;
+
+    virtual ~Utf8Error() override = default;
+
+    std::size_t offset() const noexcept {
+        return _offset;
+    }
+
+private:
+    std::size_t _offset;
+};
+
 }
 
 #endif // end SEWENEW_TOKENIZER_ERRORS_H
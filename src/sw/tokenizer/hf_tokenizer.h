@@ -0,0 +1,441 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+#ifndef SEWENEW_TOKENIZER_HF_TOKENIZER_H
+#define SEWENEW_TOKENIZER_HF_TOKENIZER_H
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "re2/re2.h"
+#include "sw/tokenizer/errors.h"
+#include "sw/tokenizer/json.h"
+
+namespace sw::tokenizer {
+
+// A byte-level BPE model in the form Tiktoken takes, i.e. token bytes to ranks.
+struct HfBpeModel {
+    std::unordered_map<std::string, uint64_t> ranks;
+
+    // Added tokens, which are split out before pre-tokenization, as HuggingFace does.
+    std::unordered_map<std::string, uint64_t> special_tokens;
+
+    // Pre-tokenizer pattern in RE2 syntax.
+    std::string pattern;
+};
+
+// Convert a HuggingFace tokenizer.json of a byte-level BPE model, e.g. GPT-2, Llama 3 or
+// Qwen2, into ranks, so that it's encoded by Tiktoken's engines.
+//
+// HuggingFace merges the adjacent pair with the lowest merge index, while Tiktoken merges
+// the adjacent pair whose concatenation has the lowest rank. Both are the same, if the
+// rank of a merged token is its merge index, so token ids are used as ranks, and they must
+// increase in merge order, which holds for models trained by byte-level BPE. Vocabulary
+// entries which no merge produces are never output by BPE, and they're dropped.
+//
+// Tiktoken outputs a piece which is a token as is, i.e. HuggingFace's `ignore_merges`.
+// If it's set, no vocabulary entry may be dropped, since HuggingFace outputs it for such a
+// piece. If not, HuggingFace merges the piece, which ends up with the same token only if
+// every token is the BPE of its own bytes, and that's checked instead.
+//
+// Only configs which keep that equivalence are accepted: no normalizer, a ByteLevel
+// pre-tokenizer optionally preceded by an isolated Split, no dropout, byte fallback or
+// subword affixes.
+//
+// NOTE: pieces are NOT the same as HuggingFace's for 2 or more whitespaces followed by
+// other text. Lookahead alternatives such as `\s+(?!\S)` are not supported by RE2, and
+// they're dropped, the same as the patterns of tiktoken encodings in the config. So the
+// whole run of whitespaces is one piece, while HuggingFace leaves its last whitespace to
+// the next piece, e.g. "a  b" is "a", "  ", "b" here, but "a", " ", " b" in HuggingFace.
+class HfBpeLoader {
+public:
+    static HfBpeModel load(const std::string &path) {
+        try {
+            return convert(Json::load(path));
+        } catch (const Error &e) {
+            throw Error("failed to load " + path + ": " + e.what());
+        }
+    }
+
+    static HfBpeModel convert(const Json &tokenizer) {
+        _check_unsupported(tokenizer);
+
+        const auto &model = tokenizer["model"];
+
+        HfBpeModel result;
+        result.pattern = _parse_pre_tokenizer(tokenizer["pre_tokenizer"]);
+
+        auto vocab = _parse_vocab(model["vocab"]);
+        result.ranks = _parse_merges(model["merges"], vocab);
+
+        if (tokenizer.contains("added_tokens")) {
+            result.special_tokens = _parse_added_tokens(tokenizer["added_tokens"], vocab, result.ranks);
+        }
+
+        if (_is_null_or(model, "ignore_merges", false)) {
+            _check_self_merges(result.ranks);
+        } else {
+            _check_no_dropped_tokens(vocab, result);
+        }
+
+        return result;
+    }
+
+    // GPT-2's map from bytes to printable characters, which are what tokenizer.json stores.
+    // Printable Latin-1 bytes map to themselves, and the others map to U+0100 onwards.
+    static const std::array<uint32_t, 256>& byte_to_unicode() {
+        static const auto table = []() {
+            std::array<uint32_t, 256> table{};
+            uint32_t next = 256;
+            for (uint32_t b = 0; b < 256; ++b) {
+                auto printable = (b >= '!' && b <= '~') || (b >= 0xA1 && b <= 0xAC) || (b >= 0xAE);
+                table[b] = printable ? b : next++;
+            }
+            return table;
+        }();
+
+        return table;
+    }
+
+private:
+    // The pre-tokenizer regex of GPT-2, which `ByteLevel` uses when `use_regex` is true.
+    static constexpr std::string_view GPT2_PATTERN =
+        R"('s|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+)";
+
+    static constexpr int NONE = -1;
+
+    static bool _is_null_or(const Json &conf, const std::string &key, bool expected) {
+        return !conf.contains(key) || conf[key].is_null() || conf[key].get<bool>() == expected;
+    }
+
+    static bool _is_null_or_empty(const Json &conf, const std::string &key) {
+        return !conf.contains(key) || conf[key].is_null() || conf[key].get<std::string>().empty();
+    }
+
+    static void _check_unsupported(const Json &tokenizer) {
+        if (tokenizer.contains("normalizer") && !tokenizer["normalizer"].is_null()) {
+            throw Error("normalizer is not supported");
+        }
+
+        const auto &model = tokenizer["model"];
+        if (model.contains("type") && model["type"].get<std::string>() != "BPE") {
+            throw Error("not a BPE model: " + model["type"].get<std::string>());
+        }
+
+        if (model.contains("dropout") && !model["dropout"].is_null()) {
+            throw Error("BPE dropout is not supported");
+        }
+
+        if (!_is_null_or(model, "byte_fallback", false)) {
+            throw Error("byte fallback is not supported");
+        }
+
+        if (!_is_null_or_empty(model, "continuing_subword_prefix")
+                || !_is_null_or_empty(model, "end_of_word_suffix")) {
+            throw Error("subword prefix or suffix is not supported");
+        }
+    }
+
+    static std::string _parse_pre_tokenizer(const Json &conf) {
+        if (conf.is_null()) {
+            throw Error("no pre-tokenizer, i.e. not a byte-level model");
+        }
+
+        std::vector<const Json*> steps;
+        if (conf["type"].get<std::string>() == "Sequence") {
+            for (const auto &step : conf["pretokenizers"].elements()) {
+                steps.push_back(&step);
+            }
+        } else {
+            steps.push_back(&conf);
+        }
+
+        if (steps.empty() || (*steps.back())["type"].get<std::string>() != "ByteLevel") {
+            throw Error("no ByteLevel pre-tokenizer");
+        }
+
+        // [Split], ByteLevel
+        std::string pattern;
+        for (std::size_t idx = 0; idx < steps.size(); ++idx) {
+            const auto &step = *steps[idx];
+            auto type = step["type"].get<std::string>();
+            auto last = (idx + 1 == steps.size());
+            if (type == "Split" && idx == 0 && !last) {
+                pattern = _parse_split(step);
+            } else if (type == "ByteLevel" && last) {
+                if (!_is_null_or(step, "add_prefix_space", false)) {
+                    throw Error("add_prefix_space is not supported");
+                }
+
+                auto use_regex = !step.contains("use_regex") || step["use_regex"].get<bool>();
+                if (use_regex == !pattern.empty()) {
+                    throw Error("there should be exactly one pre-tokenizer regex");
+                }
+
+                if (use_regex) {
+                    pattern = GPT2_PATTERN;
+                }
+            } else {
+                throw Error("unsupported pre-tokenizer: " + type);
+            }
+        }
+
+        return _to_re2_pattern(pattern);
+    }
+
+    static std::string _parse_split(const Json &split) {
+        if (split.contains("behavior") && split["behavior"].get<std::string>() != "Isolated") {
+            throw Error("unsupported split behavior: " + split["behavior"].get<std::string>());
+        }
+
+        if (!_is_null_or(split, "invert", false)) {
+            throw Error("inverted split is not supported");
+        }
+
+        const auto &pattern = split["pattern"];
+        if (pattern.contains("Regex")) {
+            return pattern["Regex"].get<std::string>();
+        }
+
+        return re2::RE2::QuoteMeta(pattern["String"].get<std::string>());
+    }
+
+    static std::string _to_re2_pattern(std::string pattern) {
+        for (std::string_view lookahead : {R"(|\s+(?!\S))", R"(\s+(?!\S)|)"}) {
+            for (auto pos = pattern.find(lookahead); pos != std::string::npos; pos = pattern.find(lookahead)) {
+                pattern.erase(pos, lookahead.size());
+            }
+        }
+
+        re2::RE2 regex(pattern, re2::RE2::Quiet);
+        if (!regex.ok()) {
+            throw Error("unsupported pre-tokenizer regex: " + regex.error());
+        }
+
+        return pattern;
+    }
+
+    // Map characters of tokenizer.json back to bytes.
+    static std::string _to_bytes(const std::string &token) {
+        static const auto table = []() {
+            std::array<int, 512> table;
+            table.fill(NONE);
+            const auto &chars = byte_to_unicode();
+            for (auto b = 0U; b < chars.size(); ++b) {
+                table[chars[b]] = static_cast<int>(b);
+            }
+            return table;
+        }();
+
+        std::string bytes;
+        bytes.reserve(token.size());
+        for (std::size_t pos = 0; pos < token.size(); ) {
+            // All characters of the map are below U+0800, i.e. 1 or 2 bytes in UTF-8.
+            auto c = static_cast<unsigned char>(token[pos]);
+            uint32_t cp = c;
+            if (c >= 0xC0 && c < 0xE0 && pos + 1 < token.size()) {
+                cp = ((c & 0x1F) << 6) | (static_cast<unsigned char>(token[pos + 1]) & 0x3F);
+                pos += 2;
+            } else if (c < 0x80) {
+                pos += 1;
+            } else {
+                throw Error("not a byte-level token: " + token);
+            }
+
+            if (cp >= table.size() || table[cp] == NONE) {
+                throw Error("not a byte-level token: " + token);
+            }
+            bytes.push_back(static_cast<char>(table[cp]));
+        }
+
+        return bytes;
+    }
+
+    static std::unordered_map<std::string, uint64_t> _parse_vocab(const Json &conf) {
+        std::unordered_map<std::string, uint64_t> vocab;
+        vocab.reserve(conf.items().size());
+        for (const auto &[token, id] : conf.items()) {
+            if (!vocab.emplace(_to_bytes(token), id.get<uint64_t>()).second) {
+                throw Error("duplicate token: " + token);
+            }
+        }
+
+        return vocab;
+    }
+
+    // Merges are either "a b" strings, or ["a", "b"] pairs in recent versions.
+    static std::pair<std::string, std::string> _parse_merge(const Json &merge) {
+        if (merge.is_string()) {
+            auto str = merge.get<std::string>();
+            auto pos = str.find(' ');
+            if (pos == std::string::npos || str.find(' ', pos + 1) != std::string::npos) {
+                throw Error("invalid merge: " + str);
+            }
+
+            return {_to_bytes(str.substr(0, pos)), _to_bytes(str.substr(pos + 1))};
+        }
+
+        if (merge.elements().size() != 2) {
+            throw Error("invalid merge");
+        }
+
+        return {_to_bytes(merge[0].get<std::string>()), _to_bytes(merge[1].get<std::string>())};
+    }
+
+    static std::unordered_map<std::string, uint64_t> _parse_merges(const Json &conf,
+            const std::unordered_map<std::string, uint64_t> &vocab) {
+        std::unordered_map<std::string, uint64_t> ranks;
+        for (auto b = 0; b < 256; ++b) {
+            std::string token(1, static_cast<char>(b));
+            auto iter = vocab.find(token);
+            if (iter == vocab.end()) {
+                throw Error("byte " + std::to_string(b) + " is not in the vocabulary");
+            }
+            ranks.emplace(token, iter->second);
+        }
+
+        std::optional<uint64_t> last_rank;
+        for (const auto &merge : conf.elements()) {
+            auto [left, right] = _parse_merge(merge);
+            if (ranks.find(left) == ranks.end() || ranks.find(right) == ranks.end()) {
+                throw Error("merge of unknown tokens: " + left + " " + right);
+            }
+
+            auto token = left + right;
+            auto iter = vocab.find(token);
+            if (iter == vocab.end()) {
+                throw Error("merged token is not in the vocabulary: " + token);
+            }
+
+            // Another pair of the same bytes merges into the same token. Tiktoken merges them
+            // at the priority of the first one.
+            if (!ranks.emplace(token, iter->second).second) {
+                continue;
+            }
+
+            if (last_rank && iter->second <= *last_rank) {
+                throw Error("token ids are not in merge order: " + token);
+            }
+            last_rank = iter->second;
+        }
+
+        return ranks;
+    }
+
+    static std::unordered_map<std::string, uint64_t> _parse_added_tokens(const Json &conf,
+            const std::unordered_map<std::string, uint64_t> &vocab,
+            std::unordered_map<std::string, uint64_t> &ranks) {
+        std::unordered_map<uint64_t, const std::string*> ids;
+        for (const auto &[token, rank] : ranks) {
+            ids.emplace(rank, &token);
+        }
+
+        std::unordered_map<std::string, uint64_t> special_tokens;
+        for (const auto &added : conf.elements()) {
+            if (!_is_null_or(added, "lstrip", false) || !_is_null_or(added, "rstrip", false)
+                    || !_is_null_or(added, "single_word", false)) {
+                throw Error("added token with lstrip, rstrip or single_word is not supported");
+            }
+
+            auto content = added["content"].get<std::string>();
+            auto id = added["id"].get<uint64_t>();
+
+            // Added tokens are often in the vocabulary as well, e.g. <|endoftext|> of GPT-2,
+            // and they're output as special tokens only.
+            auto iter = ids.find(id);
+            if (iter != ids.end()) {
+                auto vocab_iter = vocab.find(*iter->second);
+                if (*iter->second != content || vocab_iter == vocab.end() || vocab_iter->second != id) {
+                    throw Error("added token " + content + " conflicts with the vocabulary");
+                }
+                ranks.erase(content);
+                ids.erase(iter);
+            }
+
+            if (!special_tokens.emplace(std::move(content), id).second) {
+                throw Error("duplicate added token: " + added["content"].get<std::string>());
+            }
+        }
+
+        return special_tokens;
+    }
+
+    // Without `ignore_merges`, a piece which is a token is merged by HuggingFace, and the
+    // merges must end up with the token, as Tiktoken outputs it as is.
+    static void _check_self_merges(const std::unordered_map<std::string, uint64_t> &ranks) {
+        for (const auto &ele : ranks) {
+            const auto &token = ele.first;
+            if (token.size() > 1 && _merge(token, ranks) != 1) {
+                throw Error("ignore_merges is not set, but merges of token " + token
+                        + " don't end up with itself");
+            }
+        }
+    }
+
+    // Number of parts which BPE merges the bytes of a token into.
+    static std::size_t _merge(const std::string &token, const std::unordered_map<std::string, uint64_t> &ranks) {
+        std::vector<std::string> parts;
+        for (auto c : token) {
+            parts.emplace_back(1, c);
+        }
+
+        while (parts.size() > 1) {
+            auto min_idx = parts.size();
+            uint64_t min_rank = 0;
+            for (std::size_t idx = 0; idx + 1 < parts.size(); ++idx) {
+                auto iter = ranks.find(parts[idx] + parts[idx + 1]);
+                if (iter != ranks.end() && (min_idx == parts.size() || iter->second < min_rank)) {
+                    min_idx = idx;
+                    min_rank = iter->second;
+                }
+            }
+
+            if (min_idx == parts.size()) {
+                break;
+            }
+
+            parts[min_idx] += parts[min_idx + 1];
+            parts.erase(parts.begin() + min_idx + 1);
+        }
+
+        return parts.size();
+    }
+
+    // With `ignore_merges`, HuggingFace outputs a piece which is in the vocabulary as is,
+    // even if no merge produces it.
+    static void _check_no_dropped_tokens(const std::unordered_map<std::string, uint64_t> &vocab,
+            const HfBpeModel &model) {
+        std::unordered_set<uint64_t> special_ids;
+        for (const auto &ele : model.special_tokens) {
+            special_ids.insert(ele.second);
+        }
+
+        for (const auto &[token, id] : vocab) {
+            if (model.ranks.find(token) == model.ranks.end() && special_ids.count(id) == 0) {
+                throw Error("ignore_merges is set, but no merge produces token: " + token);
+            }
+        }
+    }
+};
+
+}
+
+#endif // end SEWENEW_TOKENIZER_HF_TOKENIZER_H
@@ -0,0 +1,507 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+#ifndef SEWENEW_TOKENIZER_JSON_H
+#define SEWENEW_TOKENIZER_JSON_H
+
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <variant>
+#include <vector>
+#include "sw/tokenizer/errors.h"
+
+namespace sw::tokenizer {
+
+// A strict RFC 8259 parser, which is just enough for config files such as HuggingFace's
+// tokenizer.json. Integers are kept as integers, and only numbers with a fraction or an
+// exponent are parsed as double.
+class Json {
+public:
+    using Object = std::map<std::string, Json>;
+    using Array = std::vector<Json>;
+
+private:
+    using Value = std::variant<std::monostate, Object, Array, std::string, bool, double, long long, unsigned long long>;
+
+    class Parser {
+    public:
+        explicit Parser(std::string_view input, std::size_t pos = 0) : _input(input), _pos(pos) {}
+
+        Json parse() {
+            auto value = _parse_value(0);
+            _skip_spaces();
+            if (_pos != _input.size()) {
+                _fail("trailing characters");
+            }
+
+            return value;
+        }
+
+        std::string parse_string() {
+            if (_pos >= _input.size() || _input[_pos] != '"') {
+                _fail("expect string");
+            }
+
+            return _parse_string();
+        }
+
+        std::size_t pos() const {
+            return _pos;
+        }
+
+    private:
+        // Nesting deeper than this is rejected, instead of overflowing the stack.
+        static constexpr std::size_t MAX_DEPTH = 512;
+
+        [[noreturn]] void _fail(const std::string &msg) const {
+            throw Error("invalid json: " + msg + " at offset " + std::to_string(_pos));
+        }
+
+        void _skip_spaces() {
+            while (_pos < _input.size()) {
+                auto c = _input[_pos];
+                if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+                    break;
+                }
+                ++_pos;
+            }
+        }
+
+        void _expect(std::string_view literal) {
+            if (_input.substr(_pos, literal.size()) != literal) {
+                _fail("expect " + std::string(literal));
+            }
+            _pos += literal.size();
+        }
+
+        Json _parse_value(std::size_t depth) {
+            if (depth > MAX_DEPTH) {
+                _fail("too deep");
+            }
+
+            _skip_spaces();
+            if (_pos == _input.size()) {
+                _fail("unexpected end");
+            }
+
+            Json value;
+            switch (_input[_pos]) {
+            case '{':
+                value._value = _parse_object(depth);
+                break;
+
+            case '[':
+                value._value = _parse_array(depth);
+                break;
+
+            case '"':
+                value._value = _parse_string();
+                break;
+
+            case 't':
+                _expect("true");
+                value._value = true;
+                break;
+
+            case 'f':
+                _expect("false");
+                value._value = false;
+                break;
+
+            case 'n':
+                _expect("null");
+                break;
+
+            default:
+                _parse_number(value);
+                break;
+            }
+
+            return value;
+        }
+
+        Object _parse_object(std::size_t depth) {
+            Object obj;
+            ++_pos;
+            _skip_spaces();
+            if (_pos < _input.size() && _input[_pos] == '}') {
+                ++_pos;
+                return obj;
+            }
+
+            while (true) {
+                _skip_spaces();
+                if (_pos == _input.size() || _input[_pos] != '"') {
+                    _fail("expect object key");
+                }
+
+                auto key = _parse_string();
+                _skip_spaces();
+                _expect(":");
+
+                // The last one wins, if keys are duplicated.
+                obj[std::move(key)] = _parse_value(depth + 1);
+
+                _skip_spaces();
+                if (_pos < _input.size() && _input[_pos] == ',') {
+                    ++_pos;
+                    continue;
+                }
+
+                _expect("}");
+                return obj;
+            }
+        }
+
+        Array _parse_array(std::size_t depth) {
+            Array arr;
+            ++_pos;
+            _skip_spaces();
+            if (_pos < _input.size() && _input[_pos] == ']') {
+                ++_pos;
+                return arr;
+            }
+
+            while (true) {
+                arr.push_back(_parse_value(depth + 1));
+
+                _skip_spaces();
+                if (_pos < _input.size() && _input[_pos] == ',') {
+                    ++_pos;
+                    continue;
+                }
+
+                _expect("]");
+                return arr;
+            }
+        }
+
+        std::string _parse_string() {
+            assert(_input[_pos] == '"');
+            ++_pos;
+
+            std::string str;
+            while (true) {
+                // Copy the run of plain characters in one go.
+                auto begin = _pos;
+                while (_pos < _input.size() && _input[_pos] != '"' && _input[_pos] != '\\') {
+                    if (static_cast<unsigned char>(_input[_pos]) < 0x20) {
+                        _fail("control character in string");
+                    }
+                    ++_pos;
+                }
+                str.append(_input.data() + begin, _pos - begin);
+
+                if (_pos == _input.size()) {
+                    _fail("unterminated string");
+                }
+
+                if (_input[_pos++] == '"') {
+                    return str;
+                }
+
+                if (_pos == _input.size()) {
+                    _fail("unterminated escape");
+                }
+
+                switch (_input[_pos++]) {
+                case '"': str.push_back('"'); break;
+                case '\\': str.push_back('\\'); break;
+                case '/': str.push_back('/'); break;
+                case 'b': str.push_back('\b'); break;
+                case 'f': str.push_back('\f'); break;
+                case 'n': str.push_back('\n'); break;
+                case 'r': str.push_back('\r'); break;
+                case 't': str.push_back('\t'); break;
+                case 'u': _append_code_point(str, _parse_unicode_escape()); break;
+                default: _fail("invalid escape");
+                }
+            }
+        }
+
+        // Parse XXXX of \uXXXX, and the low surrogate following a high one. RFC 8259 allows
+        // unpaired surrogates, which can't be encoded in UTF-8, and are replaced with U+FFFD.
+        uint32_t _parse_unicode_escape() {
+            auto cp = _parse_hex4();
+            if (cp >= 0xD800 && cp <= 0xDBFF && _input.substr(_pos, 2) == "\\u") {
+                auto pos = _pos;
+                _pos += 2;
+                auto low = _parse_hex4();
+                if (low >= 0xDC00 && low <= 0xDFFF) {
+                    return 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                }
+
+                // Not a low surrogate, which is parsed as the next escape.
+                _pos = pos;
+            }
+
+            if (cp >= 0xD800 && cp <= 0xDFFF) {
+                cp = 0xFFFD;
+            }
+
+            return cp;
+        }
+
+        uint32_t _parse_hex4() {
+            if (_input.size() - _pos < 4) {
+                _fail("truncated unicode escape");
+            }
+
+            uint32_t cp = 0;
+            for (auto idx = 0; idx < 4; ++idx) {
+                auto c = _input[_pos++];
+                cp <<= 4;
+                if (c >= '0' && c <= '9') {
+                    cp |= c - '0';
+                } else if (c >= 'a' && c <= 'f') {
+                    cp |= c - 'a' + 10;
+                } else if (c >= 'A' && c <= 'F') {
+                    cp |= c - 'A' + 10;
+                } else {
+                    _fail("invalid unicode escape");
+                }
+            }
+
+            return cp;
+        }
+
+        static void _append_code_point(std::string &str, uint32_t cp) {
+            if (cp < 0x80) {
+                str.push_back(static_cast<char>(cp));
+            } else if (cp < 0x800) {
+                str.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+                str.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+            } else if (cp < 0x10000) {
+                str.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+                str.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+                str.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+            } else {
+                str.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+                str.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+                str.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+                str.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+            }
+        }
+
+        void _parse_number(Json &value) {
+            auto begin = _pos;
+            auto digits = [this]() {
+                auto start = _pos;
+                while (_pos < _input.size() && _input[_pos] >= '0' && _input[_pos] <= '9') {
+                    ++_pos;
+                }
+                if (_pos == start) {
+                    _fail("invalid number");
+                }
+            };
+
+            auto negative = (_input[_pos] == '-');
+            if (negative) {
+                ++_pos;
+            }
+
+            if (_pos < _input.size() && _input[_pos] == '0') {
+                ++_pos;
+            } else {
+                digits();
+            }
+
+            auto integral = true;
+            if (_pos < _input.size() && _input[_pos] == '.') {
+                ++_pos;
+                digits();
+                integral = false;
+            }
+
+            if (_pos < _input.size() && (_input[_pos] == 'e' || _input[_pos] == 'E')) {
+                ++_pos;
+                if (_pos < _input.size() && (_input[_pos] == '+' || _input[_pos] == '-')) {
+                    ++_pos;
+                }
+                digits();
+                integral = false;
+            }
+
+            std::string num(_input.substr(begin, _pos - begin));
+            errno = 0;
+            char *end = nullptr;
+            if (integral && negative) {
+                value._value = std::strtoll(num.c_str(), &end, 10);
+            } else if (integral) {
+                value._value = std::strtoull(num.c_str(), &end, 10);
+            } else {
+                value._value = std::strtod(num.c_str(), &end);
+            }
+
+            if (errno == ERANGE) {
+                _fail("number out of range");
+            }
+        }
+
+        std::string_view _input;
+
+        std::size_t _pos = 0;
+    };
+
+public:
+    static Json parse(std::string_view input) {
+        return Parser(input).parse();
+    }
+
+    // Parse the string at `pos` of `input`, and move `pos` past its closing quote, for
+    // scanners which only decode part of a document.
+    static std::string parse_string(std::string_view input, std::size_t &pos) {
+        Parser parser(input, pos);
+        auto str = parser.parse_string();
+        pos = parser.pos();
+        return str;
+    }
+
+    static Json load(const std::string &path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            throw Error("failed to open file: " + path);
+        }
+
+        std::stringstream ss;
+        ss << file.rdbuf();
+        return parse(ss.str());
+    }
+
+    Json() : _value(std::monostate{}) {}
+
+    bool is_null() const {
+        return std::holds_alternative<std::monostate>(_value);
+    }
+
+    bool is_object() const {
+        return std::holds_alternative<Object>(_value);
+    }
+
+    bool is_array() const {
+        return std::holds_alternative<Array>(_value);
+    }
+
+    bool is_string() const {
+        return std::holds_alternative<std::string>(_value);
+    }
+
+    template <typename T, typename std::enable_if<std::is_same<typename std::decay<T>::type, std::string>::value, int>::type = 0>
+    T get() const {
+        if (const auto *p = std::get_if<std::string>(&_value)) {
+            return *p;
+        } else {
+            throw Error("type mismatch");
+        }
+    }
+
+    template <typename T, typename std::enable_if<std::is_same<typename std::decay<T>::type, bool>::value, int>::type = 0>
+    T get() const {
+        if (const auto *p = std::get_if<bool>(&_value)) {
+            return *p;
+        } else {
+            throw Error("type mismatch");
+        }
+    }
+
+    template <typename T, typename std::enable_if<std::is_integral<typename std::decay<T>::type>::value
+        && !std::is_same<typename std::decay<T>::type, bool>::value, int>::type = 0>
+    T get() const {
+        if (const auto *p = std::get_if<unsigned long long>(&_value)) {
+            return static_cast<T>(*p);
+        } else if (const auto *p = std::get_if<long long>(&_value)) {
+            return static_cast<T>(*p);
+        } else {
+            throw Error("type mismatch");
+        }
+    }
+
+    template <typename T, typename std::enable_if<std::is_floating_point<typename std::decay<T>::type>::value, int>::type = 0>
+    T get() const {
+        if (const auto *p = std::get_if<double>(&_value)) {
+            return static_cast<T>(*p);
+        } else if (const auto *p = std::get_if<unsigned long long>(&_value)) {
+            return static_cast<T>(*p);
+        } else if (const auto *p = std::get_if<long long>(&_value)) {
+            return static_cast<T>(*p);
+        } else {
+            throw Error("type mismatch");
+        }
+    }
+
+    bool contains(const std::string &key) const {
+        if (auto *p = std::get_if<Object>(&_value)) {
+            return p->find(key) != p->end();
+        }
+
+        return false;
+    }
+
+    const Object& items() const {
+        if (const auto *p = std::get_if<Object>(&_value)) {
+            return *p;
+        } else {
+            throw Error("not an object");
+        }
+    }
+
+    const Array& elements() const {
+        if (const auto *p = std::get_if<Array>(&_value)) {
+            return *p;
+        } else {
+            throw Error("not an array");
+        }
+    }
+
+    const Json& operator[] (const std::string &key) const {
+        if (auto *p = std::get_if<Object>(&_value)) {
+            auto iter = p->find(key);
+            if (iter == p->end()) {
+                throw Error("key not exist: " + key);
+            }
+
+            return iter->second;
+        } else {
+            throw Error("not an object");
+        }
+    }
+
+    const Json& operator[] (std::size_t idx) const {
+        const auto &arr = elements();
+        if (idx >= arr.size()) {
+            throw Error("index out of range");
+        }
+
+        return arr[idx];
+    }
+
+private:
+    friend class Parser;
+
+    Value _value;
+};
+
+}
+
+#endif // end SEWENEW_TOKENIZER_JSON_H
@@ -0,0 +1,371 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+#ifndef SEWENEW_TOKENIZER_PACKER_H
+#define SEWENEW_TOKENIZER_PACKER_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <vector>
+#include "sw/tokenizer/errors.h"
+
+namespace sw::tokenizer {
+
+// How documents are packed into sequences. A document always includes its separator.
+enum class PackPolicy {
+    // Concatenate documents, and cut them into sequences, i.e. no padding except the
+    // last sequence, but documents might be split across sequences.
+    CONCAT = 0,
+
+    // Put each document into the open sequence with the least room that fits it.
+    // Documents longer than a sequence are split, and the remainder is packed.
+    BEST_FIT,
+
+    // One sequence per document, and the tail of a long document is dropped.
+    TRUNCATE,
+
+    // One or more sequences per document, i.e. a long document is split.
+    SPLIT
+};
+
+struct PackOptions {
+    // Number of tokens of a sequence, i.e. the context length.
+    std::size_t seq_len = 2048;
+
+    PackPolicy policy = PackPolicy::CONCAT;
+
+    // Token appended to each document, e.g. <|endoftext|>.
+    std::optional<uint64_t> separator;
+
+    // Token filling the unused tail of a sequence.
+    uint64_t pad = 0;
+
+    // Whether to output the document id of each token, e.g. for attention masks.
+    bool document_ids = false;
+
+    // Number of sequences passed to the callback at a time.
+    std::size_t batch_size = 64;
+
+    // Number of sequences kept open for PackPolicy::BEST_FIT. The more, the less padding.
+    std::size_t open_sequences = 64;
+};
+
+// A row major `rows` x `seq_len` matrix of sequences.
+struct PackedBatch {
+    const uint64_t *tokens = nullptr;
+
+    // Same shape as `tokens`. 1-based index of the document of each token in its sequence,
+    // or 0 for padding. It's null, unless `PackOptions::document_ids` is set.
+    const uint32_t *document_ids = nullptr;
+
+    std::size_t rows = 0;
+    std::size_t seq_len = 0;
+};
+
+struct PackStats {
+    std::size_t documents = 0;
+    std::size_t sequences = 0;
+    std::size_t padding = 0;
+
+    // Number of tokens dropped by PackPolicy::TRUNCATE.
+    std::size_t truncated = 0;
+};
+
+// Pack encoded documents into fixed-length sequences. Sequences are written into buffers
+// allocated once at construction, and passed to the callback in batches, so that adding
+// a document never allocates.
+class Packer {
+public:
+    // `batch` is overwritten by the next batch, copy it if needed.
+    using Callback = std::function<void (const PackedBatch &batch)>;
+
+    Packer(PackOptions opts, Callback callback) : _opts(opts), _callback(std::move(callback)) {
+        if (_opts.seq_len == 0) {
+            throw Error("sequence length must be positive");
+        }
+
+        if (_opts.batch_size == 0) {
+            throw Error("batch size must be positive");
+        }
+
+        if (_opts.policy == PackPolicy::BEST_FIT && _opts.open_sequences == 0) {
+            throw Error("number of open sequences must be positive");
+        }
+
+        if (!_callback) {
+            throw Error("null pack callback");
+        }
+
+        _tokens.resize(_opts.batch_size * _opts.seq_len);
+        if (_opts.document_ids) {
+            _document_ids.resize(_tokens.size());
+        }
+
+        if (_opts.policy == PackPolicy::BEST_FIT) {
+            _bins.resize(_opts.open_sequences);
+            _bin_tokens.resize(_opts.open_sequences * _opts.seq_len);
+            if (_opts.document_ids) {
+                _bin_ids.resize(_bin_tokens.size());
+            }
+        }
+    }
+
+    Packer(const Packer &) = delete;
+    Packer& operator=(const Packer &) = delete;
+
+    Packer(Packer &&) = delete;
+    Packer& operator=(Packer &&) = delete;
+
+    void add(const std::vector<uint64_t> &tokens) {
+        add(tokens.data(), tokens.size());
+    }
+
+    void add(const uint64_t *tokens, std::size_t size) {
+        if (_finished) {
+            throw Error("packer has been finished");
+        }
+
+        Document doc{tokens, size, size + (_opts.separator ? 1 : 0)};
+        if (doc.total == 0) {
+            return;
+        }
+
+        ++_stats.documents;
+        switch (_opts.policy) {
+        case PackPolicy::CONCAT:
+            _concat(doc);
+            break;
+
+        case PackPolicy::BEST_FIT:
+            _best_fit(doc);
+            break;
+
+        case PackPolicy::TRUNCATE:
+            _stats.truncated += doc.total - std::min(doc.total, _opts.seq_len);
+            _write_row(doc, 0, std::min(doc.total, _opts.seq_len));
+            break;
+
+        case PackPolicy::SPLIT:
+            for (std::size_t pos = 0; pos < doc.total; pos += _opts.seq_len) {
+                _write_row(doc, pos, std::min(doc.total - pos, _opts.seq_len));
+            }
+            break;
+
+        default:
+            assert(false);
+        }
+    }
+
+    // Pad and emit partially filled sequences.
+    void finish() {
+        if (_finished) {
+            return;
+        }
+
+        _finished = true;
+        if (_row_size > 0) {
+            _close_row();
+        }
+
+        for (std::size_t idx = 0; idx < _bins.size(); ++idx) {
+            if (_bins[idx].size > 0) {
+                _close_bin(idx);
+            }
+        }
+
+        if (_rows > 0) {
+            _emit();
+        }
+    }
+
+    const PackStats& stats() const {
+        return _stats;
+    }
+
+private:
+    struct Document {
+        const uint64_t *tokens;
+        std::size_t size;
+
+        // Size including the separator.
+        std::size_t total;
+    };
+
+    struct Bin {
+        std::size_t size = 0;
+        uint32_t documents = 0;
+    };
+
+    // Copy [begin, begin + cnt) of the document, whose last token is the separator.
+    void _copy(const Document &doc, std::size_t begin, std::size_t cnt,
+            uint64_t *tokens, uint32_t *ids, uint32_t id) const {
+        auto body = begin < doc.size ? std::min(cnt, doc.size - begin) : 0;
+        std::copy_n(doc.tokens + begin, body, tokens);
+        if (body < cnt) {
+            assert(_opts.separator && cnt - body == 1);
+            tokens[body] = *_opts.separator;
+        }
+
+        if (ids != nullptr) {
+            std::fill_n(ids, cnt, id);
+        }
+    }
+
+    uint64_t* _row_tokens() {
+        return _tokens.data() + _rows * _opts.seq_len;
+    }
+
+    uint32_t* _row_ids() {
+        return _opts.document_ids ? _document_ids.data() + _rows * _opts.seq_len : nullptr;
+    }
+
+    void _concat(const Document &doc) {
+        for (std::size_t pos = 0; pos < doc.total; ) {
+            auto cnt = std::min(doc.total - pos, _opts.seq_len - _row_size);
+            auto *ids = _row_ids();
+            _copy(doc, pos, cnt, _row_tokens() + _row_size,
+                    ids == nullptr ? nullptr : ids + _row_size, ++_row_documents);
+            _row_size += cnt;
+            pos += cnt;
+
+            if (_row_size == _opts.seq_len) {
+                _close_row();
+            }
+        }
+    }
+
+    void _best_fit(const Document &doc) {
+        // Full sequences of a long document need no packing.
+        std::size_t pos = 0;
+        for (; doc.total - pos >= _opts.seq_len; pos += _opts.seq_len) {
+            _write_row(doc, pos, _opts.seq_len);
+        }
+
+        auto cnt = doc.total - pos;
+        if (cnt == 0) {
+            return;
+        }
+
+        // There're a few open sequences, so a linear scan is cheaper than a tree.
+        auto best = _bins.size();
+        auto fullest = std::size_t(0);
+        for (std::size_t idx = 0; idx < _bins.size(); ++idx) {
+            auto room = _opts.seq_len - _bins[idx].size;
+            if (room >= cnt && (best == _bins.size() || room < _opts.seq_len - _bins[best].size)) {
+                best = idx;
+            }
+
+            if (_bins[idx].size > _bins[fullest].size) {
+                fullest = idx;
+            }
+        }
+
+        if (best == _bins.size()) {
+            // No room for it, so make room by closing the fullest sequence.
+            _close_bin(fullest);
+            best = fullest;
+        }
+
+        auto &bin = _bins[best];
+        auto offset = best * _opts.seq_len + bin.size;
+        _copy(doc, pos, cnt, _bin_tokens.data() + offset,
+                _opts.document_ids ? _bin_ids.data() + offset : nullptr, ++bin.documents);
+        bin.size += cnt;
+
+        if (bin.size == _opts.seq_len) {
+            _close_bin(best);
+        }
+    }
+
+    void _close_bin(std::size_t idx) {
+        auto &bin = _bins[idx];
+        assert(bin.size > 0 && _row_size == 0);
+
+        std::copy_n(_bin_tokens.data() + idx * _opts.seq_len, bin.size, _row_tokens());
+        if (auto *ids = _row_ids(); ids != nullptr) {
+            std::copy_n(_bin_ids.data() + idx * _opts.seq_len, bin.size, ids);
+        }
+
+        _row_size = bin.size;
+        bin = Bin{};
+        _close_row();
+    }
+
+    void _write_row(const Document &doc, std::size_t begin, std::size_t cnt) {
+        assert(_row_size == 0 && cnt <= _opts.seq_len);
+
+        _copy(doc, begin, cnt, _row_tokens(), _row_ids(), 1);
+        _row_size = cnt;
+        _close_row();
+    }
+
+    // Pad the current row, and move to the next one.
+    void _close_row() {
+        auto padding = _opts.seq_len - _row_size;
+        std::fill_n(_row_tokens() + _row_size, padding, _opts.pad);
+        if (auto *ids = _row_ids(); ids != nullptr) {
+            std::fill_n(ids + _row_size, padding, 0);
+        }
+
+        _stats.padding += padding;
+        ++_stats.sequences;
+
+        _row_size = 0;
+        _row_documents = 0;
+        if (++_rows == _opts.batch_size) {
+            _emit();
+        }
+    }
+
+    void _emit() {
+        PackedBatch batch;
+        batch.tokens = _tokens.data();
+        batch.document_ids = _opts.document_ids ? _document_ids.data() : nullptr;
+        batch.rows = _rows;
+        batch.seq_len = _opts.seq_len;
+
+        _rows = 0;
+        _callback(batch);
+    }
+
+    PackOptions _opts;
+
+    Callback _callback;
+
+    // Output sequences, of which the first `_rows` ones are complete, and the next one
+    // has `_row_size` tokens of `_row_documents` documents.
+    std::vector<uint64_t> _tokens;
+    std::vector<uint32_t> _document_ids;
+    std::size_t _rows = 0;
+    std::size_t _row_size = 0;
+    uint32_t _row_documents = 0;
+
+    // Open sequences of PackPolicy::BEST_FIT.
+    std::vector<Bin> _bins;
+    std::vector<uint64_t> _bin_tokens;
+    std::vector<uint32_t> _bin_ids;
+
+    PackStats _stats;
+
+    bool _finished = false;
+};
+
+}
+
+#endif // end SEWENEW_TOKENIZER_PACKER_H
@@ -0,0 +1,576 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+#ifndef SEWENEW_TOKENIZER_PIECE_SCANNER_H
+#define SEWENEW_TOKENIZER_PIECE_SCANNER_H
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <string_view>
+
+namespace sw::tokenizer {
+
+// Split text into pieces of the bundled pre-tokenizer patterns without running the
+// regex, for `Tiktoken::estimate_tokens`.
+//
+// On ASCII text, pieces are exactly those of the regex. Non-ASCII bytes need Unicode
+// classes, so the piece before a non-ASCII byte, and the bytes after it until a space
+// after a non-whitespace byte, which always begins a piece, are reported as foreign
+// pieces, which might cover several real pieces, or parts of them.
+//
+// The scan is a DFA, whose table entries also tell where pieces end, so that there's no
+// data dependent branch per byte. Since each byte waits for the state of the previous
+// one, text is split into lanes at spaces after non-whitespace bytes, and lanes are
+// scanned in lockstep.
+class PieceScanner {
+public:
+    // Patterns are compared as is, since the DFA only works for these ones.
+    static constexpr std::string_view CL100K_PATTERN =
+        R"((?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+)";
+
+    static constexpr std::string_view GPT2_PATTERN =
+        R"('s|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+)";
+
+    PieceScanner() = default;
+
+    explicit PieceScanner(std::string_view pattern) {
+        if (pattern == CL100K_PATTERN) {
+            _table = _cl100k_table().data();
+        } else if (pattern == GPT2_PATTERN) {
+            _table = _gpt2_table().data();
+        }
+    }
+
+    // If it's disabled, the caller should run the regex instead.
+    bool enabled() const {
+        return _table != nullptr;
+    }
+
+    // Call `func(piece, foreign)` for each piece of `text`. Lanes take turns to report
+    // pieces of a block, so pieces are NOT in text order.
+    template <typename Func>
+    void scan(std::string_view text, Func &&func) const {
+        assert(enabled());
+
+        std::array<Lane, LANES> lanes;
+        std::size_t begin = 0;
+        for (std::size_t idx = 0; idx < LANES; ++idx) {
+            auto end = (idx + 1 == LANES) ? text.size() :
+                _resync_point(text, std::max(begin, text.size() / LANES * (idx + 1)));
+            lanes[idx].data = text.data() + begin;
+            lanes[idx].size = end - begin;
+            begin = end;
+        }
+
+        // The last end might be taken back by the next byte, so it's kept, until the
+        // lane finishes.
+        auto flush = [&func](Lane &lane, bool finish) {
+            auto *end = lane.out_end;
+            if (!finish && end != lane.out.data()) {
+                --end;
+            }
+
+            // Locals, since `func` might write to anything the lane points to.
+            const auto *data = lane.data;
+            auto last_byte = lane.size - 1;
+            auto last = lane.last;
+            for (const auto *iter = lane.out.data(); iter != end; ++iter) {
+                auto pos = static_cast<std::size_t>(*iter);
+                assert(pos > last);
+                func(std::string_view(data + last, pos - last), _is_foreign(data, last, std::min(pos, last_byte)));
+                last = pos;
+            }
+            lane.last = last;
+
+            lane.out[0] = *end;
+            lane.out_end = lane.out.data() + (lane.out_end - end);
+        };
+
+        // All lanes are at the same position, until the shortest one finishes.
+        auto common = lanes[0].size;
+        for (const auto &lane : lanes) {
+            common = std::min(common, lane.size);
+        }
+
+        static_assert(LANES == 4, "lanes are unrolled by hand");
+        for (std::size_t pos = 0; pos < common; ) {
+            auto end = std::min(pos + BLOCK, common);
+
+            // Copy lanes into locals, so that they're kept in registers.
+            auto lane0 = _Cursor(lanes[0]);
+            auto lane1 = _Cursor(lanes[1]);
+            auto lane2 = _Cursor(lanes[2]);
+            auto lane3 = _Cursor(lanes[3]);
+            for (; pos < end; ++pos) {
+                _step(lane0, pos);
+                _step(lane1, pos);
+                _step(lane2, pos);
+                _step(lane3, pos);
+            }
+            lane0.save(lanes[0]);
+            lane1.save(lanes[1]);
+            lane2.save(lanes[2]);
+            lane3.save(lanes[3]);
+
+            for (auto &lane : lanes) {
+                flush(lane, false);
+            }
+        }
+
+        for (auto &lane : lanes) {
+            for (auto pos = common; pos < lane.size; ) {
+                auto end = std::min(pos + BLOCK, lane.size);
+                auto cursor = _Cursor(lane);
+                for (; pos < end; ++pos) {
+                    _step(cursor, pos);
+                }
+                cursor.save(lane);
+                flush(lane, false);
+            }
+
+            auto cursor = _Cursor(lane);
+            _emit(cursor, _table[END_ENTRIES + _row(lane.entry) / 256], lane.size);
+            cursor.save(lane);
+            flush(lane, true);
+        }
+    }
+
+private:
+    // Byte classes. Letters are split further for contractions, i.e. 's, 't, 'm, 'd,
+    // 're, 've and 'll. Note that RE2's \s is ASCII only, without \v.
+    enum Class : uint8_t {
+        // Letters other than the following ones.
+        LETTER = 0,
+        // s, t, m and d
+        LETTER_STMD,
+        // r and v
+        LETTER_RV,
+        LETTER_L,
+        LETTER_E,
+        DIGIT,
+        // ' '
+        SPACE,
+        // '\t' and '\f'
+        OTHER_SPACE,
+        // '\r' and '\n'
+        NEWLINE,
+        // Punctuations other than '\''
+        PUNCT,
+        QUOTE,
+        NON_ASCII,
+        // Not a byte, but the end of a lane.
+        END,
+        NUM_CLASSES
+    };
+
+    // What the current piece is, and what it has seen.
+    enum State : uint16_t {
+        // Beginning of a lane.
+        START = 0,
+        LETTERS,
+        // A contraction, which ends here.
+        CONTRACTION,
+        // A quote which begins a piece, followed by 'r' or 'v', or by 'l'.
+        QUOTE_START,
+        QUOTE_RV,
+        QUOTE_L,
+        // A punctuation which begins a piece, and might be a prefix of letters.
+        PUNCT_START,
+        PUNCTS,
+        // Newlines after punctuations.
+        PUNCT_NEWLINES,
+        DIGIT_1,
+        DIGIT_2,
+        DIGIT_3,
+        DIGITS,
+        // Whitespaces without newline, i.e. a single ' ', a single '\t' or '\f', or more.
+        SPACE_1,
+        OTHER_SPACE_1,
+        SPACES,
+        // Whitespaces with newlines, and after the last newline, nothing, a single ' ',
+        // a single '\t' or '\f', or more.
+        NEWLINE_0,
+        NEWLINE_SPACE_1,
+        NEWLINE_OTHER_SPACE_1,
+        NEWLINE_SPACES,
+        // Foreign bytes, whose last byte is not a whitespace, or is one.
+        FOREIGN,
+        FOREIGN_SPACE,
+        NUM_STATES
+    };
+
+    enum class Family {
+        CL100K = 0,
+        GPT2
+    };
+
+    // A transition is the row of the next state, i.e. the state times STRIDE, and the
+    // following flags.
+    static constexpr std::size_t STRIDE = 16;
+    static_assert(NUM_CLASSES <= STRIDE, "too many classes");
+    static_assert(NUM_STATES * STRIDE <= (1U << 9), "too many states");
+
+    static constexpr uint16_t STATE_MASK = (1U << 9) - 1;
+
+    // A piece ends before the current byte.
+    static constexpr uint16_t CUT = 1U << 9;
+
+    // The previous byte was cut before, since a piece might end there. It doesn't.
+    static constexpr uint16_t RETRACT = 1U << 10;
+
+    using Classes = std::array<uint8_t, 256>;
+
+    using Transitions = std::array<uint16_t, NUM_STATES * STRIDE>;
+
+    // Transitions are expanded to a table indexed by the row of the current state, i.e.
+    // the state times 256, ORed with the current byte, so that there's no lookup of the
+    // class. Transitions at the end of a lane follow the rows. A table entry is the row
+    // of the next state shifted by 8 bits, and the number of ends to append in its lowest
+    // byte, i.e. 1 for CUT, and -1 for RETRACT. So the next row is a shift away, which is
+    // on the critical path of each lane.
+
+    static constexpr std::size_t END_ENTRIES = NUM_STATES * 256;
+
+    using Table = std::array<uint32_t, END_ENTRIES + NUM_STATES>;
+
+    static constexpr std::size_t LANES = 4;
+
+    static constexpr std::size_t BLOCK = 256;
+
+    struct Lane {
+        const char *data = nullptr;
+        std::size_t size = 0;
+
+        // Beginning of the current piece.
+        std::size_t last = 0;
+
+        uint32_t entry = START * 256 << 8;
+
+        // Ends of pieces in the current block, and the last end of the previous block.
+        // The slot after the last end is always written, even if it's not appended.
+        std::array<uint64_t, BLOCK + 2> out;
+        uint64_t *out_end = out.data();
+    };
+
+    static constexpr Classes _build_classes(Family family) {
+        Classes classes{};
+        for (std::size_t idx = 0; idx < classes.size(); ++idx) {
+            auto c = static_cast<char>(idx);
+            // Contractions are case insensitive for cl100k.
+            auto lower = (family == Family::CL100K && c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+            uint8_t cls = PUNCT;
+            if (idx >= 0x80) {
+                cls = NON_ASCII;
+            } else if (lower == 's' || lower == 't' || lower == 'm' || lower == 'd') {
+                cls = LETTER_STMD;
+            } else if (lower == 'r' || lower == 'v') {
+                cls = LETTER_RV;
+            } else if (lower == 'l') {
+                cls = LETTER_L;
+            } else if (lower == 'e') {
+                cls = LETTER_E;
+            } else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+                cls = LETTER;
+            } else if (c >= '0' && c <= '9') {
+                cls = DIGIT;
+            } else if (c == ' ') {
+                cls = SPACE;
+            } else if (c == '\t' || c == '\f') {
+                cls = OTHER_SPACE;
+            } else if (c == '\r' || c == '\n') {
+                cls = NEWLINE;
+            } else if (c == '\'') {
+                cls = QUOTE;
+            }
+            classes[idx] = cls;
+        }
+
+        return classes;
+    }
+
+    static constexpr bool _is_letter(std::size_t cls) {
+        return cls <= LETTER_E;
+    }
+
+    static constexpr uint16_t _go(State state, uint16_t flags = 0) {
+        return static_cast<uint16_t>(state * STRIDE) | flags;
+    }
+
+    // State of a piece which begins with a byte of `cls`.
+    static constexpr uint16_t _begin(Family family, std::size_t cls) {
+        auto cl100k = (family == Family::CL100K);
+        if (_is_letter(cls)) {
+            return _go(LETTERS);
+        }
+
+        switch (cls) {
+        case DIGIT:
+            return _go(cl100k ? DIGIT_1 : DIGITS);
+
+        case SPACE:
+            return _go(SPACE_1);
+
+        case OTHER_SPACE:
+            return _go(cl100k ? OTHER_SPACE_1 : SPACES);
+
+        case NEWLINE:
+            return _go(cl100k ? NEWLINE_0 : SPACES);
+
+        case PUNCT:
+            return _go(cl100k ? PUNCT_START : PUNCTS);
+
+        case QUOTE:
+            return _go(QUOTE_START);
+
+        case NON_ASCII:
+            return _go(FOREIGN);
+
+        default:
+            return _go(START);
+        }
+    }
+
+    // The current piece ends, and another one begins with a byte of `cls`.
+    static constexpr uint16_t _cut(Family family, std::size_t cls) {
+        if (cls == END) {
+            return CUT;
+        }
+
+        return _begin(family, cls) | CUT;
+    }
+
+    static constexpr void _set(Transitions &table, State state, std::size_t cls, uint16_t transition) {
+        table[state * STRIDE + cls] = transition;
+    }
+
+    static constexpr Transitions _build_transitions(Family family) {
+        Transitions table{};
+        for (std::size_t state = 0; state < NUM_STATES; ++state) {
+            for (std::size_t cls = 0; cls < NUM_CLASSES; ++cls) {
+                table[state * STRIDE + cls] = _cut(family, cls);
+            }
+        }
+
+        for (std::size_t cls = 0; cls < NUM_CLASSES; ++cls) {
+            auto space = (cls == SPACE || cls == OTHER_SPACE);
+            auto whitespace = (space || cls == NEWLINE);
+
+            _set(table, START, cls, cls == END ? 0 : _begin(family, cls));
+
+            // Resync at spaces after non-whitespace bytes.
+            auto foreign = (cls == END) ? CUT : _go(whitespace ? FOREIGN_SPACE : FOREIGN);
+            _set(table, FOREIGN, cls, space ? _cut(family, cls) : foreign);
+            _set(table, FOREIGN_SPACE, cls, foreign);
+
+            if (_is_letter(cls)) {
+                _set(table, LETTERS, cls, _go(LETTERS));
+                _set(table, SPACE_1, cls, _go(LETTERS));
+            }
+        }
+
+        _set(table, DIGITS, DIGIT, _go(DIGITS));
+        _set(table, PUNCTS, PUNCT, _go(PUNCTS));
+        _set(table, PUNCTS, QUOTE, _go(PUNCTS));
+
+        _set(table, QUOTE_START, LETTER_STMD, _go(CONTRACTION));
+        _set(table, QUOTE_START, LETTER_RV, _go(QUOTE_RV));
+        _set(table, QUOTE_START, LETTER_L, _go(QUOTE_L));
+        _set(table, QUOTE_START, PUNCT, _go(PUNCTS));
+        _set(table, QUOTE_START, QUOTE, _go(PUNCTS));
+
+        _set(table, SPACE_1, PUNCT, _go(PUNCTS));
+        _set(table, SPACE_1, QUOTE, _go(PUNCTS));
+        for (auto state : {SPACE_1, SPACES}) {
+            _set(table, state, SPACE, _go(SPACES));
+            _set(table, state, OTHER_SPACE, _go(SPACES));
+        }
+
+        if (family == Family::CL100K) {
+            _build_cl100k(table);
+        } else {
+            _build_gpt2(table);
+        }
+
+        return table;
+    }
+
+    // (?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+
+    static constexpr void _build_cl100k(Transitions &table) {
+        for (std::size_t cls = 0; cls < NUM_CLASSES; ++cls) {
+            if (_is_letter(cls)) {
+                // Letters after a quote, which is not a contraction, or after a punctuation,
+                // or a single whitespace, which begins a piece.
+                if (cls == LETTER || cls == LETTER_E) {
+                    _set(table, QUOTE_START, cls, _go(LETTERS));
+                }
+                _set(table, QUOTE_RV, cls, _go(cls == LETTER_E ? CONTRACTION : LETTERS));
+                _set(table, QUOTE_L, cls, _go(cls == LETTER_L ? CONTRACTION : LETTERS));
+                _set(table, PUNCT_START, cls, _go(LETTERS));
+                _set(table, OTHER_SPACE_1, cls, _go(LETTERS));
+            }
+        }
+
+        _set(table, QUOTE_START, NEWLINE, _go(PUNCT_NEWLINES));
+        for (auto state : {PUNCT_START, PUNCTS}) {
+            _set(table, state, PUNCT, _go(PUNCTS));
+            _set(table, state, QUOTE, _go(PUNCTS));
+            _set(table, state, NEWLINE, _go(PUNCT_NEWLINES));
+        }
+        _set(table, PUNCT_NEWLINES, NEWLINE, _go(PUNCT_NEWLINES));
+
+        _set(table, DIGIT_1, DIGIT, _go(DIGIT_2));
+        _set(table, DIGIT_2, DIGIT, _go(DIGIT_3));
+
+        _set(table, OTHER_SPACE_1, SPACE, _go(SPACES));
+        _set(table, OTHER_SPACE_1, OTHER_SPACE, _go(SPACES));
+
+        // Whitespaces with newlines end at the last newline, and the following spaces
+        // are the same as whitespaces without newline. So they're cut before the first
+        // space after a newline, and the cut is taken back by another newline.
+        for (std::size_t cls = 0; cls < NUM_CLASSES; ++cls) {
+            _set(table, NEWLINE_SPACE_1, cls, table[SPACE_1 * STRIDE + cls]);
+            _set(table, NEWLINE_OTHER_SPACE_1, cls, table[OTHER_SPACE_1 * STRIDE + cls]);
+            _set(table, NEWLINE_SPACES, cls, table[SPACES * STRIDE + cls]);
+        }
+
+        _set(table, NEWLINE_0, SPACE, _go(NEWLINE_SPACE_1, CUT));
+        _set(table, NEWLINE_0, OTHER_SPACE, _go(NEWLINE_OTHER_SPACE_1, CUT));
+        for (auto state : {NEWLINE_SPACE_1, NEWLINE_OTHER_SPACE_1, NEWLINE_SPACES}) {
+            _set(table, state, SPACE, _go(NEWLINE_SPACES));
+            _set(table, state, OTHER_SPACE, _go(NEWLINE_SPACES));
+            _set(table, state, NEWLINE, _go(NEWLINE_0, RETRACT));
+        }
+
+        for (auto state : {SPACE_1, OTHER_SPACE_1, SPACES, NEWLINE_0}) {
+            _set(table, state, NEWLINE, _go(NEWLINE_0));
+        }
+    }
+
+    // 's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+
+    static constexpr void _build_gpt2(Transitions &table) {
+        // A quote followed by 'r', 'v' or 'l' is a piece on its own, and the letter begins
+        // another one, unless it's a contraction.
+        _set(table, QUOTE_START, LETTER_RV, _go(QUOTE_RV, CUT));
+        _set(table, QUOTE_START, LETTER_L, _go(QUOTE_L, CUT));
+        for (std::size_t cls = 0; cls < NUM_CLASSES; ++cls) {
+            auto transition = _is_letter(cls) ? _go(LETTERS) : _cut(Family::GPT2, cls);
+            _set(table, QUOTE_RV, cls, transition);
+            _set(table, QUOTE_L, cls, transition);
+        }
+        _set(table, QUOTE_RV, LETTER_E, _go(CONTRACTION, RETRACT));
+        _set(table, QUOTE_L, LETTER_L, _go(CONTRACTION, RETRACT));
+
+        _set(table, SPACE_1, DIGIT, _go(DIGITS));
+        _set(table, SPACE_1, NEWLINE, _go(SPACES));
+        _set(table, SPACES, NEWLINE, _go(SPACES));
+    }
+
+    static constexpr uint32_t _expand(uint16_t transition) {
+        uint32_t ends = 0;
+        if (transition & CUT) {
+            ends = 1;
+        } else if (transition & RETRACT) {
+            ends = 0xff;
+        }
+
+        return static_cast<uint32_t>((transition & STATE_MASK) / STRIDE * 256) << 8 | ends;
+    }
+
+    static constexpr Table _build_table(Family family) {
+        auto classes = _build_classes(family);
+        auto transitions = _build_transitions(family);
+        Table table{};
+        for (std::size_t state = 0; state < NUM_STATES; ++state) {
+            for (std::size_t c = 0; c < 256; ++c) {
+                table[state * 256 + c] = _expand(transitions[state * STRIDE + classes[c]]);
+            }
+            table[END_ENTRIES + state] = _expand(transitions[state * STRIDE + END]);
+        }
+
+        return table;
+    }
+
+    static const Table& _cl100k_table() {
+        static constexpr auto table = _build_table(Family::CL100K);
+        return table;
+    }
+
+    static const Table& _gpt2_table() {
+        static constexpr auto table = _build_table(Family::GPT2);
+        return table;
+    }
+
+    static bool _is_whitespace(char c) {
+        return c == ' ' || c == '\t' || c == '\f' || c == '\r' || c == '\n';
+    }
+
+    // First space after a non-whitespace byte from `pos`, or the end.
+    static std::size_t _resync_point(std::string_view text, std::size_t pos) {
+        for (pos = std::max<std::size_t>(pos, 1); pos < text.size(); ++pos) {
+            auto c = text[pos];
+            if ((c == ' ' || c == '\t' || c == '\f') && !_is_whitespace(text[pos - 1])) {
+                return pos;
+            }
+        }
+
+        return text.size();
+    }
+
+    // A non-ASCII byte always begins a foreign piece, and ends the piece before it,
+    // which is then foreign too. So a piece is foreign if its first byte or the next
+    // one is non-ASCII. At the end of a lane, `next` is the last byte of the piece,
+    // which is only non-ASCII if the first one is, so that there's no branch.
+    static bool _is_foreign(const char *data, std::size_t first, std::size_t next) {
+        return ((static_cast<unsigned char>(data[first]) | static_cast<unsigned char>(data[next])) & 0x80) != 0;
+    }
+
+    // Part of a lane which changes per byte.
+    struct _Cursor {
+        explicit _Cursor(const Lane &lane) : data(lane.data), entry(lane.entry), out_end(lane.out_end) {}
+
+        void save(Lane &lane) const {
+            lane.entry = entry;
+            lane.out_end = out_end;
+        }
+
+        const char *data;
+        uint32_t entry;
+        uint64_t *out_end;
+    };
+
+    static uint32_t _row(uint32_t entry) {
+        return entry >> 8;
+    }
+
+    void _step(_Cursor &cursor, std::size_t pos) const {
+        auto c = static_cast<unsigned char>(cursor.data[pos]);
+        _emit(cursor, _table[_row(cursor.entry) | c], pos);
+    }
+
+    static void _emit(_Cursor &cursor, uint32_t entry, std::size_t pos) {
+        *cursor.out_end = pos;
+        cursor.out_end += static_cast<int8_t>(entry & 0xff);
+        cursor.entry = entry;
+    }
+
+    const uint32_t *_table = nullptr;
+};
+
+}
+
+#endif // end SEWENEW_TOKENIZER_PIECE_SCANNER_H
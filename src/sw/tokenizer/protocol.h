@@ -0,0 +1,271 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+#ifndef SEWENEW_TOKENIZER_PROTOCOL_H
+#define SEWENEW_TOKENIZER_PROTOCOL_H
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "sw/tokenizer/errors.h"
+
+// Binary protocol between the tokenizer server and its clients. All integers are
+// little endian, and every frame starts with the size of the rest of the frame.
+//
+// Request:  u32 size | u32 id | u8 op | u8 flags | u8 encoding size | encoding | payload
+// Response: u32 size | u32 id | u8 status | payload
+//
+// Payload of ENCODE and COUNT requests is the text, and payload of DECODE requests
+// is an array of u32 tokens. Payload of a successful response is an array of u32 tokens
+// for ENCODE, the text for DECODE, and a u64 count for COUNT. Payload of a failed
+// response is the error message. Tokens which don't fit in u32, and responses larger than
+// MAX_FRAME_SIZE, are failed responses.
+namespace sw::tokenizer::protocol {
+
+enum class Op : uint8_t {
+    ENCODE = 1,
+    DECODE = 2,
+    COUNT = 3
+};
+
+enum class Status : uint8_t {
+    OK = 0,
+    ERROR = 1
+};
+
+// Encode with all special tokens allowed.
+constexpr uint8_t FLAG_ALLOW_SPECIAL = 1;
+
+constexpr uint32_t MAX_FRAME_SIZE = 64 * 1024 * 1024;
+
+// A response frame has a u32 id and a u8 status before the payload.
+constexpr std::size_t MAX_RESPONSE_PAYLOAD = MAX_FRAME_SIZE - 4 - 1;
+
+struct Request {
+    uint32_t id = 0;
+    Op op = Op::ENCODE;
+    uint8_t flags = 0;
+    std::string encoding;
+    std::string payload;
+};
+
+struct Response {
+    uint32_t id = 0;
+    Status status = Status::OK;
+    std::string payload;
+};
+
+inline void put_u32(std::string &buf, uint32_t val) {
+    for (auto idx = 0; idx < 4; ++idx) {
+        buf.push_back(static_cast<char>((val >> (idx * 8)) & 0xFF));
+    }
+}
+
+inline void put_u64(std::string &buf, uint64_t val) {
+    for (auto idx = 0; idx < 8; ++idx) {
+        buf.push_back(static_cast<char>((val >> (idx * 8)) & 0xFF));
+    }
+}
+
+inline uint32_t get_u32(const char *data) {
+    uint32_t val = 0;
+    for (auto idx = 0; idx < 4; ++idx) {
+        val |= static_cast<uint32_t>(static_cast<unsigned char>(data[idx])) << (idx * 8);
+    }
+    return val;
+}
+
+inline uint64_t get_u64(const char *data) {
+    uint64_t val = 0;
+    for (auto idx = 0; idx < 8; ++idx) {
+        val |= static_cast<uint64_t>(static_cast<unsigned char>(data[idx])) << (idx * 8);
+    }
+    return val;
+}
+
+template <typename Token>
+void put_tokens(std::string &buf, const std::vector<Token> &tokens) {
+    buf.reserve(buf.size() + tokens.size() * 4);
+    for (auto token : tokens) {
+        if (static_cast<uint64_t>(token) > UINT32_MAX) {
+            throw Error("token doesn't fit in u32: " + std::to_string(token));
+        }
+        put_u32(buf, static_cast<uint32_t>(token));
+    }
+}
+
+inline std::vector<uint64_t> get_tokens(std::string_view payload) {
+    if (payload.size() % 4 != 0) {
+        throw Error("invalid token array");
+    }
+
+    std::vector<uint64_t> tokens;
+    tokens.reserve(payload.size() / 4);
+    for (std::size_t pos = 0; pos < payload.size(); pos += 4) {
+        tokens.push_back(get_u32(payload.data() + pos));
+    }
+    return tokens;
+}
+
+// Append the serialized frame to `buf`.
+inline void serialize(const Request &req, std::string &buf) {
+    if (req.encoding.size() > 255) {
+        throw Error("encoding name is too long: " + req.encoding);
+    }
+
+    auto size = 4 + 1 + 1 + 1 + req.encoding.size() + req.payload.size();
+    if (size > MAX_FRAME_SIZE) {
+        throw Error("request is too large");
+    }
+
+    put_u32(buf, static_cast<uint32_t>(size));
+    put_u32(buf, req.id);
+    buf.push_back(static_cast<char>(req.op));
+    buf.push_back(static_cast<char>(req.flags));
+    buf.push_back(static_cast<char>(req.encoding.size()));
+    buf += req.encoding;
+    buf += req.payload;
+}
+
+inline void serialize(const Response &resp, std::string &buf) {
+    if (resp.payload.size() > MAX_RESPONSE_PAYLOAD) {
+        throw Error("response is too large");
+    }
+    auto size = 4 + 1 + resp.payload.size();
+
+    put_u32(buf, static_cast<uint32_t>(size));
+    put_u32(buf, resp.id);
+    buf.push_back(static_cast<char>(resp.status));
+    buf += resp.payload;
+}
+
+// `frame` doesn't include the leading size.
+inline Request parse_request(std::string_view frame) {
+    if (frame.size() < 7) {
+        throw Error("request frame is too short");
+    }
+
+    Request req;
+    req.id = get_u32(frame.data());
+    req.op = static_cast<Op>(frame[4]);
+    req.flags = static_cast<uint8_t>(frame[5]);
+    std::size_t encoding_size = static_cast<unsigned char>(frame[6]);
+    if (frame.size() < 7 + encoding_size) {
+        throw Error("invalid encoding size");
+    }
+    req.encoding = frame.substr(7, encoding_size);
+    req.payload = frame.substr(7 + encoding_size);
+
+    return req;
+}
+
+inline Response parse_response(std::string_view frame) {
+    if (frame.size() < 5) {
+        throw Error("response frame is too short");
+    }
+
+    Response resp;
+    resp.id = get_u32(frame.data());
+    resp.status = static_cast<Status>(frame[4]);
+    resp.payload = frame.substr(5);
+
+    return resp;
+}
+
+// Split a byte stream into frames.
+class FrameReader {
+public:
+    void append(const char *data, std::size_t size) {
+        _buf.append(data, size);
+    }
+
+    // Returns false if there's no complete frame yet. Throws if the stream is broken.
+    bool next(std::string &frame) {
+        if (_buf.size() - _pos < 4) {
+            _compact();
+            return false;
+        }
+
+        auto size = get_u32(_buf.data() + _pos);
+        if (size > MAX_FRAME_SIZE) {
+            throw Error("frame is too large");
+        }
+
+        if (_buf.size() - _pos - 4 < size) {
+            _compact();
+            return false;
+        }
+
+        frame.assign(_buf, _pos + 4, size);
+        _pos += 4 + size;
+
+        return true;
+    }
+
+    // Number of buffered bytes, which are not returned as frames yet.
+    std::size_t size() const {
+        return _buf.size() - _pos;
+    }
+
+private:
+    void _compact() {
+        if (_pos > 0) {
+            _buf.erase(0, _pos);
+            _pos = 0;
+        }
+    }
+
+    std::string _buf;
+
+    std::size_t _pos = 0;
+};
+
+inline void write_all(int fd, const char *data, std::size_t size) {
+    while (size > 0) {
+        auto n = ::send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw Error(std::string("failed to write socket: ") + std::strerror(errno));
+        }
+
+        data += n;
+        size -= static_cast<std::size_t>(n);
+    }
+}
+
+inline sockaddr_un make_address(const std::string &path) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw Error("socket path is too long: " + path);
+    }
+    std::memcpy(addr.sun_path, path.data(), path.size());
+
+    return addr;
+}
+
+}
+
+#endif // end SEWENEW_TOKENIZER_PROTOCOL_H
@@ -0,0 +1,589 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+#ifndef SEWENEW_TOKENIZER_SERVER_H
+#define SEWENEW_TOKENIZER_SERVER_H
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "sw/tokenizer/errors.h"
+#include "sw/tokenizer/protocol.h"
+#include "sw/tokenizer/tiktoken.h"
+
+namespace sw::tokenizer {
+
+struct ServerOptions {
+    // Path of the Unix domain socket.
+    std::string path;
+
+    // Number of worker threads. 0 means the number of hardware threads.
+    std::size_t workers = 0;
+
+    // A worker takes at most this number of requests at a time.
+    std::size_t max_batch = 64;
+
+    // At most this number of requests wait for workers. The IO thread stops reading
+    // requests while the queue is full.
+    std::size_t max_queue = 1024;
+
+    // The IO thread stops reading a connection while it buffers more than this number of
+    // bytes of requests not yet handled and responses not yet sent, e.g. its client pipelines
+    // requests without reading responses. A frame is always read in full, so a connection
+    // buffers at most this plus the size of a frame.
+    std::size_t max_connection_bytes = 16 * 1024 * 1024;
+};
+
+// Serve encode, decode and count requests over a Unix domain socket, see protocol.h.
+//
+// One IO thread reads frames from all connections, and queues the requests. Workers
+// take requests from the queue in batches, whose size adapts to the load: with a short
+// queue, a request is handled as soon as it arrives, and with a long queue, a worker
+// takes its share of it up to `max_batch`. Responses of a batch for the same connection
+// are appended to its output buffer at once, and the IO thread writes them without
+// blocking, so that a slow client never holds up a worker. The queue and the buffers of
+// a connection are bounded, see ServerOptions, and the IO thread stops reading while
+// they're full, which pushes back on clients.
+class TokenizerServer {
+public:
+    TokenizerServer(const TiktokenFactory &factory, ServerOptions opts) :
+        _factory(factory), _opts(std::move(opts)) {
+        if (_opts.workers == 0) {
+            _opts.workers = std::max(1U, std::thread::hardware_concurrency());
+        }
+
+        if (_opts.max_batch == 0) {
+            throw Error("max batch must be positive");
+        }
+
+        if (_opts.max_queue == 0 || _opts.max_connection_bytes == 0) {
+            throw Error("max queue and max connection bytes must be positive");
+        }
+
+        if (::pipe(_wakeup) != 0) {
+            throw Error(std::string("failed to create pipe: ") + std::strerror(errno));
+        }
+
+        try {
+            // Wakeups never block, and a full pipe wakes up the IO thread anyway.
+            _set_nonblocking(_wakeup[0]);
+            _set_nonblocking(_wakeup[1]);
+
+            _listen();
+        } catch (...) {
+            ::close(_wakeup[0]);
+            ::close(_wakeup[1]);
+            throw;
+        }
+    }
+
+    TokenizerServer(const TokenizerServer &) = delete;
+    TokenizerServer& operator=(const TokenizerServer &) = delete;
+
+    TokenizerServer(TokenizerServer &&) = delete;
+    TokenizerServer& operator=(TokenizerServer &&) = delete;
+
+    ~TokenizerServer() {
+        ::close(_listener);
+        ::unlink(_opts.path.c_str());
+        ::close(_wakeup[0]);
+        ::close(_wakeup[1]);
+    }
+
+    // Serve until `stop` is called.
+    void run() {
+        std::vector<std::thread> workers;
+        for (std::size_t idx = 0; idx < _opts.workers; ++idx) {
+            workers.emplace_back([this]() { _work(); });
+        }
+
+        try {
+            _poll();
+        } catch (...) {
+            _stop_workers(workers);
+            throw;
+        }
+
+        _stop_workers(workers);
+    }
+
+    // Safe to call from a signal handler.
+    void stop() {
+        _stopped = true;
+        _wake();
+    }
+
+private:
+    struct Connection {
+        explicit Connection(int sock) : fd(sock) {}
+
+        ~Connection() {
+            ::close(fd);
+        }
+
+        int fd;
+
+        // Only accessed by the IO thread.
+        protocol::FrameReader reader;
+
+        // Responses being written by the IO thread, and the number of bytes written.
+        std::string output;
+        std::size_t written = 0;
+
+        // Guard the members below, which are shared with workers.
+        std::mutex mutex;
+
+        // Responses from workers, which are moved to `output` by the IO thread.
+        std::string responses;
+
+        // Bytes of requests which are queued or being handled.
+        std::size_t handling = 0;
+    };
+
+    using ConnectionSPtr = std::shared_ptr<Connection>;
+
+    struct Task {
+        ConnectionSPtr connection;
+        protocol::Request request;
+
+        // Size of the request frame.
+        std::size_t size = 0;
+    };
+
+    static void _set_nonblocking(int fd) {
+        auto flags = ::fcntl(fd, F_GETFL, 0);
+        if (flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+            throw Error(std::string("failed to set non-blocking mode: ") + std::strerror(errno));
+        }
+    }
+
+    void _wake() {
+        char c = 0;
+        while (::write(_wakeup[1], &c, 1) < 0 && errno == EINTR) {}
+    }
+
+    void _listen() {
+        ::unlink(_opts.path.c_str());
+
+        _listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (_listener < 0) {
+            throw Error(std::string("failed to create socket: ") + std::strerror(errno));
+        }
+
+        auto addr = protocol::make_address(_opts.path);
+        if (::bind(_listener, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0
+                || ::listen(_listener, SOMAXCONN) != 0) {
+            auto err = std::string(std::strerror(errno));
+            ::close(_listener);
+            throw Error("failed to listen on " + _opts.path + ": " + err);
+        }
+    }
+
+    void _poll() {
+        std::unordered_map<int, ConnectionSPtr> connections;
+        std::vector<pollfd> fds;
+        std::vector<char> buf(64 * 1024);
+        std::vector<Task> tasks;
+        std::string frame;
+        while (true) {
+            // Cleared before collecting responses, so that workers responding after that
+            // wake up the IO thread again.
+            _woken = false;
+
+            for (auto iter = connections.begin(); iter != connections.end(); ) {
+                if (_flush(*iter->second)) {
+                    ++iter;
+                } else {
+                    // The peer has gone.
+                    iter = connections.erase(iter);
+                }
+            }
+
+            auto has_room = _dispatch(connections, tasks, frame);
+
+            fds.clear();
+            fds.push_back({_wakeup[0], POLLIN, 0});
+            fds.push_back({_listener, POLLIN, 0});
+            for (const auto &ele : connections) {
+                auto &connection = *ele.second;
+                short events = 0;
+                if (has_room && _readable(connection)) {
+                    events |= POLLIN;
+                }
+                if (connection.written < connection.output.size()) {
+                    events |= POLLOUT;
+                }
+                fds.push_back({ele.first, events, 0});
+            }
+
+            if (::poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw Error(std::string("failed to poll: ") + std::strerror(errno));
+            }
+
+            if (fds[0].revents != 0) {
+                _drain_wakeup();
+                if (_stopped) {
+                    break;
+                }
+            }
+
+            if ((fds[1].revents & POLLIN) != 0) {
+                auto fd = ::accept(_listener, nullptr, nullptr);
+                if (fd >= 0) {
+                    auto connection = std::make_shared<Connection>(fd);
+                    try {
+                        _set_nonblocking(fd);
+                        connections.emplace(fd, std::move(connection));
+                    } catch (const Error &) {
+                        // Give up the connection, which is closed by its destructor.
+                    }
+                }
+            }
+
+            for (auto idx = 2U; idx < fds.size(); ++idx) {
+                if (fds[idx].revents == 0) {
+                    continue;
+                }
+
+                auto iter = connections.find(fds[idx].fd);
+                assert(iter != connections.end());
+                auto &connection = iter->second;
+
+                if ((fds[idx].revents & POLLIN) == 0) {
+                    if ((fds[idx].revents & (POLLERR | POLLHUP | POLLNVAL)) != 0) {
+                        // Closed by peer, while not being read.
+                        connections.erase(iter);
+                    }
+
+                    // Otherwise, it's writable, and flushed in the next round.
+                    continue;
+                }
+
+                auto n = ::read(connection->fd, buf.data(), buf.size());
+                if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    continue;
+                }
+
+                if (n <= 0) {
+                    // Closed by peer. Pending responses are dropped with the connection.
+                    connections.erase(iter);
+                    continue;
+                }
+
+                connection->reader.append(buf.data(), static_cast<std::size_t>(n));
+            }
+        }
+    }
+
+    void _drain_wakeup() {
+        char buf[64];
+        while (true) {
+            auto n = ::read(_wakeup[0], buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (n <= 0) {
+                // EAGAIN, i.e. drained.
+                break;
+            }
+        }
+    }
+
+    // Queue frames which have been read, while the queue has room. Connections take turns,
+    // one frame at a time, so that pipelined requests of one connection don't take all
+    // the room. Returns whether the queue still has room.
+    bool _dispatch(std::unordered_map<int, ConnectionSPtr> &connections,
+            std::vector<Task> &tasks,
+            std::string &frame) {
+        std::size_t room = 0;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            // Only the IO thread pushes, and never over the limit.
+            assert(_queue.size() <= _opts.max_queue);
+            room = _opts.max_queue - _queue.size();
+        }
+
+        auto more = true;
+        while (room > 0 && more) {
+            more = false;
+            for (auto iter = connections.begin(); iter != connections.end() && room > 0; ) {
+                auto &connection = iter->second;
+                try {
+                    if (connection->reader.next(frame)) {
+                        auto request = protocol::parse_request(frame);
+                        {
+                            std::lock_guard<std::mutex> lock(connection->mutex);
+                            connection->handling += frame.size();
+                        }
+                        tasks.push_back({connection, std::move(request), frame.size()});
+                        --room;
+                        more = true;
+                    }
+                    ++iter;
+                } catch (const Error &) {
+                    // Broken stream, give up the connection.
+                    iter = connections.erase(iter);
+                }
+            }
+        }
+
+        if (!tasks.empty()) {
+            _push(tasks);
+            tasks.clear();
+        }
+
+        return room > 0;
+    }
+
+    // Whether to read more from the connection, i.e. it's not over its limit, or all it
+    // buffers is a partial frame, which must be read in full.
+    bool _readable(Connection &connection) {
+        auto pending = connection.output.size() - connection.written;
+        {
+            std::lock_guard<std::mutex> lock(connection.mutex);
+            pending += connection.handling + connection.responses.size();
+        }
+
+        return pending == 0 || pending + connection.reader.size() < _opts.max_connection_bytes;
+    }
+
+    // Move responses from workers to the output, and write as much as the socket takes.
+    // Returns false if the connection is broken.
+    bool _flush(Connection &connection) {
+        {
+            std::lock_guard<std::mutex> lock(connection.mutex);
+            if (connection.output.empty()) {
+                connection.output.swap(connection.responses);
+            } else {
+                connection.output += connection.responses;
+                connection.responses.clear();
+            }
+        }
+
+        while (connection.written < connection.output.size()) {
+            auto n = ::send(connection.fd,
+                    connection.output.data() + connection.written,
+                    connection.output.size() - connection.written,
+                    MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+
+                return false;
+            }
+
+            connection.written += static_cast<std::size_t>(n);
+        }
+
+        if (connection.written == connection.output.size()) {
+            connection.output.clear();
+            connection.written = 0;
+        } else if (connection.written >= connection.output.size() / 2) {
+            // Keep the output from growing with bytes which have been written.
+            connection.output.erase(0, connection.written);
+            connection.written = 0;
+        }
+
+        return true;
+    }
+
+    void _push(std::vector<Task> &tasks) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (auto &task : tasks) {
+                _queue.push_back(std::move(task));
+            }
+        }
+
+        if (tasks.size() == 1) {
+            _cv.notify_one();
+        } else {
+            _cv.notify_all();
+        }
+    }
+
+    void _stop_workers(std::vector<std::thread> &workers) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _cv.notify_all();
+
+        for (auto &worker : workers) {
+            worker.join();
+        }
+
+        // Drop pending requests, so that their connections are closed.
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.clear();
+    }
+
+    void _work() {
+        std::vector<Task> batch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cv.wait(lock, [this]() { return _stopping || !_queue.empty(); });
+                if (_stopping) {
+                    break;
+                }
+
+                // Take an even share of the queue, so that other workers get some as well.
+                auto share = (_queue.size() + _opts.workers - 1) / _opts.workers;
+                auto cnt = std::min(_opts.max_batch, std::max<std::size_t>(share, 1));
+                for (std::size_t idx = 0; idx < cnt; ++idx) {
+                    batch.push_back(std::move(_queue.front()));
+                    _queue.pop_front();
+                }
+
+                if (!_queue.empty()) {
+                    _cv.notify_one();
+                }
+            }
+
+            _process(batch);
+            batch.clear();
+        }
+    }
+
+    void _process(std::vector<Task> &batch) {
+        struct Output {
+            Connection *connection;
+
+            std::string responses;
+
+            // Bytes of requests, whose responses are in `responses`.
+            std::size_t handled;
+        };
+
+        // Responses grouped by connection, in the order of requests.
+        std::vector<Output> outputs;
+        std::unordered_map<std::string, TiktokenSPtr> tiktokens;
+        for (auto &task : batch) {
+            auto *connection = task.connection.get();
+            auto iter = std::find_if(outputs.begin(), outputs.end(),
+                    [connection](const auto &ele) { return ele.connection == connection; });
+            if (iter == outputs.end()) {
+                outputs.push_back(Output{connection, std::string{}, 0});
+                iter = std::prev(outputs.end());
+            }
+
+            protocol::serialize(_handle(task.request, tiktokens), iter->responses);
+            iter->handled += task.size;
+        }
+
+        for (auto &output : outputs) {
+            std::lock_guard<std::mutex> lock(output.connection->mutex);
+            output.connection->responses += output.responses;
+            output.connection->handling -= output.handled;
+        }
+
+        // Only the first worker after the IO thread collected responses writes the pipe.
+        if (!_woken.exchange(true)) {
+            _wake();
+        }
+    }
+
+    protocol::Response _handle(const protocol::Request &req,
+            std::unordered_map<std::string, TiktokenSPtr> &tiktokens) {
+        protocol::Response resp;
+        resp.id = req.id;
+        try {
+            auto &tiktoken = tiktokens[req.encoding];
+            if (!tiktoken) {
+                tiktoken = _factory.get(req.encoding);
+            }
+
+            auto with_special_token = (req.flags & protocol::FLAG_ALLOW_SPECIAL) != 0;
+            switch (req.op) {
+            case protocol::Op::ENCODE:
+                protocol::put_tokens(resp.payload, tiktoken->encode(req.payload, with_special_token));
+                break;
+
+            case protocol::Op::DECODE:
+                resp.payload = tiktoken->decode(protocol::get_tokens(req.payload));
+                break;
+
+            case protocol::Op::COUNT:
+                protocol::put_u64(resp.payload, tiktoken->count_tokens(req.payload, with_special_token));
+                break;
+
+            default:
+                throw Error("unknown op: " + std::to_string(static_cast<int>(req.op)));
+            }
+
+            // Otherwise, it throws when serialized, which is out of the try block.
+            if (resp.payload.size() > protocol::MAX_RESPONSE_PAYLOAD) {
+                throw Error("response is too large");
+            }
+        } catch (const std::exception &e) {
+            resp.status = protocol::Status::ERROR;
+            resp.payload = e.what();
+        }
+
+        return resp;
+    }
+
+    const TiktokenFactory &_factory;
+
+    ServerOptions _opts;
+
+    int _listener = -1;
+
+    // Self pipe to wake up the IO thread when stopping, or when there're responses.
+    int _wakeup[2] = {-1, -1};
+
+    std::atomic<bool> _stopped{false};
+
+    // Whether the IO thread has been woken up since it last collected responses.
+    std::atomic<bool> _woken{false};
+
+    std::mutex _mutex;
+
+    std::condition_variable _cv;
+
+    std::deque<Task> _queue;
+
+    bool _stopping = false;
+};
+
+}
+
+#endif // end SEWENEW_TOKENIZER_SERVER_H
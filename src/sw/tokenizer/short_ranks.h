@@ -0,0 +1,192 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+#ifndef SEWENEW_TOKENIZER_SHORT_RANKS_H
+#define SEWENEW_TOKENIZER_SHORT_RANKS_H
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace sw::tokenizer {
+
+// Rank lookup for byte sequences no longer than 8 bytes, without hashing strings.
+// 1-byte and 2-byte keys index into direct tables, and 3 to 8 byte keys are packed
+// into an integer, and looked up in an open addressing hash table.
+class ShortRanks {
+public:
+    static constexpr std::size_t MAX_SIZE = 8;
+
+    // Sentinel for keys not in the table.
+    static constexpr uint64_t NONE = std::numeric_limits<uint64_t>::max();
+
+    ShortRanks() = default;
+
+    explicit ShortRanks(const std::unordered_map<std::string, uint64_t> &ranks) {
+        std::size_t packed_cnt = 0;
+        for (const auto &[key, rank] : ranks) {
+            if (key.size() > MAX_SIZE) {
+                continue;
+            }
+
+            if (rank >= EMPTY) {
+                // Ranks are stored as 32-bit integers, leave the table disabled,
+                // and let the caller fall back to the general map.
+                return;
+            }
+
+            if (key.size() > 2) {
+                ++packed_cnt;
+            }
+        }
+
+        _one_byte.assign(1U << 8, EMPTY);
+        _two_bytes.assign(1U << 16, EMPTY);
+
+        // Keep load factor no more than 0.5.
+        std::size_t capacity = 16;
+        while (capacity < packed_cnt * 2) {
+            capacity <<= 1;
+        }
+        _packed.assign(capacity, Slot{});
+        _mask = capacity - 1;
+
+        for (const auto &[key, rank] : ranks) {
+            switch (key.size()) {
+            case 0:
+                break;
+
+            case 1:
+                _one_byte[_byte(key, 0)] = static_cast<uint32_t>(rank);
+                break;
+
+            case 2:
+                _two_bytes[_byte(key, 0) | (_byte(key, 1) << 8)] = static_cast<uint32_t>(rank);
+                break;
+
+            default:
+                if (key.size() <= MAX_SIZE) {
+                    _insert(_pack(key.data(), key.size()), key.size(), static_cast<uint32_t>(rank));
+                }
+                break;
+            }
+        }
+
+        _enabled = true;
+    }
+
+    // If it's disabled, the caller should use the general map instead.
+    bool enabled() const {
+        return _enabled;
+    }
+
+    // Returns NONE if the key is not a token. `key` must be no longer than MAX_SIZE.
+    uint64_t find(std::string_view key) const {
+        assert(_enabled && key.size() <= MAX_SIZE);
+
+        uint32_t rank = EMPTY;
+        switch (key.size()) {
+        case 0:
+            break;
+
+        case 1:
+            rank = _one_byte[_byte(key, 0)];
+            break;
+
+        case 2:
+            rank = _two_bytes[_byte(key, 0) | (_byte(key, 1) << 8)];
+            break;
+
+        default:
+            rank = _find(_pack(key.data(), key.size()), key.size());
+            break;
+        }
+
+        return rank == EMPTY ? NONE : rank;
+    }
+
+private:
+    static constexpr uint32_t EMPTY = std::numeric_limits<uint32_t>::max();
+
+    struct Slot {
+        uint64_t key = 0;
+        uint32_t rank = EMPTY;
+        uint32_t size = 0;
+    };
+
+    static uint32_t _byte(std::string_view key, std::size_t idx) {
+        return static_cast<unsigned char>(key[idx]);
+    }
+
+    static uint64_t _pack(const char *data, std::size_t size) {
+        assert(size <= MAX_SIZE);
+
+        uint64_t key = 0;
+        std::memcpy(&key, data, size);
+        return key;
+    }
+
+    std::size_t _slot(uint64_t key, std::size_t size) const {
+        // Fibonacci hashing, and mix the size in, since keys of different sizes
+        // might be packed into the same integer, e.g. "ab\0" and "ab".
+        auto hash = (key ^ size) * 0x9E3779B97F4A7C15ULL;
+        return static_cast<std::size_t>(hash >> 32) & _mask;
+    }
+
+    void _insert(uint64_t key, std::size_t size, uint32_t rank) {
+        for (auto idx = _slot(key, size); ; idx = (idx + 1) & _mask) {
+            auto &slot = _packed[idx];
+            if (slot.rank == EMPTY) {
+                slot.key = key;
+                slot.rank = rank;
+                slot.size = static_cast<uint32_t>(size);
+                return;
+            }
+        }
+    }
+
+    uint32_t _find(uint64_t key, std::size_t size) const {
+        for (auto idx = _slot(key, size); ; idx = (idx + 1) & _mask) {
+            const auto &slot = _packed[idx];
+            if (slot.rank == EMPTY) {
+                return EMPTY;
+            }
+
+            if (slot.key == key && slot.size == size) {
+                return slot.rank;
+            }
+        }
+    }
+
+    bool _enabled = false;
+
+    std::vector<uint32_t> _one_byte;
+
+    std::vector<uint32_t> _two_bytes;
+
+    std::vector<Slot> _packed;
+
+    std::size_t _mask = 0;
+};
+
+}
+
+#endif // end SEWENEW_TOKENIZER_SHORT_RANKS_H
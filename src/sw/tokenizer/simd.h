@@ -0,0 +1,126 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+#ifndef SEWENEW_TOKENIZER_SIMD_H
+#define SEWENEW_TOKENIZER_SIMD_H
+
+#include <cstddef>
+#include <cstdint>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SEWENEW_TOKENIZER_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace sw::tokenizer::simd {
+
+// Number of uint32_t in the widest vector we use. Arrays passed to `argmin` must be
+// padded with UINT32_MAX to a multiple of it.
+constexpr std::size_t ARGMIN_ALIGNMENT = 8;
+
+namespace detail {
+
+using ArgminFunc = std::size_t (*)(const uint32_t *, std::size_t);
+
+inline std::size_t argmin_scalar(const uint32_t *vals, std::size_t size) {
+    std::size_t idx = 0;
+    for (std::size_t i = 1; i < size; ++i) {
+        if (vals[i] < vals[idx]) {
+            idx = i;
+        }
+    }
+
+    return idx;
+}
+
+#ifdef SEWENEW_TOKENIZER_X86_SIMD
+
+__attribute__((target("sse4.1")))
+inline std::size_t argmin_sse41(const uint32_t *vals, std::size_t size) {
+    auto min = _mm_set1_epi32(-1);
+    for (std::size_t i = 0; i < size; i += 4) {
+        min = _mm_min_epu32(min, _mm_loadu_si128(reinterpret_cast<const __m128i *>(vals + i)));
+    }
+
+    // Horizontal min, then broadcast it to all lanes.
+    min = _mm_min_epu32(min, _mm_shuffle_epi32(min, _MM_SHUFFLE(1, 0, 3, 2)));
+    min = _mm_min_epu32(min, _mm_shuffle_epi32(min, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    for (std::size_t i = 0; i < size; i += 4) {
+        auto eq = _mm_cmpeq_epi32(min, _mm_loadu_si128(reinterpret_cast<const __m128i *>(vals + i)));
+        auto mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+        if (mask != 0) {
+            return i + __builtin_ctz(static_cast<unsigned>(mask));
+        }
+    }
+
+    return 0;
+}
+
+__attribute__((target("avx2")))
+inline std::size_t argmin_avx2(const uint32_t *vals, std::size_t size) {
+    auto min = _mm256_set1_epi32(-1);
+    for (std::size_t i = 0; i < size; i += 8) {
+        min = _mm256_min_epu32(min, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(vals + i)));
+    }
+
+    // Horizontal min, then broadcast it to all lanes.
+    min = _mm256_min_epu32(min, _mm256_permute2x128_si256(min, min, 1));
+    min = _mm256_min_epu32(min, _mm256_shuffle_epi32(min, _MM_SHUFFLE(1, 0, 3, 2)));
+    min = _mm256_min_epu32(min, _mm256_shuffle_epi32(min, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    for (std::size_t i = 0; i < size; i += 8) {
+        auto eq = _mm256_cmpeq_epi32(min, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(vals + i)));
+        auto mask = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+        if (mask != 0) {
+            return i + __builtin_ctz(static_cast<unsigned>(mask));
+        }
+    }
+
+    return 0;
+}
+
+#endif
+
+inline ArgminFunc select_argmin() {
+#ifdef SEWENEW_TOKENIZER_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return argmin_avx2;
+    }
+
+    if (__builtin_cpu_supports("sse4.1")) {
+        return argmin_sse41;
+    }
+#endif
+
+    return argmin_scalar;
+}
+
+}
+
+// Returns the index of the first minimum of `vals[0, size)`. The kernel is chosen at
+// runtime according to the CPU. `vals` must be readable up to `size` rounded up to
+// a multiple of ARGMIN_ALIGNMENT, and the padding must be UINT32_MAX.
+inline std::size_t argmin(const uint32_t *vals, std::size_t size) {
+    static const auto func = detail::select_argmin();
+
+    return func(vals, size);
+}
+
+}
+
+#endif // end SEWENEW_TOKENIZER_SIMD_H
@@ -17,6 +17,7 @@
 #ifndef SEWENEW_TIKTOKEN_STR_UTILS_H
 #define SEWENEW_TIKTOKEN_STR_UTILS_H
 
+#include <algorithm>
 #include <cctype>
 #include <cstring>
 #include <string>
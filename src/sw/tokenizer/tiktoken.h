@@ -17,23 +17,185 @@
 #ifndef SEWENEW_TOKENIZER_TIKTOKEN_H
 #define SEWENEW_TOKENIZER_TIKTOKEN_H
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
 #include <cctype>
+#include <charconv>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <filesystem>
 #include <limits>
 #include <memory>
+#include <memory_resource>
 #include <fstream>
 #include <functional>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <unordered_set>
 #include <unordered_map>
 #include <vector>
 #include "re2/re2.h"
+#include "sw/tokenizer/backtrack_encoder.h"
 #include "sw/tokenizer/base64.h"
 #include "sw/tokenizer/errors.h"
+#include "sw/tokenizer/hf_tokenizer.h"
+#include "sw/tokenizer/piece_scanner.h"
+#include "sw/tokenizer/short_ranks.h"
+#include "sw/tokenizer/simd.h"
+#include "sw/tokenizer/token_set.h"
 #include "sw/tokenizer/toml.h"
+#include "sw/tokenizer/utf8.h"
 
 namespace sw::tokenizer {
 
+// Algorithm to encode pieces which are not tokens themselves.
+enum class BpeEngine {
+    // Repeatedly merge the byte pair with the lowest rank, i.e. `Tiktoken::_byte_pair_merge`.
+    MERGE = 0,
+
+    // Greedy longest match with backtracking, see `BacktrackEncoder`.
+    BACKTRACK,
+
+    // The straightforward implementation, i.e. FindAndConsume for pieces, the O(mn) merge,
+    // and a plain map for ranks, without any of the optimizations. It's slow, and only
+    // kept as the reference which optimized paths are checked against.
+    REFERENCE
+};
+
+struct TokenEstimate {
+    // Never less than the number of tokens `Tiktoken::encode(text, false)` returns.
+    std::size_t upper_bound = 0;
+
+    // Estimated number of tokens, which is no more than `upper_bound`.
+    std::size_t estimate = 0;
+};
+
+// Tokens of a text, and where its pieces end, so that it can be updated by
+// `Tiktoken::reencode` after the text is edited.
+struct IncrementalEncoding {
+    std::vector<uint64_t> tokens;
+
+    // The i-th piece ends at `piece_ends[i]` of the text, and its tokens end at
+    // `token_ends[i]` of `tokens`. Special tokens are pieces as well.
+    std::vector<std::size_t> piece_ends;
+    std::vector<std::size_t> token_ends;
+
+    std::size_t text_size = 0;
+
+    bool with_special_token = true;
+};
+
+// Tokens of a batch of texts in one flat buffer, instead of a vector per text, so that
+// encoding a batch doesn't allocate per text, and the result can be copied into a tensor
+// as is. Tokens of the i-th text are [offsets[i], offsets[i + 1]) of `tokens`.
+struct BatchEncoding {
+    std::vector<uint64_t> tokens;
+    std::vector<uint64_t> offsets = {0};
+
+    std::size_t size() const {
+        return offsets.size() - 1;
+    }
+
+    std::size_t length(std::size_t idx) const {
+        return offsets[idx + 1] - offsets[idx];
+    }
+
+    const uint64_t* data(std::size_t idx) const {
+        return tokens.data() + offsets[idx];
+    }
+
+    // Copy tokens of the i-th text.
+    std::vector<uint64_t> get(std::size_t idx) const {
+        return std::vector<uint64_t>(data(idx), data(idx) + length(idx));
+    }
+
+    std::size_t max_length() const {
+        std::size_t len = 0;
+        for (std::size_t idx = 0; idx < size(); ++idx) {
+            len = std::max(len, length(idx));
+        }
+        return len;
+    }
+
+    // Pad tokens into a row major [size(), max_len] matrix, and truncate longer texts.
+    // `lengths` is set to the length of each row without padding, e.g. for attention masks.
+    // `max_len` of 0 means the length of the longest text.
+    std::vector<uint64_t> pad(uint64_t pad_token, std::vector<uint64_t> &lengths, std::size_t max_len = 0) const {
+        if (max_len == 0) {
+            max_len = max_length();
+        }
+
+        std::vector<uint64_t> matrix(size() * max_len);
+        lengths.resize(size());
+        pad(pad_token, max_len, matrix.data(), lengths.data());
+        return matrix;
+    }
+
+    // Same as above, but write into preallocated buffers of size() * max_len and size() items.
+    void pad(uint64_t pad_token, std::size_t max_len, uint64_t *matrix, uint64_t *lengths) const {
+        assert(matrix != nullptr || size() * max_len == 0);
+
+        for (std::size_t idx = 0; idx < size(); ++idx) {
+            auto len = std::min(length(idx), max_len);
+            auto *row = matrix + idx * max_len;
+            std::copy_n(data(idx), len, row);
+            std::fill(row + len, row + max_len, pad_token);
+            if (lengths != nullptr) {
+                lengths[idx] = len;
+            }
+        }
+    }
+
+    // Keep the buffers for the next batch.
+    void clear() {
+        tokens.clear();
+        offsets.assign(1, 0);
+    }
+};
+
+// A chat message, whose segments are views of the caller's buffers. An empty `name`
+// means the message has no name.
+struct ChatMessage {
+    std::string_view role;
+    std::string_view content;
+    std::string_view name;
+};
+
+// Tokens added by the chat format, i.e. role markers and separators, which are not part
+// of any segment. The defaults are those of gpt-3.5-turbo and gpt-4.
+struct ChatOverhead {
+    // Tokens of each message besides its segments.
+    int64_t tokens_per_message = 3;
+
+    // Tokens added, or removed if negative, when a message has a name.
+    int64_t tokens_per_name = 1;
+
+    // Tokens priming the reply, e.g. <|start|>assistant<|message|>.
+    int64_t tokens_per_reply = 3;
+};
+
+struct ChatTokenCount {
+    // Number of tokens of the request, including the reply priming.
+    std::size_t total = 0;
+
+    // Number of tokens of each message, including its overhead.
+    std::vector<std::size_t> messages;
+};
+
+// Replace `removed` bytes at `offset` of a text with `inserted`.
+struct TextEdit {
+    std::size_t offset = 0;
+    std::size_t removed = 0;
+    std::string inserted;
+};
+
 class Tiktoken {
 public:
     using Encoder = std::unordered_map<std::string, uint64_t>;
@@ -47,12 +209,27 @@ public:
 
     Tiktoken(Encoder encoder,
             Encoder special_encoder,
-            const std::string &pattern) {
+            const std::string &pattern,
+            BpeEngine engine = BpeEngine::MERGE) {
         _encoder = std::move(encoder);
         _special_token_encoder = std::move(special_encoder);
 
-        _decoder = _build_decoder(_encoder);
-        _special_token_decoder = _build_decoder(_special_token_encoder);
+        _short_ranks = ShortRanks(_encoder);
+        _build_long_ranks();
+
+        _narrow_ranks = std::all_of(_encoder.begin(), _encoder.end(),
+                [](const auto &ele) { return ele.second < std::numeric_limits<uint32_t>::max(); });
+
+        _token_set = TokenSet(_encoder);
+        _build_estimate_stats();
+
+        if (engine == BpeEngine::BACKTRACK) {
+            _backtrack_encoder = std::make_unique<BacktrackEncoder>(_encoder);
+        }
+
+        _reference = (engine == BpeEngine::REFERENCE);
+
+        _build_decoder();
 
         if (pattern.empty()) {
             throw Error("no pattern is specified");
@@ -60,15 +237,21 @@ public:
 
         _regex = _create_regex(pattern);
 
+        _scanner = PieceScanner(pattern);
+
         _special_token_regex = _build_special_token_regex(_special_token_encoder);
+
+        for (const auto &ele : _special_token_encoder) {
+            _max_special_token_size = std::max(_max_special_token_size, ele.first.size());
+        }
     }
 
-    std::vector<uint64_t> encode(const std::string &text, bool with_special_token = true) {
+    std::vector<uint64_t> encode(const std::string &text, bool with_special_token = true) const {
         if (!with_special_token) {
             std::vector<uint64_t> tokens;
             uint64_t last_piece_token_len = 0;
             re2::StringPiece input(text);
-            _encode(input, tokens, last_piece_token_len);
+            _encode(input, tokens, last_piece_token_len, std::pmr::get_default_resource());
 
             return tokens;
         } else {
@@ -76,36 +259,440 @@ public:
         }
     }
 
-    std::vector<uint64_t> encode(const std::string &text, const std::unordered_set<std::string> &allowed_special) {
+    std::vector<uint64_t> encode(const std::string &text, const std::unordered_set<std::string> &allowed_special) const {
         return _encode_with_special_token(text, allowed_special).first;
     }
 
-    std::string decode(const std::vector<uint64_t> &tokens) {
-        std::string ret;
-        ret.reserve(tokens.size() * 2);
-        for (auto token : tokens) {
-            std::string token_bytes;
-            auto iter = _decoder.find(token);
-            if (iter != _decoder.end()) {
-                token_bytes = iter->second;
+    // Same as `encode`, but the result and all scratch memory come from `resource`, e.g. a
+    // request-scoped std::pmr::monotonic_buffer_resource, which is released in one go.
+    std::pmr::vector<uint64_t> encode(const std::string &text,
+            std::pmr::memory_resource *resource,
+            bool with_special_token = true) const {
+        assert(resource != nullptr);
+
+        std::pmr::vector<uint64_t> tokens(resource);
+        uint64_t last_piece_token_len = 0;
+        if (!with_special_token) {
+            re2::StringPiece input(text);
+            _encode(input, tokens, last_piece_token_len, resource);
+        } else {
+            _encode_with_special_token(text, _special_token_encoder, tokens, resource);
+        }
+
+        return tokens;
+    }
+
+    std::size_t count_tokens(const std::string &text, bool with_special_token = true) const {
+        return _count_tokens(text, with_special_token);
+    }
+
+    // Count tokens of a chat request. Segments are encoded in place, i.e. messages are never
+    // concatenated, and tokens are counted without being stored. Messages are split into
+    // `threads` ranges of about the same size, which are counted in parallel.
+    //
+    // Segments are encoded as plain text by default, so that a special token in the
+    // content, e.g. <|endoftext|>, is counted as what it is in the request body.
+    ChatTokenCount count_chat_tokens(const std::vector<ChatMessage> &messages,
+            const ChatOverhead &overhead = ChatOverhead{},
+            std::size_t threads = 1,
+            bool with_special_token = false) const {
+        ChatTokenCount result;
+        result.messages.resize(messages.size());
+
+        auto count = [&](std::size_t begin, std::size_t end) {
+            for (auto idx = begin; idx < end; ++idx) {
+                result.messages[idx] = _count_message(messages[idx], overhead, with_special_token);
+            }
+        };
+
+        threads = std::max<std::size_t>(1, std::min(threads, messages.size()));
+        if (threads == 1) {
+            count(0, messages.size());
+        } else {
+            std::size_t bytes = 0;
+            for (const auto &message : messages) {
+                bytes += message.role.size() + message.content.size() + message.name.size();
+            }
+
+            // Each range writes distinct items of `result.messages`, so no locking is needed.
+            // The last range is counted by the calling thread.
+            std::vector<std::future<void>> futures;
+            auto bytes_per_range = bytes / threads + 1;
+            std::size_t begin = 0;
+            std::size_t range_bytes = 0;
+            for (std::size_t idx = 0; idx < messages.size() && futures.size() + 1 < threads; ++idx) {
+                const auto &message = messages[idx];
+                range_bytes += message.role.size() + message.content.size() + message.name.size();
+                if (range_bytes >= bytes_per_range) {
+                    futures.push_back(std::async(std::launch::async, count, begin, idx + 1));
+                    begin = idx + 1;
+                    range_bytes = 0;
+                }
+            }
+            count(begin, messages.size());
+
+            for (auto &future : futures) {
+                future.get();
+            }
+        }
+
+        int64_t total = overhead.tokens_per_reply;
+        for (auto cnt : result.messages) {
+            total += static_cast<int64_t>(cnt);
+        }
+        result.total = static_cast<std::size_t>(std::max<int64_t>(total, 0));
+
+        return result;
+    }
+
+    // Estimate the number of tokens of `encode(text, false)` without running BPE, e.g. for
+    // admission control. It only splits text into pieces, and looks up whole pieces.
+    //
+    // BPE keeps merging while two adjacent parts form a token, so in a piece's encoding,
+    // no two adjacent short tokens concatenate into a token. The upper bound of a piece is
+    // the max number of parts of such partitions, see `_piece_upper_bound`. Pieces which are
+    // not tokens themselves are estimated with the average token size of their byte class
+    // in the vocabulary.
+    //
+    // For the bundled patterns, pieces come from a byte scan instead of the regex, see
+    // `PieceScanner`. Its foreign pieces might be parts of a real piece, so they're bounded
+    // by their size, and estimated together as non-ASCII text. Other patterns still run
+    // the regex.
+    TokenEstimate estimate_tokens(const std::string &text) const {
+        TokenEstimate result;
+        if (!_scanner.enabled()) {
+            _EstimateCache cache;
+            re2::StringPiece input(text);
+            re2::StringPiece piece;
+            while (_next_piece(input, piece)) {
+                _estimate_piece(std::string_view(piece.data(), piece.size()), result, cache);
+            }
+
+            return result;
+        }
+
+        // Other pieces are estimated after the scan, which keeps the scan loop small. So are
+        // pieces near the end of text, since a lookup reads TokenSet::READ_SIZE bytes.
+        std::vector<std::string_view> others;
+        std::size_t known_tokens = 0;
+        std::size_t foreign_bytes = 0;
+        const auto *text_end = text.data() + text.size();
+        _scanner.scan(text, [this, text_end, &others, &known_tokens, &foreign_bytes](std::string_view piece,
+                                                                                    bool foreign) {
+            if (foreign) {
+                foreign_bytes += piece.size();
+            } else if (piece.size() <= TokenSet::MAX_SIZE &&
+                    static_cast<std::size_t>(text_end - piece.data()) >= TokenSet::READ_SIZE &&
+                    _token_set.contains(piece.data(), piece.size())) {
+                // Most pieces are tokens, and they're checked without branches.
+                ++known_tokens;
             } else {
-                iter = _special_token_decoder.find(token);
-                if (iter != _special_token_decoder.end()) {
-                    token_bytes = iter->second;
-                } else {
-                    throw Error("unknown token: " + std::to_string(token));
+                others.push_back(piece);
+            }
+        });
+
+        _EstimateCache cache;
+        for (auto piece : others) {
+            _estimate_piece(piece, result, cache);
+        }
+
+        result.upper_bound += known_tokens;
+        result.estimate += known_tokens;
+
+        if (foreign_bytes > 0) {
+            auto estimate = static_cast<std::size_t>(foreign_bytes / _bytes_per_token[NON_ASCII] + 0.5);
+            result.upper_bound += foreign_bytes;
+            result.estimate += std::clamp<std::size_t>(estimate, 1, foreign_bytes);
+        }
+
+        return result;
+    }
+
+    // Encode texts into one flat buffer. The buffer grows by amortized doubling, and
+    // its initial size is a guess from the total size of texts.
+    BatchEncoding encode_batch(const std::vector<std::string> &texts, bool with_special_token = true) const {
+        BatchEncoding batch;
+        encode_batch(texts, batch, with_special_token);
+        return batch;
+    }
+
+    // Same as above, but append to `batch`, so that its buffers can be reused.
+    void encode_batch(const std::vector<std::string> &texts,
+            BatchEncoding &batch,
+            bool with_special_token = true) const {
+        std::size_t bytes = 0;
+        for (const auto &text : texts) {
+            bytes += text.size();
+        }
+
+        // A token is about 4 bytes of English text.
+        batch.tokens.reserve(batch.tokens.size() + bytes / 4);
+        batch.offsets.reserve(batch.offsets.size() + texts.size());
+
+        for (const auto &text : texts) {
+            if (with_special_token) {
+                _encode_with_special_token(text, _special_token_encoder, batch.tokens,
+                        std::pmr::get_default_resource());
+            } else {
+                uint64_t last_piece_token_len = 0;
+                re2::StringPiece input(text);
+                _encode(input, batch.tokens, last_piece_token_len, std::pmr::get_default_resource());
+            }
+            batch.offsets.push_back(batch.tokens.size());
+        }
+    }
+
+    // Same as `encode`, but also keep piece boundaries for `reencode`.
+    IncrementalEncoding encode_incremental(const std::string &text, bool with_special_token = true) const {
+        IncrementalEncoding encoding;
+        encoding.text_size = text.size();
+        encoding.with_special_token = with_special_token;
+        _encode_pieces(text, 0, with_special_token, encoding, [](std::size_t) { return false; });
+
+        return encoding;
+    }
+
+    // Update `encoding` of the old text after `edit`, and `text` is the new text. The result
+    // equals `encode_incremental(text, encoding.with_special_token)`.
+    //
+    // BPE never merges across pieces, so only pieces around the edit are encoded again.
+    // It restarts the pre-tokenizer at a piece boundary before the edit, and stops as soon
+    // as a piece ends at an old boundary after the edit, since the rest of the text, and
+    // hence the rest of pieces, are unchanged. A piece might be decided by the text after it,
+    // e.g. '\n' followed by spaces becomes part of a longer piece if another '\n' is inserted
+    // after the spaces, so the restart point is checked by matching the piece after it:
+    // if the piece is unchanged, so are the pieces before it. Otherwise, back off further.
+    void reencode(IncrementalEncoding &encoding, const TextEdit &edit, const std::string &text) const {
+        if (edit.offset + edit.removed > encoding.text_size
+                || text.size() != encoding.text_size - edit.removed + edit.inserted.size()
+                || text.compare(edit.offset, edit.inserted.size(), edit.inserted) != 0) {
+            throw Error("edit does not match the text");
+        }
+
+        const auto &piece_ends = encoding.piece_ends;
+        const auto &token_ends = encoding.token_ends;
+
+        // The first piece which might be changed, i.e. the first one ending at or after the edit.
+        auto first = static_cast<std::size_t>(
+                std::lower_bound(piece_ends.begin(), piece_ends.end(), edit.offset) - piece_ends.begin());
+        auto edit_end = edit.offset + edit.inserted.size();
+
+        IncrementalEncoding pieces;
+        std::size_t restart = 0;
+        std::size_t resume = piece_ends.size();
+        for (std::size_t margin = 1; ; margin *= 2) {
+            restart = first > margin ? first - margin : 0;
+            while (restart > 0 && encoding.with_special_token
+                    && _inside_special_token(text, piece_ends[restart - 1])) {
+                --restart;
+            }
+
+            pieces.tokens.clear();
+            pieces.piece_ends.clear();
+            pieces.token_ends.clear();
+            resume = piece_ends.size();
+
+            auto checked = (restart == 0);
+            auto valid = true;
+            auto stop = [&](std::size_t end) {
+                if (!checked) {
+                    checked = true;
+                    if (end != piece_ends[restart]) {
+                        valid = false;
+                        return true;
+                    }
+                }
+
+                if (end < edit_end) {
+                    return false;
+                }
+
+                auto old_end = end - edit.inserted.size() + edit.removed;
+                auto iter = std::lower_bound(piece_ends.begin() + first, piece_ends.end(), old_end);
+                if (iter != piece_ends.end() && *iter == old_end) {
+                    resume = static_cast<std::size_t>(iter - piece_ends.begin()) + 1;
+                    return true;
                 }
+
+                return false;
+            };
+
+            auto begin = (restart == 0) ? 0 : piece_ends[restart - 1];
+            _encode_pieces(text, begin, encoding.with_special_token, pieces, stop);
+            if (valid) {
+                break;
+            }
+        }
+
+        // Splice the new pieces in, and shift boundaries of the following ones.
+        auto token_begin = (restart == 0) ? 0 : token_ends[restart - 1];
+        auto token_end = (resume == 0) ? 0 : token_ends[resume - 1];
+        for (auto idx = resume; idx < piece_ends.size(); ++idx) {
+            encoding.piece_ends[idx] = encoding.piece_ends[idx] - edit.removed + edit.inserted.size();
+            encoding.token_ends[idx] = encoding.token_ends[idx] - (token_end - token_begin) + pieces.tokens.size();
+        }
+        for (auto &end : pieces.token_ends) {
+            end += token_begin;
+        }
+
+        _splice(encoding.tokens, token_begin, token_end, pieces.tokens);
+        _splice(encoding.piece_ends, restart, resume, pieces.piece_ends);
+        _splice(encoding.token_ends, restart, resume, pieces.token_ends);
+        encoding.text_size = text.size();
+    }
+
+    // End of the first piece which ends at or after `pos`, when `text` is split by the
+    // pre-tokenizer, or std::string_view::npos if there's none. Special tokens are plain
+    // text. The last piece might be cut off by the end of `text`, so it's never returned.
+    std::size_t piece_end(std::string_view text, std::size_t pos) const {
+        re2::StringPiece input(text.data(), text.size());
+        re2::StringPiece piece;
+        while (_next_piece(input, piece)) {
+            auto end = static_cast<std::size_t>(piece.data() + piece.size() - text.data());
+            if (end >= pos && end < text.size()) {
+                return end;
+            }
+        }
+
+        return std::string_view::npos;
+    }
+
+    // Bytes of a token. It's valid as long as this object lives.
+    std::string_view token_bytes(uint64_t token) const {
+        return _token_bytes(token);
+    }
+
+    // One past the largest token, including special tokens.
+    std::size_t n_vocab() const {
+        return _n_vocab;
+    }
+
+    uint64_t special_token(const std::string &token) const {
+        auto iter = _special_token_encoder.find(token);
+        if (iter == _special_token_encoder.end()) {
+            throw Error("unknown special token: " + token);
+        }
+
+        return iter->second;
+    }
+
+    // Size of the longest special token, or 0 if there's no special token.
+    std::size_t max_special_token_size() const {
+        return _max_special_token_size;
+    }
+
+    std::string decode(const std::vector<uint64_t> &tokens) const {
+        std::size_t size = 0;
+        for (auto token : tokens) {
+            size += _token_bytes(token).size();
+        }
+
+        std::string ret;
+        ret.reserve(size);
+        for (auto token : tokens) {
+            ret += _token_bytes(token);
+        }
+
+        return ret;
+    }
+
+    // Same as above, but the result comes from `resource`. `tokens` is any container of
+    // tokens, e.g. the result of `encode(text, resource)`.
+    template <typename Tokens>
+    std::pmr::string decode(const Tokens &tokens, std::pmr::memory_resource *resource) const {
+        assert(resource != nullptr);
+
+        std::size_t size = 0;
+        for (auto token : tokens) {
+            size += _token_bytes(token).size();
+        }
+
+        std::pmr::string ret(resource);
+        ret.reserve(size);
+        for (auto token : tokens) {
+            ret += _token_bytes(token);
+        }
+
+        return ret;
+    }
+
+    // Same as the first one, but check that the result is valid UTF-8, which might not be the case
+    // if tokens split a multi-byte character, and handle invalid sequences with `errors`.
+    //
+    // ASCII tokens are always valid, and end at character boundaries. So only runs of
+    // non-ASCII tokens are validated, while they're appended, and ASCII text costs
+    // a flag check per token.
+    std::string decode(const std::vector<uint64_t> &tokens, utf8::ErrorMode errors) const {
+        std::size_t size = 0;
+        for (auto token : tokens) {
+            size += _token_bytes(token).size();
+        }
+
+        std::string ret;
+        ret.reserve(size);
+
+        // Beginning of the current run of non-ASCII tokens.
+        auto run = std::string::npos;
+        for (auto token : tokens) {
+            const auto &slice = _token_slice(token);
+            if (!slice.ascii && run == std::string::npos) {
+                run = ret.size();
+            } else if (slice.ascii && run != std::string::npos) {
+                utf8::check(ret, run, errors);
+                run = std::string::npos;
             }
-            ret += token_bytes;
+
+            ret.append(_decoder_bytes.data() + slice.offset, slice.size);
+        }
+
+        if (run != std::string::npos) {
+            utf8::check(ret, run, errors);
         }
 
         return ret;
     }
 
+    // Decode tokens into slices of the vocabulary's byte storage without copying, e.g. to
+    // write them with `writev`. Slices of adjacent tokens are coalesced if they're contiguous
+    // in the storage. The slices are valid as long as this object lives, even if it's moved.
+    std::vector<std::string_view> decode_views(const std::vector<uint64_t> &tokens) const {
+        std::vector<std::string_view> views;
+        decode_views(tokens, views);
+        return views;
+    }
+
+    // Same as above, but append the slices to `views`, so that the vector can be reused.
+    void decode_views(const std::vector<uint64_t> &tokens, std::vector<std::string_view> &views) const {
+        for (auto token : tokens) {
+            auto bytes = _token_bytes(token);
+            if (!views.empty() && views.back().data() + views.back().size() == bytes.data()) {
+                views.back() = std::string_view(views.back().data(), views.back().size() + bytes.size());
+            } else {
+                views.push_back(bytes);
+            }
+        }
+    }
+
 private:
     using Re2UPtr = std::unique_ptr<re2::RE2>;
 
-    uint64_t _max_size() {
+    struct TokenSlice {
+        static constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
+
+        uint32_t offset = NONE;
+        uint32_t size = 0;
+
+        // Whether the token is ASCII only, and hence always valid UTF-8.
+        bool ascii = true;
+    };
+
+    // Pieces shorter than this are merged by `_byte_pair_merge_short`.
+    // It must be a multiple of simd::ARGMIN_ALIGNMENT.
+    static constexpr std::size_t SHORT_PIECE_SIZE = 64;
+
+    static_assert(SHORT_PIECE_SIZE % simd::ARGMIN_ALIGNMENT == 0, "invalid short piece size");
+
+    uint64_t _max_size() const {
         return std::numeric_limits<uint64_t>::max();
     }
 
@@ -131,110 +718,528 @@ private:
         return _create_regex(special_pattern);
     }
 
-    Decoder _build_decoder(const Encoder &encoder) {
-        Decoder decoder;
-        for (const auto &[k, v] : encoder) {
-            decoder.emplace(v, k);
+    // Store bytes of all tokens, including special ones, contiguously in token order,
+    // so that decoding is indexing into an array, and adjacent tokens can be coalesced.
+    void _build_decoder() {
+        std::vector<std::pair<uint64_t, const std::string*>> tokens;
+        tokens.reserve(_encoder.size() + _special_token_encoder.size());
+        for (const auto *encoder : {&_encoder, &_special_token_encoder}) {
+            for (const auto &[k, v] : *encoder) {
+                tokens.emplace_back(v, &k);
+            }
+        }
+
+        if (tokens.empty()) {
+            return;
+        }
+
+        std::sort(tokens.begin(), tokens.end());
+
+        std::size_t size = 0;
+        for (auto idx = 0U; idx < tokens.size(); ++idx) {
+            if (idx > 0 && tokens[idx].first == tokens[idx - 1].first) {
+                throw Error("duplicate items in encoder");
+            }
+            size += tokens[idx].second->size();
+        }
+
+        if (size >= std::numeric_limits<uint32_t>::max()) {
+            throw Error("vocabulary is too large");
+        }
+
+        // Tokens are dense, except for a few special ones with outlier ids, e.g. 1 << 40,
+        // which would make the table huge. Those are kept in `_sparse_decoder`.
+        auto dense_limit = tokens.size() * 2 + 256;
+        auto dense_end = std::lower_bound(tokens.begin(), tokens.end(),
+                std::make_pair(dense_limit, static_cast<const std::string*>(nullptr)));
+        auto dense_size = (dense_end == tokens.begin()) ? 0 : std::prev(dense_end)->first + 1;
+
+        _n_vocab = tokens.back().first + 1;
+        _decoder_bytes.reserve(size);
+        _decoder.assign(dense_size, TokenSlice{});
+        for (const auto &[token, bytes] : tokens) {
+            auto &slice = (token < dense_size) ? _decoder[token] : _sparse_decoder[token];
+            slice.offset = static_cast<uint32_t>(_decoder_bytes.size());
+            slice.size = static_cast<uint32_t>(bytes->size());
+            slice.ascii = std::all_of(bytes->begin(), bytes->end(),
+                    [](char c) { return static_cast<unsigned char>(c) < 0x80; });
+            _decoder_bytes.insert(_decoder_bytes.end(), bytes->begin(), bytes->end());
+        }
+    }
+
+    const TokenSlice& _token_slice(uint64_t token) const {
+        if (token >= _decoder.size()) {
+            auto iter = _sparse_decoder.find(token);
+            if (iter == _sparse_decoder.end()) {
+                throw Error("unknown token: " + std::to_string(token));
+            }
+
+            return iter->second;
         }
 
-        if (encoder.size() != decoder.size()) {
-            throw Error("duplicate items in encoder");
+        if (_decoder[token].offset == TokenSlice::NONE) {
+            throw Error("unknown token: " + std::to_string(token));
         }
 
-        return decoder;
+        return _decoder[token];
+    }
+
+    std::string_view _token_bytes(uint64_t token) const {
+        const auto &slice = _token_slice(token);
+        return std::string_view(_decoder_bytes.data() + slice.offset, slice.size);
     }
 
+    // The special token is a view of the input, so that splitting never allocates, except
+    // for looking up a set of allowed special tokens given by the user.
     template <typename T>
-    std::pair<std::optional<std::string>, re2::StringPiece> _split_with_allowed_special_token(re2::StringPiece &input, const T &allowed_special) {
+    std::pair<std::optional<re2::StringPiece>, re2::StringPiece> _split_with_allowed_special_token(re2::StringPiece &input, const T &allowed_special) const {
         if (!_special_token_regex) {
             return std::make_pair(std::nullopt, input);
         }
 
         auto start = input.begin();
-        std::string special;
+        re2::StringPiece special;
         while (true) {
             if (!re2::RE2::FindAndConsume(&input, *_special_token_regex, &special)) {
                 // No special token.
                 break;
             }
 
-            if (allowed_special.count(special) == 1) {
+            if (_is_allowed_special_token(allowed_special, special)) {
                 // Found an allowed special token, split the text with it.
-                return std::make_pair(std::move(special), re2::StringPiece(start, input.begin() - start - special.size()));
+                return std::make_pair(special, re2::StringPiece(start, special.data() - start));
             } // else try to find the next special token
         }
 
-        return std::make_pair(std::nullopt, input);
+        // Disallowed special tokens which have been consumed are plain text.
+        return std::make_pair(std::nullopt, re2::StringPiece(start, input.end() - start));
     }
 
-    void _encode(re2::StringPiece &input, std::vector<uint64_t> &ret, uint64_t &last_piece_token_len) {
-        std::string piece;
+    bool _is_allowed_special_token(const Encoder &allowed_special, re2::StringPiece special) const {
+        // All special tokens are allowed, and `special` must be one of them.
+        if (&allowed_special == &_special_token_encoder) {
+            return true;
+        }
+
+        return allowed_special.count(std::string(special.data(), special.size())) == 1;
+    }
+
+    bool _is_allowed_special_token(const std::unordered_set<std::string> &allowed_special,
+            re2::StringPiece special) const {
+        return allowed_special.count(std::string(special.data(), special.size())) == 1;
+    }
+
+    // Same as `RE2::FindAndConsume(&input, *_regex, &piece)`, but without capturing groups,
+    // so that RE2 can find the match with its DFA, instead of the much slower NFA. Pieces
+    // are usually adjacent, so try an anchored match first, which saves a reverse scan.
+    bool _next_piece(re2::StringPiece &input, re2::StringPiece &piece) const {
         assert(_regex);
-        while (re2::RE2::FindAndConsume(&input, *_regex, &piece)) {
-            auto iter = _encoder.find(piece);
-            if (iter != _encoder.end()) {
-                last_piece_token_len = 1;
-                ret.push_back(iter->second);
-                continue;
-            }
-            auto tokens = _byte_pair_encode(piece, _encoder);
-            last_piece_token_len = tokens.size();
-            ret.insert(ret.end(), tokens.begin(), tokens.end());
+        if (!_regex->Match(input, 0, input.size(), re2::RE2::ANCHOR_START, &piece, 1)
+                && !_regex->Match(input, 0, input.size(), re2::RE2::UNANCHORED, &piece, 1)) {
+            return false;
         }
+
+        auto consumed = static_cast<std::size_t>(piece.data() + piece.size() - input.data());
+        input.remove_prefix(consumed);
+
+        // Patterns of encodings never match empty string. Stop here in case of a bad one.
+        return !piece.empty();
     }
 
-    template <typename T>
-    std::pair<std::vector<uint64_t>, uint64_t> _encode_with_special_token(const std::string &text, const T &allowed_special) {
-        std::vector<uint64_t> tokens;
-        uint64_t last_piece_token_len = 0;
-        re2::StringPiece input(text);
-        while (true) {
-            auto [special, sub_input] = _split_with_allowed_special_token(input, allowed_special);
+    // Estimates of recent pieces which are not in `_token_set`, since words repeat, e.g.
+    // identifiers in code. Pieces are views of the text being estimated.
+    struct _EstimateCache {
+        struct Entry {
+            std::string_view piece;
+            TokenEstimate estimate;
+        };
 
-            _encode(sub_input, tokens, last_piece_token_len);
+        static constexpr std::size_t SIZE = 2048;
 
-            if (special) {
-                uint64_t token = 0;
-                try {
-                    token = _special_token_encoder.at(*special);
-                } catch (const std::out_of_range &) {
-                    // Should never go here, since special pattern includes all special chars.
-                    assert(false);
-                }
+        // Allocated on the first lookup, since most pieces are in `_token_set`.
+        std::vector<Entry> entries;
+    };
 
-                tokens.push_back(token);
-                last_piece_token_len = 0;
-            } else {
-                break;
-            }
+    void _estimate_piece(std::string_view piece, TokenEstimate &result, _EstimateCache &cache) const {
+        if (cache.entries.empty()) {
+            cache.entries.resize(_EstimateCache::SIZE);
         }
 
-        // last_piece_token_len is how many tokens came from the last regex split. This is used
-        // for determining unstable tokens, since you can't merge across (stable) regex splits
-        return std::make_pair(tokens, last_piece_token_len);
+        auto &entry = cache.entries[std::hash<std::string_view>{}(piece) % _EstimateCache::SIZE];
+        if (entry.piece.empty() || entry.piece != piece) {
+            entry.piece = piece;
+            entry.estimate = _estimate_piece(piece);
+        }
+
+        result.upper_bound += entry.estimate.upper_bound;
+        result.estimate += entry.estimate.estimate;
     }
 
-    std::vector<uint64_t> _byte_pair_merge(
-            const std::string &piece,
-            const std::unordered_map<std::string, uint64_t> &ranks,
-            std::function<uint64_t (uint64_t, uint64_t)> func) {
-        // This is a vector of (start, rank).
-        // The rank is of the byte pair starting at position start.
-        // The rank of the last item in the vector is not a valid value.
-        std::vector<std::pair<uint64_t, uint64_t>> parts;
-        parts.reserve(piece.size() + 1);
+    TokenEstimate _estimate_piece(std::string_view piece) const {
+        if (_rank(piece) != _max_size()) {
+            return {1, 1};
+        }
+
+        auto bound = _piece_upper_bound(piece);
+        auto bytes_per_token = _bytes_per_token[_byte_class(piece)];
+        auto estimate = static_cast<std::size_t>(piece.size() / bytes_per_token + 0.5);
+        return {bound, std::min(bound, std::max<std::size_t>(estimate, 2))};
+    }
+
+    // Max number of tokens a piece might be encoded into, see `estimate_tokens`.
+    //
+    // It's the max number of parts a partition of the piece might have, such that no two
+    // adjacent parts of size 1 or 2 form a token. Parts of 3 or more bytes are not checked,
+    // so the result is never less than the number of tokens BPE produces. Neither is it
+    // when `_token_set` misses a token, which only allows more partitions.
+    std::size_t _piece_upper_bound(std::string_view piece) const {
+        // Max number of parts of the first i bytes, whose last part has 1 byte, 2 bytes,
+        // or 3 or more bytes, for i - 1 and i - 2. NONE means impossible, and it's so small
+        // that it stays negative after adding parts, so that no check is needed. `best` is
+        // the max of them for the first [0, i - k] bytes.
+        constexpr long NONE = std::numeric_limits<long>::min() / 2;
+        long one1 = NONE, two1 = NONE, more1 = NONE;
+        long one2 = NONE, two2 = NONE, more2 = NONE;
+        long best1 = 0, best2 = NONE, best3 = NONE;
+
+        // NONE if `token`, or `cnt` otherwise. Lookups are random, so there's no branch.
+        auto unless = [](bool token, long cnt) {
+            return cnt ^ ((cnt ^ NONE) & -static_cast<long>(token));
+        };
+
+        // A lookup reads TokenSet::READ_SIZE bytes, so the piece is padded once, instead of
+        // each window.
+        std::string padded(piece);
+        padded.resize(piece.size() + TokenSet::READ_SIZE);
+        const auto *data = padded.data();
+
+        for (std::size_t i = 1; i <= piece.size(); ++i) {
+            // Whether the last 2, 3 and 4 bytes are tokens.
+            auto token2 = (i >= 2 && _token_set.contains(data + i - 2, 2));
+            auto token3 = (i >= 3 && _token_set.contains(data + i - 3, 3));
+            auto token4 = (i >= 4 && _token_set.contains(data + i - 4, 4));
+
+            auto one = std::max({(i == 1) ? 0 : NONE,
+                    unless(token2, one1),
+                    unless(token3, two1),
+                    more1}) + 1;
+
+            auto two = std::max({(i == 2) ? 0 : NONE,
+                    unless(token3, one2),
+                    unless(token4, two2),
+                    more2}) + 1;
+
+            auto more = best3 + 1;
+
+            best3 = best2;
+            best2 = best1;
+            best1 = std::max({best1, one, two, more});
+            one2 = one1;
+            two2 = two1;
+            more2 = more1;
+            one1 = one;
+            two1 = two;
+            more1 = more;
+        }
+
+        return static_cast<std::size_t>(std::max({one1, two1, more1}));
+    }
+
+    enum ByteClass {
+        LETTER = 0,
+        DIGIT,
+        SPACE,
+        PUNCT,
+        NON_ASCII,
+        NUM_BYTE_CLASS
+    };
+
+    // Class of the first byte, skipping a leading space, which pieces often start with.
+    static std::size_t _byte_class(std::string_view bytes) {
+        if (bytes.size() > 1 && bytes[0] == ' ') {
+            bytes.remove_prefix(1);
+        }
+
+        auto c = static_cast<unsigned char>(bytes[0]);
+        if (c >= 0x80) {
+            return NON_ASCII;
+        } else if (std::isalpha(c)) {
+            return LETTER;
+        } else if (std::isdigit(c)) {
+            return DIGIT;
+        } else if (std::isspace(c)) {
+            return SPACE;
+        } else {
+            return PUNCT;
+        }
+    }
+
+    // Average size of multi-byte tokens of each byte class.
+    void _build_estimate_stats() {
+        std::array<std::size_t, NUM_BYTE_CLASS> bytes = {};
+        std::array<std::size_t, NUM_BYTE_CLASS> cnt = {};
+        for (const auto &ele : _encoder) {
+            const auto &token = ele.first;
+            if (token.size() < 2) {
+                continue;
+            }
+
+            auto cls = _byte_class(token);
+            bytes[cls] += token.size();
+            ++cnt[cls];
+        }
+
+        for (auto cls = 0U; cls < NUM_BYTE_CLASS; ++cls) {
+            _bytes_per_token[cls] = cnt[cls] == 0 ? 1.0 : static_cast<double>(bytes[cls]) / cnt[cls];
+        }
+    }
+
+    // Pieces are views of the input, and tokens are appended to `ret` directly, so that
+    // the only scratch memory, i.e. that of long pieces, comes from `resource`.
+    template <typename Tokens>
+    void _encode(re2::StringPiece &input,
+            Tokens &ret,
+            uint64_t &last_piece_token_len,
+            std::pmr::memory_resource *resource) const {
+        if (_reference) {
+            _reference_encode(input, ret, last_piece_token_len);
+            return;
+        }
+
+        re2::StringPiece piece;
+        while (_next_piece(input, piece)) {
+            std::string_view view(piece.data(), piece.size());
+            auto rank = _rank(view);
+            if (rank != _max_size()) {
+                last_piece_token_len = 1;
+                ret.push_back(rank);
+                continue;
+            }
+            auto size = ret.size();
+            _byte_pair_encode(view, ret, resource);
+            last_piece_token_len = ret.size() - size;
+        }
+    }
+
+    // Encode `text` from `pos`, which must be a piece boundary, and append the pieces to
+    // `encoding`, until `stop(piece_end)` returns true, or the end of text.
+    template <typename Stop>
+    void _encode_pieces(const std::string &text,
+            std::size_t pos,
+            bool with_special_token,
+            IncrementalEncoding &encoding,
+            Stop &&stop) const {
+        auto add_piece = [&encoding](std::size_t end) {
+            encoding.piece_ends.push_back(end);
+            encoding.token_ends.push_back(encoding.tokens.size());
+        };
+
+        while (true) {
+            // Pieces never cross special tokens, so split the text with the next one first.
+            auto segment_end = text.size();
+            re2::StringPiece special;
+            if (with_special_token && _special_token_regex
+                    && _special_token_regex->Match(text, pos, text.size(), re2::RE2::UNANCHORED, &special, 1)) {
+                segment_end = static_cast<std::size_t>(special.data() - text.data());
+            }
+
+            re2::StringPiece input(text.data() + pos, segment_end - pos);
+            re2::StringPiece piece;
+            while (_next_piece(input, piece)) {
+                std::string_view view(piece.data(), piece.size());
+                auto rank = _rank(view);
+                if (rank != _max_size()) {
+                    encoding.tokens.push_back(rank);
+                } else {
+                    _byte_pair_encode(view, encoding.tokens, std::pmr::get_default_resource());
+                }
+
+                auto end = static_cast<std::size_t>(input.data() - text.data());
+                add_piece(end);
+                if (stop(end)) {
+                    return;
+                }
+            }
+
+            if (special.data() == nullptr) {
+                break;
+            }
+
+            encoding.tokens.push_back(_special_token_encoder.at(std::string(special.data(), special.size())));
+            pos = segment_end + special.size();
+            add_piece(pos);
+            if (stop(pos)) {
+                return;
+            }
+        }
+    }
+
+    // Whether a special token in `text` starts before `pos`, and ends after it.
+    bool _inside_special_token(const std::string &text, std::size_t pos) const {
+        if (!_special_token_regex) {
+            return false;
+        }
+
+        auto begin = pos > _max_special_token_size ? pos - _max_special_token_size : 0;
+        re2::StringPiece special;
+        while (begin < pos
+                && _special_token_regex->Match(text, begin, text.size(), re2::RE2::UNANCHORED, &special, 1)) {
+            auto start = static_cast<std::size_t>(special.data() - text.data());
+            if (start >= pos) {
+                break;
+            }
+
+            begin = start + special.size();
+            if (begin > pos) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Replace [begin, end) of `vec` with `items`.
+    template <typename T>
+    static void _splice(std::vector<T> &vec, std::size_t begin, std::size_t end, const std::vector<T> &items) {
+        assert(begin <= end && end <= vec.size());
+
+        auto size = end - begin;
+        auto common = std::min(size, items.size());
+        std::copy(items.begin(), items.begin() + common, vec.begin() + begin);
+        if (size > items.size()) {
+            vec.erase(vec.begin() + begin + common, vec.begin() + end);
+        } else {
+            vec.insert(vec.begin() + end, items.begin() + common, items.end());
+        }
+    }
+
+    template <typename T>
+    std::pair<std::vector<uint64_t>, uint64_t> _encode_with_special_token(const std::string &text, const T &allowed_special) const {
+        std::vector<uint64_t> tokens;
+        auto last_piece_token_len = _encode_with_special_token(text, allowed_special, tokens,
+                std::pmr::get_default_resource());
+
+        return std::make_pair(std::move(tokens), last_piece_token_len);
+    }
+
+    // Append tokens to `tokens`, and return the number of tokens of the last piece.
+    template <typename T, typename Tokens>
+    uint64_t _encode_with_special_token(std::string_view text,
+            const T &allowed_special,
+            Tokens &tokens,
+            std::pmr::memory_resource *resource) const {
+        if (_reference) {
+            return _reference_encode_with_special_token(std::string(text), allowed_special, tokens);
+        }
+
+        uint64_t last_piece_token_len = 0;
+        re2::StringPiece input(text.data(), text.size());
+        while (true) {
+            auto [special, sub_input] = _split_with_allowed_special_token(input, allowed_special);
+
+            _encode(sub_input, tokens, last_piece_token_len, resource);
+
+            if (special) {
+                uint64_t token = 0;
+                auto iter = _special_token_ranks.find(std::string_view(special->data(), special->size()));
+                if (iter != _special_token_ranks.end()) {
+                    token = iter->second;
+                } else {
+                    // Should never go here, since special pattern includes all special chars.
+                    assert(false);
+                }
+
+                tokens.push_back(token);
+                last_piece_token_len = 0;
+            } else {
+                break;
+            }
+        }
+
+        // last_piece_token_len is how many tokens came from the last regex split. This is used
+        // for determining unstable tokens, since you can't merge across (stable) regex splits
+        return last_piece_token_len;
+    }
+
+    // A sink of `_encode`, which counts tokens instead of storing them.
+    class TokenCounter {
+    public:
+        void push_back(uint64_t) {
+            ++_size;
+        }
+
+        std::size_t size() const {
+            return _size;
+        }
+
+        int end() const {
+            return 0;
+        }
+
+        template <typename Iter>
+        void insert(int, Iter first, Iter last) {
+            _size += std::distance(first, last);
+        }
+
+    private:
+        std::size_t _size = 0;
+    };
+
+    std::size_t _count_tokens(std::string_view text, bool with_special_token) const {
+        TokenCounter counter;
+        if (with_special_token) {
+            _encode_with_special_token(text, _special_token_encoder, counter, std::pmr::get_default_resource());
+        } else {
+            uint64_t last_piece_token_len = 0;
+            re2::StringPiece input(text.data(), text.size());
+            _encode(input, counter, last_piece_token_len, std::pmr::get_default_resource());
+        }
+
+        return counter.size();
+    }
+
+    std::size_t _count_message(const ChatMessage &message,
+            const ChatOverhead &overhead,
+            bool with_special_token) const {
+        auto cnt = overhead.tokens_per_message;
+        cnt += static_cast<int64_t>(_count_tokens(message.role, with_special_token));
+        cnt += static_cast<int64_t>(_count_tokens(message.content, with_special_token));
+        if (!message.name.empty()) {
+            cnt += static_cast<int64_t>(_count_tokens(message.name, with_special_token));
+            cnt += overhead.tokens_per_name;
+        }
+
+        return static_cast<std::size_t>(std::max<int64_t>(cnt, 0));
+    }
+
+    // Append the merged tokens, i.e. `func(start, stop)` of each part, to `out`.
+    template <typename Func, typename Tokens>
+    void _byte_pair_merge(
+            std::string_view piece,
+            const Func &func,
+            Tokens &out,
+            std::pmr::memory_resource *resource) const {
+        if (piece.size() < SHORT_PIECE_SIZE && _narrow_ranks) {
+            _byte_pair_merge_short(piece, func, out);
+            return;
+        }
+
+        // This is a vector of (start, rank).
+        // The rank is of the byte pair starting at position start.
+        // The rank of the last item in the vector is not a valid value.
+        std::pmr::vector<std::pair<uint64_t, uint64_t>> parts(resource);
+        parts.reserve(piece.size() + 1);
         for (auto idx = 0U; idx < piece.size() + 1; ++idx) {
             parts.emplace_back(idx, _max_size());
         }
 
-        auto get_rank = [&piece, &ranks](const std::vector<std::pair<uint64_t, uint64_t>> &parts, uint64_t start_idx, uint64_t skip) -> std::optional<uint64_t> {
+        auto get_rank = [this, piece](const auto &parts, uint64_t start_idx, uint64_t skip) -> std::optional<uint64_t> {
             if (start_idx + skip + 2 < parts.size()) {
                 auto s = parts[start_idx].first;
                 auto e = parts[start_idx + skip + 2].first;
-                auto key = piece.substr(s, e - s);
-                auto iter = ranks.find(key);
-                if (iter != ranks.end()) {
-                    return iter->second;
+                auto rank = _rank(piece.substr(s, e - s));
+                if (rank != _max_size()) {
+                    return rank;
                 }
             }
             return std::nullopt;
@@ -304,85 +1309,679 @@ private:
                 break;
             }
         }
-        std::vector<uint64_t> out;
-        out.reserve(parts.size() - 1);
         for (auto i = 0U; i < parts.size() - 1; ++i) {
             auto s = parts[i].first;
             auto e = parts[i + 1].first;
             out.push_back(func(s, e));
         }
-        return out;
     }
 
-    std::vector<uint64_t> _byte_pair_encode(const std::string &piece, const Encoder &encoder) {
-        if (piece.size() == 1) {
-            auto iter = encoder.find(piece);
-            if (iter != encoder.end()) {
-                return std::vector<uint64_t>({iter->second});
-            } else {
-                // TODO: is it possible?
-                return {};
+    // Same as `_byte_pair_merge`, but for pieces shorter than SHORT_PIECE_SIZE, whose ranks
+    // all fit in 32 bits. Starts and ranks are kept in separate fixed-size arrays, so that
+    // the min rank can be found with SIMD, and erasing a part moves less memory.
+    template <typename Func, typename Tokens>
+    void _byte_pair_merge_short(
+            std::string_view piece,
+            const Func &func,
+            Tokens &out) const {
+        assert(piece.size() < SHORT_PIECE_SIZE);
+
+        constexpr auto MAX_RANK = std::numeric_limits<uint32_t>::max();
+
+        // starts[i] is the start of the i-th part, and ranks[i] is the rank of the byte pair
+        // starting at starts[i]. Ranks beyond the last pair are padded with MAX_RANK.
+        uint32_t starts[SHORT_PIECE_SIZE];
+        alignas(32) uint32_t ranks[SHORT_PIECE_SIZE];
+        std::fill(std::begin(ranks), std::end(ranks), MAX_RANK);
+
+        std::size_t size = piece.size() + 1;
+        for (auto idx = 0U; idx < size; ++idx) {
+            starts[idx] = idx;
+        }
+
+        auto get_rank = [this, &piece, &starts, &size](std::size_t start_idx, std::size_t skip) {
+            if (start_idx + skip + 2 < size) {
+                auto s = starts[start_idx];
+                auto e = starts[start_idx + skip + 2];
+                return static_cast<uint32_t>(_rank(piece.substr(s, e - s)));
             }
+            return MAX_RANK;
+        };
+
+        for (auto i = 0U; i < size - 2; ++i) {
+            ranks[i] = get_rank(i, 0);
+        }
+
+        while (size > 1) {
+            auto i = simd::argmin(ranks, size - 1);
+            if (ranks[i] == MAX_RANK) {
+                break;
+            }
+
+            ranks[i] = get_rank(i, 1);
+            if (i > 0) {
+                ranks[i - 1] = get_rank(i - 1, 1);
+            }
+
+            // Erase the (i + 1)-th part, and keep the padding.
+            auto cnt = size - (i + 2);
+            std::memmove(starts + i + 1, starts + i + 2, cnt * sizeof(uint32_t));
+            std::memmove(ranks + i + 1, ranks + i + 2, cnt * sizeof(uint32_t));
+            --size;
+            ranks[size - 1] = MAX_RANK;
+        }
+
+        for (auto i = 0U; i < size - 1; ++i) {
+            out.push_back(func(starts[i], starts[i + 1]));
+        }
+    }
+
+    // Append the BPE encoding of `piece` to `out`.
+    template <typename Tokens>
+    void _byte_pair_encode(std::string_view piece, Tokens &out, std::pmr::memory_resource *resource) const {
+        if (piece.size() == 1) {
+            auto rank = _rank(piece);
+            if (rank != _max_size()) {
+                out.push_back(rank);
+            } // else TODO: is it possible?
+            return;
+        }
+
+        if (_backtrack_encoder) {
+            _backtrack_encoder->encode(piece, out, resource);
+            return;
         }
 
-        return _byte_pair_merge(piece, encoder,
-                [&piece, &encoder](uint64_t start, uint64_t stop) {
-                    std::string key = piece.substr(start, stop - start);
-                    auto iter = encoder.find(key);
-                    if (iter != encoder.end()) {
-                        return iter->second;
+        if (_reference) {
+            auto tokens = _reference_byte_pair_merge(std::string(piece));
+            out.insert(out.end(), tokens.begin(), tokens.end());
+            return;
+        }
+
+        _byte_pair_merge(piece,
+                [this, piece](uint64_t start, uint64_t stop) {
+                    auto rank = _rank(piece.substr(start, stop - start));
+                    if (rank != _max_size()) {
+                        return rank;
                     } else {
                         // TODO: what if key does not exist? Should we return `unknown`?
                         // assert(false); // ??
                         return uint64_t(0);
                     }
-                });
+                }, out, resource);
+    }
+
+    // BpeEngine::REFERENCE is the original path, which optimized engines are checked against,
+    // so it shares none of their splitting or lookups. Keep it as is.
+    template <typename T>
+    std::pair<std::optional<std::string>, re2::StringPiece> _reference_split_with_allowed_special_token(
+            re2::StringPiece &input, const T &allowed_special) const {
+        if (!_special_token_regex) {
+            return std::make_pair(std::nullopt, input);
+        }
+
+        auto start = input.begin();
+        std::string special;
+        while (true) {
+            if (!re2::RE2::FindAndConsume(&input, *_special_token_regex, &special)) {
+                // No special token.
+                break;
+            }
+
+            if (allowed_special.count(special) == 1) {
+                // Found an allowed special token, split the text with it.
+                return std::make_pair(std::move(special), re2::StringPiece(start, input.begin() - start - special.size()));
+            } // else try to find the next special token
+        }
+
+        // The only change to the original, which dropped the text of disallowed special
+        // tokens it had consumed.
+        return std::make_pair(std::nullopt, re2::StringPiece(start, input.end() - start));
+    }
+
+    template <typename T, typename Tokens>
+    uint64_t _reference_encode_with_special_token(const std::string &text,
+            const T &allowed_special,
+            Tokens &tokens) const {
+        uint64_t last_piece_token_len = 0;
+        re2::StringPiece input(text);
+        while (true) {
+            auto [special, sub_input] = _reference_split_with_allowed_special_token(input, allowed_special);
+
+            _reference_encode(sub_input, tokens, last_piece_token_len);
+
+            if (special) {
+                uint64_t token = 0;
+                try {
+                    token = _special_token_encoder.at(*special);
+                } catch (const std::out_of_range &) {
+                    // Should never go here, since special pattern includes all special chars.
+                    assert(false);
+                }
+
+                tokens.push_back(token);
+                last_piece_token_len = 0;
+            } else {
+                break;
+            }
+        }
+
+        return last_piece_token_len;
+    }
+
+    template <typename Tokens>
+    void _reference_encode(re2::StringPiece &input, Tokens &ret, uint64_t &last_piece_token_len) const {
+        std::string piece;
+        assert(_regex);
+        while (re2::RE2::FindAndConsume(&input, *_regex, &piece)) {
+            auto rank = _reference_rank(piece);
+            if (rank != _max_size()) {
+                last_piece_token_len = 1;
+                ret.push_back(rank);
+                continue;
+            }
+            auto tokens = _reference_byte_pair_merge(piece);
+            last_piece_token_len = tokens.size();
+            ret.insert(ret.end(), tokens.begin(), tokens.end());
+        }
+    }
+
+    std::vector<uint64_t> _reference_byte_pair_merge(const std::string &piece) const {
+        if (piece.size() == 1) {
+            auto rank = _reference_rank(piece);
+            return rank != _max_size() ? std::vector<uint64_t>({rank}) : std::vector<uint64_t>();
+        }
+
+        // (start, rank of the byte pair starting at start), and the last rank is not valid.
+        std::vector<std::pair<uint64_t, uint64_t>> parts;
+        for (auto idx = 0U; idx < piece.size() + 1; ++idx) {
+            parts.emplace_back(idx, _max_size());
+        }
+
+        auto get_rank = [this, &piece, &parts](std::size_t start_idx, std::size_t skip) {
+            if (start_idx + skip + 2 < parts.size()) {
+                auto s = parts[start_idx].first;
+                auto e = parts[start_idx + skip + 2].first;
+                return _reference_rank(piece.substr(s, e - s));
+            }
+            return _max_size();
+        };
+
+        for (auto i = 0U; i + 2 < parts.size(); ++i) {
+            parts[i].second = get_rank(i, 0);
+        }
+
+        while (parts.size() > 1) {
+            auto min_rank = std::make_pair(_max_size(), std::size_t(0));
+            for (auto i = 0U; i < parts.size() - 1; ++i) {
+                if (parts[i].second < min_rank.first) {
+                    min_rank = std::make_pair(parts[i].second, std::size_t(i));
+                }
+            }
+
+            if (min_rank.first == _max_size()) {
+                break;
+            }
+
+            auto i = min_rank.second;
+            parts[i].second = get_rank(i, 1);
+            if (i > 0) {
+                parts[i - 1].second = get_rank(i - 1, 1);
+            }
+            parts.erase(parts.begin() + (i + 1));
+        }
+
+        std::vector<uint64_t> out;
+        for (auto i = 0U; i < parts.size() - 1; ++i) {
+            auto rank = _reference_rank(piece.substr(parts[i].first, parts[i + 1].first - parts[i].first));
+            out.push_back(rank != _max_size() ? rank : 0);
+        }
+        return out;
+    }
+
+    uint64_t _reference_rank(const std::string &key) const {
+        auto iter = _encoder.find(key);
+        return iter != _encoder.end() ? iter->second : _max_size();
+    }
+
+    // Returns _max_size() if `key` is not a token. Short keys never touch the general map,
+    // and long keys are looked up by view, so that no string is allocated.
+    uint64_t _rank(std::string_view key) const {
+        if (key.size() <= ShortRanks::MAX_SIZE && _short_ranks.enabled()) {
+            return _short_ranks.find(key);
+        }
+
+        auto iter = _long_ranks.find(key);
+        if (iter != _long_ranks.end()) {
+            return iter->second;
+        }
+
+        return _max_size();
+    }
+
+    // Keys are views of `_encoder`'s keys, whose nodes stay put when the object is moved.
+    void _build_long_ranks() {
+        for (const auto &[key, rank] : _encoder) {
+            if (key.size() > ShortRanks::MAX_SIZE || !_short_ranks.enabled()) {
+                _long_ranks.emplace(key, rank);
+            }
+        }
+
+        for (const auto &[key, rank] : _special_token_encoder) {
+            _special_token_ranks.emplace(key, rank);
+        }
     }
 
     Encoder _encoder;
     Encoder _special_token_encoder;
-    Decoder _decoder;
-    Decoder _special_token_decoder;
+    ShortRanks _short_ranks;
+
+    // Ranks of tokens which are not in `_short_ranks`.
+    std::unordered_map<std::string_view, uint64_t> _long_ranks;
+
+    // Same as `_special_token_encoder`, but looked up by view.
+    std::unordered_map<std::string_view, uint64_t> _special_token_ranks;
+
+    // Whether all ranks fit in 32 bits.
+    bool _narrow_ranks = false;
+
+    // Tokens looked up by `estimate_tokens`.
+    TokenSet _token_set;
+
+    std::array<double, NUM_BYTE_CLASS> _bytes_per_token = {};
+
+    // Only built for BpeEngine::BACKTRACK.
+    std::unique_ptr<BacktrackEncoder> _backtrack_encoder;
+
+    // Whether it's BpeEngine::REFERENCE.
+    bool _reference = false;
+
+    // Token -> its bytes in `_decoder_bytes`. The vector buffer stays at the same
+    // address when the object is moved, which `decode_views` relies on.
+    std::vector<TokenSlice> _decoder;
+    std::vector<char> _decoder_bytes;
+
+    // Tokens with outlier ids, which are not in `_decoder`.
+    std::unordered_map<uint64_t, TokenSlice> _sparse_decoder;
+
+    // One past the largest token.
+    std::size_t _n_vocab = 0;
 
     Re2UPtr _regex;
     Re2UPtr _special_token_regex;
+
+    // Only enabled for the bundled patterns.
+    PieceScanner _scanner;
+
+    std::size_t _max_special_token_size = 0;
 };
 
+using TiktokenSPtr = std::shared_ptr<const Tiktoken>;
+
 class TiktokenFactory {
 private:
     struct Config {
+        // Either a .tiktoken ranks file, or a HuggingFace tokenizer.json, which also
+        // has the pattern and special tokens.
         std::string path;
+        bool huggingface = false;
         Tiktoken::Encoder special_tokens;
         std::string pattern;
+        BpeEngine engine = BpeEngine::MERGE;
+
+        // Last write time of the ranks file when the config was parsed.
+        std::optional<std::filesystem::file_time_type> ranks_time;
+
+        bool operator==(const Config &other) const {
+            return path == other.path
+                && huggingface == other.huggingface
+                && special_tokens == other.special_tokens
+                && pattern == other.pattern
+                && engine == other.engine
+                && ranks_time == other.ranks_time;
+        }
     };
 
 public:
-    explicit TiktokenFactory(const std::string &config) {
+    explicit TiktokenFactory(const std::string &config) :
+        _config(config), _snapshot(_parse_snapshot(config)) {}
+
+    TiktokenFactory(const TiktokenFactory &) = delete;
+    TiktokenFactory& operator=(const TiktokenFactory &) = delete;
+
+    TiktokenFactory(TiktokenFactory &&) = delete;
+    TiktokenFactory& operator=(TiktokenFactory &&) = delete;
+
+    ~TiktokenFactory() = default;
+
+    Tiktoken create(const std::string &name) const {
+        auto snapshot = _current();
+        return _create(_entry(*snapshot, name).config);
+    }
+
+    // Create the encoding with the given BPE engine, instead of the configured one.
+    Tiktoken create(const std::string &name, BpeEngine engine) const {
+        auto snapshot = _current();
+        auto config = _entry(*snapshot, name).config;
+        config.engine = engine;
+        return _create(config);
+    }
+
+    Tiktoken create_for_model(const std::string &model) const {
+        return create(encoding_name_for_model(model));
+    }
+
+    // Returns the encoding name of the given model. Exact model names take precedence,
+    // otherwise the longest matching model prefix is used.
+    std::string encoding_name_for_model(const std::string &model) const {
+        auto snapshot = _current();
+        return _encoding_name_for_model(*snapshot, model);
+    }
+
+    // Returns the chat overhead of the given model, which is resolved the same way as
+    // its encoding, i.e. `model_to_chat_overhead` and `model_prefix_to_chat_overhead`.
+    ChatOverhead chat_overhead_for_model(const std::string &model) const {
+        auto snapshot = _current();
+        return _chat_overhead_for_model(*snapshot, model);
+    }
+
+    // Count tokens of a chat request with the encoding and chat overhead of the given model.
+    ChatTokenCount count_chat_tokens(const std::string &model,
+            const std::vector<ChatMessage> &messages,
+            std::size_t threads = 1) const {
+        auto snapshot = _current();
+        auto overhead = _chat_overhead_for_model(*snapshot, model);
+        auto tiktoken = _get(_entry(*snapshot, _encoding_name_for_model(*snapshot, model)));
+
+        return tiktoken->count_chat_tokens(messages, overhead, threads);
+    }
+
+    // Lazy mode: the encoding is loaded on first use, and shared by all following calls.
+    // If it's being loaded by other thread, e.g. `preload`, this call blocks until it's ready.
+    TiktokenSPtr get(const std::string &name) const {
+        auto snapshot = _current();
+        return _get(_entry(*snapshot, name));
+    }
+
+    TiktokenSPtr get_for_model(const std::string &model) const {
+        auto snapshot = _current();
+        return _get(_entry(*snapshot, _encoding_name_for_model(*snapshot, model)));
+    }
+
+    // Load the encoding in a background thread, and return a future which becomes ready,
+    // once the encoding is resident. Call `get` to fetch the loaded encoding.
+    std::shared_future<TiktokenSPtr> preload(const std::string &name) const {
+        auto snapshot = _current();
+        return _load(_entry(*snapshot, name), std::launch::async);
+    }
+
+    // Re-parse the config file, rebuild encodings that have been loaded and whose config
+    // or ranks file has been changed, and then publish them all at once. The rebuilding
+    // happens in the calling thread, and if it fails, the current encodings are kept.
+    //
+    // Callers holding a `TiktokenSPtr` keep working on the old encoding, which is
+    // released once the last reference to it goes away. Encodings that have never been
+    // loaded stay lazy.
+    void reload() {
+        std::lock_guard<std::mutex> lock(_reload_mutex);
+
+        auto snapshot = _parse_snapshot(_config);
+        auto current = _current();
+        for (auto &[name, entry] : snapshot->encodings) {
+            auto iter = current->encodings.find(name);
+            if (iter == current->encodings.end()) {
+                continue;
+            }
+
+            const auto &old_entry = iter->second;
+            auto old_tiktoken = _loaded(old_entry);
+            if (!old_tiktoken) {
+                continue;
+            }
+
+            TiktokenSPtr tiktoken;
+            if (entry.config == old_entry.config) {
+                tiktoken = std::move(old_tiktoken);
+            } else {
+                tiktoken = std::make_shared<Tiktoken>(_create(entry.config));
+            }
+
+            std::promise<TiktokenSPtr> promise;
+            promise.set_value(tiktoken);
+            entry.tiktoken = promise.get_future().share();
+            _set_ready(entry, std::move(tiktoken));
+        }
+
+        _publish(SnapshotSPtr(std::move(snapshot)));
+    }
+
+private:
+    struct Entry {
+        explicit Entry(Config conf) : config(std::move(conf)) {}
+
+        Config config;
+
+        // Protect `tiktoken`.
+        mutable std::mutex mutex;
+
+        // Invalid until the encoding is requested.
+        mutable std::shared_future<TiktokenSPtr> tiktoken;
+
+        // Set once `tiktoken` is ready, and never changed after that, so that a loaded
+        // encoding is read without locking `mutex`.
+        mutable std::atomic<bool> ready{false};
+        mutable TiktokenSPtr ready_tiktoken;
+    };
+
+    // Values of models, which are looked up by exact model names first, and then by the
+    // longest matching model prefix.
+    template <typename T>
+    struct ModelTable {
+        std::unordered_map<std::string, T> models;
+
+        std::unordered_map<std::string, T> prefixes;
+
+        // Distinct sizes of model prefixes in descending order.
+        std::vector<std::size_t> prefix_sizes;
+
+        void set_prefixes(std::unordered_map<std::string, T> table) {
+            prefixes = std::move(table);
+            prefix_sizes.clear();
+            for (const auto &ele : prefixes) {
+                prefix_sizes.push_back(ele.first.size());
+            }
+            // Try longer prefixes first, so that the longest one wins.
+            std::sort(prefix_sizes.begin(), prefix_sizes.end(), std::greater<std::size_t>());
+            prefix_sizes.erase(std::unique(prefix_sizes.begin(), prefix_sizes.end()), prefix_sizes.end());
+        }
+
+        // Returns nullptr, if no model matches.
+        const T* find(const std::string &model) const {
+            auto iter = models.find(model);
+            if (iter != models.end()) {
+                return &iter->second;
+            }
+
+            for (auto size : prefix_sizes) {
+                if (size > model.size()) {
+                    continue;
+                }
+
+                iter = prefixes.find(model.substr(0, size));
+                if (iter != prefixes.end()) {
+                    return &iter->second;
+                }
+            }
+
+            return nullptr;
+        }
+    };
+
+    // Immutable once published, except for the lazily loaded encodings.
+    struct Snapshot {
+        std::unordered_map<std::string, Entry> encodings;
+
+        ModelTable<std::string> model_encodings;
+
+        ModelTable<ChatOverhead> chat_overheads;
+    };
+
+    using SnapshotSPtr = std::shared_ptr<const Snapshot>;
+
+    // Readers copy the current snapshot, and keep it alive until they're done, even if a
+    // reload publishes a new one in the meantime.
+    SnapshotSPtr _current() const {
+        return std::atomic_load(&_snapshot);
+    }
+
+    // Only called by `reload`, i.e. with `_reload_mutex` locked.
+    void _publish(SnapshotSPtr snapshot) {
+        std::atomic_store(&_snapshot, std::move(snapshot));
+    }
+
+    static std::unique_ptr<Snapshot> _parse_snapshot(const std::string &config) {
+        auto snapshot = std::make_unique<Snapshot>();
+
         auto conf = Toml::parse(config);
         for (auto &[name, value] : conf["encodings"].items()) {
-            if (!_encodings.emplace(name, _parse_config(*value)).second) {
+            if (!snapshot->encodings.emplace(name, _parse_config(*value)).second) {
                 throw Error("duplicate encoding conf");
             }
         }
+
+        if (conf.contains("model_to_encoding")) {
+            snapshot->model_encodings.models = _parse_model_table(*snapshot, conf["model_to_encoding"]);
+        }
+
+        if (conf.contains("model_prefix_to_encoding")) {
+            snapshot->model_encodings.set_prefixes(
+                    _parse_model_table(*snapshot, conf["model_prefix_to_encoding"]));
+        }
+
+        if (conf.contains("model_to_chat_overhead")) {
+            snapshot->chat_overheads.models = _parse_chat_overhead_table(conf["model_to_chat_overhead"]);
+        }
+
+        if (conf.contains("model_prefix_to_chat_overhead")) {
+            snapshot->chat_overheads.set_prefixes(
+                    _parse_chat_overhead_table(conf["model_prefix_to_chat_overhead"]));
+        }
+
+        return snapshot;
     }
 
-    Tiktoken create(const std::string &name) const {
-        auto iter = _encodings.find(name);
-        if (iter == _encodings.end()) {
+    static const Entry& _entry(const Snapshot &snapshot, const std::string &name) {
+        auto iter = snapshot.encodings.find(name);
+        if (iter == snapshot.encodings.end()) {
             throw Error("unknown name: " + name);
         }
 
-        return _create(iter->second);
+        return iter->second;
     }
 
-private:
-    Tiktoken _create(const Config &config) const {
+    static const std::string& _encoding_name_for_model(const Snapshot &snapshot, const std::string &model) {
+        const auto *encoding = snapshot.model_encodings.find(model);
+        if (encoding == nullptr) {
+            throw Error("unknown model: " + model);
+        }
+
+        return *encoding;
+    }
+
+    static const ChatOverhead& _chat_overhead_for_model(const Snapshot &snapshot, const std::string &model) {
+        const auto *overhead = snapshot.chat_overheads.find(model);
+        if (overhead == nullptr) {
+            throw Error("no chat overhead for model: " + model);
+        }
+
+        return *overhead;
+    }
+
+    static TiktokenSPtr _get(const Entry &entry) {
+        if (entry.ready.load(std::memory_order_acquire)) {
+            return entry.ready_tiktoken;
+        }
+
+        auto tiktoken = _load(entry, std::launch::deferred);
+        TiktokenSPtr loaded;
+        try {
+            loaded = tiktoken.get();
+        } catch (...) {
+            // Do not cache the failure, so that we can retry next time.
+            std::lock_guard<std::mutex> lock(entry.mutex);
+            if (entry.tiktoken.valid()
+                    && entry.tiktoken.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+                entry.tiktoken = {};
+            }
+            throw;
+        }
+
+        std::lock_guard<std::mutex> lock(entry.mutex);
+        if (!entry.ready.load(std::memory_order_relaxed)) {
+            _set_ready(entry, loaded);
+        }
+
+        return loaded;
+    }
+
+    // Either `entry.mutex` is locked, or `entry` hasn't been published.
+    static void _set_ready(const Entry &entry, TiktokenSPtr tiktoken) {
+        entry.ready_tiktoken = std::move(tiktoken);
+        entry.ready.store(true, std::memory_order_release);
+    }
+
+    static std::shared_future<TiktokenSPtr> _load(const Entry &entry, std::launch policy) {
+        std::lock_guard<std::mutex> lock(entry.mutex);
+        if (!entry.tiktoken.valid()) {
+            // Copy the config, since the snapshot might be released before the loading finishes.
+            entry.tiktoken = std::async(policy, [config = entry.config]() {
+                        return TiktokenSPtr(std::make_shared<Tiktoken>(_create(config)));
+                    }).share();
+        }
+
+        return entry.tiktoken;
+    }
+
+    // Returns the encoding if it has been requested, and waits for it if it's still loading.
+    // Returns nullptr if it has never been requested, or failed to load.
+    static TiktokenSPtr _loaded(const Entry &entry) {
+        if (entry.ready.load(std::memory_order_acquire)) {
+            return entry.ready_tiktoken;
+        }
+
+        std::shared_future<TiktokenSPtr> tiktoken;
+        {
+            std::lock_guard<std::mutex> lock(entry.mutex);
+            tiktoken = entry.tiktoken;
+        }
+
+        if (!tiktoken.valid()) {
+            return nullptr;
+        }
+
+        try {
+            return tiktoken.get();
+        } catch (const std::exception &) {
+            return nullptr;
+        }
+    }
+
+    static Tiktoken _create(const Config &config) {
+        if (config.huggingface) {
+            auto model = HfBpeLoader::load(config.path);
+
+            // Special tokens in the config are added to those of the model.
+            model.special_tokens.insert(config.special_tokens.begin(), config.special_tokens.end());
+
+            return Tiktoken(std::move(model.ranks), std::move(model.special_tokens), model.pattern, config.engine);
+        }
+
         auto encoder = _load_encoder(config.path);
 
-        return Tiktoken(std::move(encoder), config.special_tokens, config.pattern);
+        return Tiktoken(std::move(encoder), config.special_tokens, config.pattern, config.engine);
     }
 
-    Tiktoken::Encoder _load_encoder(const std::string &path) const {
+    static Tiktoken::Encoder _load_encoder(const std::string &path) {
         std::ifstream file(path);
         if (!file) {
             throw Error("failed to open encoder file: " + path);
@@ -401,33 +2000,103 @@ private:
         return encoder;
     }
 
-    std::pair<std::string, uint64_t> _parse(const std::string &line) const {
+    static std::pair<std::string, uint64_t> _parse(const std::string &line) {
         auto pos = line.find(" ");
         if (pos == std::string::npos) {
             throw Error("invalid encoder line: " + line);
         }
 
         auto token = base64::decode({line.data(), pos});
+
+        // Parse in place, instead of allocating a substring for each line.
         uint64_t rank = 0;
-        try {
-            rank = std::stoul(line.substr(pos + 1));
-        } catch (const std::exception &) {
+        if (std::from_chars(line.data() + pos + 1, line.data() + line.size(), rank).ec != std::errc()) {
             throw Error("invalid encoder rank: " + line);
         }
 
         return {std::move(token), rank};
     }
 
-    Config _parse_config(const Toml &value) const {
+    static Config _parse_config(const Toml &value) {
         Config conf;
-        conf.path = value["ranks"].get<std::string>();
-        conf.pattern = value["pattern"].get<std::string>();
-        conf.special_tokens = value["special_tokens"].get<std::unordered_map<std::string, uint64_t>>();
+        if (value.contains("tokenizer_json")) {
+            conf.path = value["tokenizer_json"].get<std::string>();
+            conf.huggingface = true;
+            if (value.contains("special_tokens")) {
+                conf.special_tokens = value["special_tokens"].get<std::unordered_map<std::string, uint64_t>>();
+            }
+        } else {
+            conf.path = value["ranks"].get<std::string>();
+            conf.pattern = value["pattern"].get<std::string>();
+            conf.special_tokens = value["special_tokens"].get<std::unordered_map<std::string, uint64_t>>();
+        }
+        if (value.contains("engine")) {
+            conf.engine = _parse_engine(value["engine"].get<std::string>());
+        }
+
+        std::error_code ec;
+        auto ranks_time = std::filesystem::last_write_time(conf.path, ec);
+        if (!ec) {
+            conf.ranks_time = ranks_time;
+        }
 
         return conf;
     }
 
-    std::unordered_map<std::string, Config> _encodings;
+    static BpeEngine _parse_engine(const std::string &engine) {
+        if (engine == "merge") {
+            return BpeEngine::MERGE;
+        } else if (engine == "backtrack") {
+            return BpeEngine::BACKTRACK;
+        } else if (engine == "reference") {
+            return BpeEngine::REFERENCE;
+        } else {
+            throw Error("unknown bpe engine: " + engine);
+        }
+    }
+
+    static std::unordered_map<std::string, std::string> _parse_model_table(const Snapshot &snapshot,
+            const Toml &value) {
+        auto table = value.get<std::unordered_map<std::string, std::string>>();
+        for (const auto &[model, encoding] : table) {
+            if (snapshot.encodings.find(encoding) == snapshot.encodings.end()) {
+                throw Error("model " + model + " has unknown encoding: " + encoding);
+            }
+        }
+
+        return table;
+    }
+
+    // Each item is an inline table, e.g. {tokens_per_message = 3, tokens_per_name = 1,
+    // tokens_per_reply = 3}, and missing fields take the defaults of `ChatOverhead`.
+    static std::unordered_map<std::string, ChatOverhead> _parse_chat_overhead_table(const Toml &value) {
+        std::unordered_map<std::string, ChatOverhead> table;
+        for (const auto &[model, conf] : value.items()) {
+            ChatOverhead overhead;
+            for (const auto &[key, val] : conf->get<std::unordered_map<std::string, int64_t>>()) {
+                if (key == "tokens_per_message") {
+                    overhead.tokens_per_message = val;
+                } else if (key == "tokens_per_name") {
+                    overhead.tokens_per_name = val;
+                } else if (key == "tokens_per_reply") {
+                    overhead.tokens_per_reply = val;
+                } else {
+                    throw Error("unknown chat overhead of model " + model + ": " + key);
+                }
+            }
+            table.emplace(model, overhead);
+        }
+
+        return table;
+    }
+
+    std::string _config;
+
+    // Serialize reloads.
+    std::mutex _reload_mutex;
+
+    // Only accessed with std::atomic_load and std::atomic_store, see `_current` and `_publish`.
+    SnapshotSPtr _snapshot;
 };
 
 }
@@ -0,0 +1,182 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+#ifndef SEWENEW_TOKENIZER_TOKEN_SET_H
+#define SEWENEW_TOKENIZER_TOKEN_SET_H
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace sw::tokenizer {
+
+// Membership of tokens no longer than 15 bytes, for `Tiktoken::estimate_tokens`, which
+// looks up nearly every piece of the input, and every 2, 3 and 4 bytes of other pieces.
+// Ranks are in `ShortRanks`, whose probing is too branchy for that many lookups.
+//
+// A key is read with fixed size loads, and compared with all slots of its bucket, so that
+// there's no branch on the data. A token whose bucket is full is dropped, i.e. lookups
+// might return false for a token, but never return true for a non-token. Callers must
+// treat false as unknown. Tokens are inserted by rank, so that only rare ones are dropped.
+class TokenSet {
+public:
+    static constexpr std::size_t MAX_SIZE = 15;
+
+    // Number of bytes `contains(const char *, std::size_t)` reads.
+    static constexpr std::size_t READ_SIZE = 16;
+
+    // An empty set still has its tables, so that lookups never check for them.
+    TokenSet() : TokenSet(std::unordered_map<std::string, uint64_t>{}) {}
+
+    explicit TokenSet(const std::unordered_map<std::string, uint64_t> &ranks) {
+        std::vector<std::pair<uint64_t, std::string_view>> tokens;
+        for (const auto &[token, rank] : ranks) {
+            if (!token.empty() && token.size() <= MAX_SIZE) {
+                tokens.emplace_back(rank, token);
+            }
+        }
+        std::sort(tokens.begin(), tokens.end());
+
+        // No more than 1 key per bucket on average, so that few buckets overflow.
+        // Shifting by 64 bits is undefined, so there're at least 2 buckets.
+        auto capacity = std::max<std::size_t>(_capacity(tokens.size() * 2), 2);
+        _buckets.assign(capacity, Bucket{});
+        _shift = 64;
+        while ((std::size_t(1) << (64 - _shift)) < capacity) {
+            --_shift;
+        }
+
+        for (std::size_t size = 0; size < _layouts.size(); ++size) {
+            _layouts[size] = _layout(size);
+        }
+
+        for (const auto &ele : tokens) {
+            auto token = ele.second;
+            _insert(_key(_pad(token).data(), token.size()));
+        }
+    }
+
+    // `data` must be readable for READ_SIZE bytes, no matter what `size` is.
+    bool contains(const char *data, std::size_t size) const {
+        assert(size > 0 && size <= MAX_SIZE);
+
+        auto key = _key(data, size);
+        const auto &slots = _buckets[_bucket(key)].slots;
+        auto equal = [&key](const Key &slot) {
+            return ((slot.low ^ key.low) | (slot.high ^ key.high)) == 0;
+        };
+
+        return equal(slots[0]) | equal(slots[1]);
+    }
+
+    bool contains(std::string_view token) const {
+        assert(!token.empty() && token.size() <= MAX_SIZE);
+
+        return contains(_pad(token).data(), token.size());
+    }
+
+private:
+    static std::size_t _capacity(std::size_t cnt) {
+        std::size_t capacity = 1;
+        while (capacity * 2 < cnt) {
+            capacity <<= 1;
+        }
+
+        return capacity;
+    }
+
+    // An empty slot is all zeros, which never equals a key, since it has the size.
+    struct Key {
+        uint64_t low = 0;
+        uint64_t high = 0;
+    };
+
+    struct alignas(32) Bucket {
+        std::array<Key, 2> slots;
+    };
+
+    // Masks to keep the first `size` bytes, and the size in the last byte, which is
+    // never kept. They're built from bytes, so that they work for any byte order.
+    struct Layout {
+        uint64_t low_mask = 0;
+        uint64_t high_mask = 0;
+        uint64_t high_size = 0;
+    };
+
+    static Layout _layout(std::size_t size) {
+        std::array<unsigned char, READ_SIZE> mask = {};
+        std::array<unsigned char, READ_SIZE> tag = {};
+        std::memset(mask.data(), 0xff, size);
+        tag.back() = static_cast<unsigned char>(size);
+
+        Layout layout;
+        std::memcpy(&layout.low_mask, mask.data(), 8);
+        std::memcpy(&layout.high_mask, mask.data() + 8, 8);
+        std::memcpy(&layout.high_size, tag.data() + 8, 8);
+        return layout;
+    }
+
+    static std::array<char, READ_SIZE> _pad(std::string_view token) {
+        std::array<char, READ_SIZE> buf = {};
+        std::memcpy(buf.data(), token.data(), token.size());
+        return buf;
+    }
+
+    Key _key(const char *data, std::size_t size) const {
+        const auto &layout = _layouts[size];
+        Key key;
+        std::memcpy(&key.low, data, 8);
+        std::memcpy(&key.high, data + 8, 8);
+        key.low &= layout.low_mask;
+        key.high = (key.high & layout.high_mask) | layout.high_size;
+        return key;
+    }
+
+    // The highest bits of the product depend on all bits of the key.
+    std::size_t _bucket(const Key &key) const {
+        auto hash = (key.low ^ key.high) * 0x9E3779B97F4A7C15ULL;
+        return static_cast<std::size_t>(hash >> _shift);
+    }
+
+    void _insert(const Key &key) {
+        for (auto &slot : _buckets[_bucket(key)].slots) {
+            if (slot.high == 0) {
+                slot = key;
+                return;
+            }
+        }
+
+        // The bucket is full, and the token is dropped.
+    }
+
+    std::vector<Bucket> _buckets;
+
+    // 64 minus the number of bits of a bucket index.
+    unsigned _shift = 64;
+
+    std::array<Layout, MAX_SIZE + 1> _layouts;
+};
+
+}
+
+#endif // end SEWENEW_TOKENIZER_TOKEN_SET_H
@@ -17,6 +17,7 @@
 #ifndef SEWENEW_TIKTOKEN_TOML_H
 #define SEWENEW_TIKTOKEN_TOML_H
 
+#include <cassert>
 #include <map>
 #include <fstream>
 #include <string>
@@ -346,6 +347,14 @@ public:
         }
     }
 
+    bool contains(const std::string &key) const {
+        if (auto *p = std::get_if<Object>(&_value)) {
+            return p->find(key) != p->end();
+        }
+
+        return false;
+    }
+
     std::map<std::string, const Toml*> items() const {
         if (const auto *p = std::get_if<Object>(&_value)) {
             std::map<std::string, const Toml*> result;
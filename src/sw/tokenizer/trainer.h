@@ -0,0 +1,390 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+#ifndef SEWENEW_TOKENIZER_TRAINER_H
+#define SEWENEW_TOKENIZER_TRAINER_H
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "re2/re2.h"
+#include "sw/tokenizer/base64.h"
+#include "sw/tokenizer/errors.h"
+#include "sw/tokenizer/tiktoken.h"
+
+namespace sw::tokenizer {
+
+struct TrainerOptions {
+    // Number of tokens to learn, including the 256 single bytes.
+    std::size_t vocab_size = 100000;
+
+    // Stop merging, if the most frequent pair occurs less than this.
+    uint64_t min_frequency = 2;
+
+    // Number of threads to count pieces. 0 means the number of hardware threads.
+    std::size_t threads = 0;
+};
+
+// Learn a byte level BPE vocabulary, whose ranks are the merge order, so that it can be used
+// by Tiktoken, and saved as a .tiktoken file.
+//
+// Texts are split into pieces with the same pattern as the encoding, and pieces are counted
+// in parallel. Then each distinct piece is a word of symbols, which initially are its bytes.
+// The most frequent adjacent pair is merged into a new symbol, until the vocabulary is
+// large enough. Pair counts are updated incrementally, only for words which contain
+// the merged pair, and the most frequent pair is found with a priority queue, whose stale
+// entries are skipped lazily.
+class BpeTrainer {
+public:
+    explicit BpeTrainer(const std::string &pattern, TrainerOptions opts = {}) : _opts(opts) {
+        if (_opts.vocab_size < BYTE_TOKENS) {
+            throw Error("vocab size must be at least " + std::to_string(BYTE_TOKENS));
+        }
+
+        if (_opts.threads == 0) {
+            _opts.threads = std::max(1U, std::thread::hardware_concurrency());
+        }
+
+        _regex = std::make_unique<re2::RE2>(pattern);
+        if (!_regex->ok()) {
+            throw Error("invalid pattern: " + _regex->error());
+        }
+
+        _piece_counts.resize(_opts.threads);
+    }
+
+    BpeTrainer(const BpeTrainer &) = delete;
+    BpeTrainer& operator=(const BpeTrainer &) = delete;
+
+    BpeTrainer(BpeTrainer &&) = default;
+    BpeTrainer& operator=(BpeTrainer &&) = default;
+
+    // Count pieces of `text`. It can be called multiple times, e.g. once for each file.
+    //
+    // The text is split into one shard per thread, after a newline followed by an ASCII
+    // letter or digit, where all patterns of shipped encodings start a new piece. Each
+    // thread counts pieces of its shard, and partitions them by hash, then each thread
+    // merges one partition of all threads into the total counts.
+    void count(std::string_view text) {
+        auto shards = _split(text);
+        auto threads = _opts.threads;
+
+        // counts[shard][partition]
+        using Counts = std::unordered_map<std::string_view, uint64_t>;
+        std::vector<std::vector<Counts>> counts(shards.size(), std::vector<Counts>(threads));
+        _run(shards.size(), [&](std::size_t idx) { _count(shards[idx], counts[idx]); });
+
+        _run(threads, [&](std::size_t partition) {
+                    auto &total = _piece_counts[partition];
+                    for (auto &shard : counts) {
+                        for (const auto &[piece, cnt] : shard[partition]) {
+                            total[std::string(piece)] += cnt;
+                        }
+                        Counts{}.swap(shard[partition]);
+                    }
+                });
+    }
+
+    // Learn the vocabulary from pieces counted so far. Token ranks are the merge order,
+    // and the 256 single bytes take the first ranks.
+    Tiktoken::Encoder train() {
+        _init();
+
+        while (_tokens.size() < _opts.vocab_size && !_queue.empty()) {
+            auto [cnt, pair] = _queue.top();
+            _queue.pop();
+
+            auto iter = _pair_counts.find(pair);
+            if (iter == _pair_counts.end() || iter->second != cnt) {
+                // Stale entry, the count has changed since it was pushed.
+                if (iter != _pair_counts.end() && iter->second > 0) {
+                    _queue.emplace(iter->second, pair);
+                }
+                continue;
+            }
+
+            if (cnt < static_cast<int64_t>(_opts.min_frequency)) {
+                break;
+            }
+
+            _merge(pair);
+        }
+
+        Tiktoken::Encoder encoder;
+        for (std::size_t rank = 0; rank < _tokens.size(); ++rank) {
+            encoder.emplace(_tokens[rank], rank);
+        }
+
+        return encoder;
+    }
+
+    // Save `encoder` in the .tiktoken format, i.e. base64 encoded token and rank per line.
+    static void save(const Tiktoken::Encoder &encoder, const std::string &path) {
+        std::vector<std::pair<uint64_t, const std::string*>> tokens;
+        tokens.reserve(encoder.size());
+        for (const auto &[token, rank] : encoder) {
+            tokens.emplace_back(rank, &token);
+        }
+        std::sort(tokens.begin(), tokens.end());
+
+        std::ofstream file(path);
+        if (!file) {
+            throw Error("failed to open rank file: " + path);
+        }
+
+        for (const auto &[rank, token] : tokens) {
+            file << base64::encode(*token) << " " << rank << "\n";
+        }
+
+        if (!file.flush()) {
+            throw Error("failed to write rank file: " + path);
+        }
+    }
+
+private:
+    static constexpr std::size_t BYTE_TOKENS = 256;
+
+    struct Word {
+        std::vector<uint32_t> symbols;
+        int64_t count;
+    };
+
+    static uint64_t _pair(uint32_t left, uint32_t right) {
+        return (static_cast<uint64_t>(left) << 32) | right;
+    }
+
+    std::vector<std::string_view> _split(std::string_view text) const {
+        std::vector<std::string_view> shards;
+        auto size = text.size() / _opts.threads + 1;
+        std::size_t begin = 0;
+        while (begin < text.size()) {
+            auto end = begin + size;
+            while (end < text.size()
+                    && !(text[end - 1] == '\n' && std::isalnum(static_cast<unsigned char>(text[end])))) {
+                ++end;
+            }
+            end = std::min(end, text.size());
+            shards.push_back(text.substr(begin, end - begin));
+            begin = end;
+        }
+
+        return shards;
+    }
+
+    template <typename Func>
+    static void _run(std::size_t cnt, Func &&func) {
+        std::vector<std::thread> threads;
+        std::vector<std::exception_ptr> errors(cnt);
+        for (std::size_t idx = 0; idx < cnt; ++idx) {
+            threads.emplace_back([&func, &errors, idx]() {
+                        try {
+                            func(idx);
+                        } catch (...) {
+                            errors[idx] = std::current_exception();
+                        }
+                    });
+        }
+
+        for (auto &thread : threads) {
+            thread.join();
+        }
+
+        for (auto &err : errors) {
+            if (err) {
+                std::rethrow_exception(err);
+            }
+        }
+    }
+
+    void _count(std::string_view shard,
+            std::vector<std::unordered_map<std::string_view, uint64_t>> &counts) const {
+        std::unordered_map<std::string_view, uint64_t> local;
+        re2::StringPiece input(shard.data(), shard.size());
+        re2::StringPiece piece;
+        while (true) {
+            // Same as Tiktoken, try an anchored match first, since pieces are usually adjacent.
+            if (!_regex->Match(input, 0, input.size(), re2::RE2::ANCHOR_START, &piece, 1)
+                    && !_regex->Match(input, 0, input.size(), re2::RE2::UNANCHORED, &piece, 1)) {
+                break;
+            }
+
+            input.remove_prefix(static_cast<std::size_t>(piece.data() + piece.size() - input.data()));
+            if (piece.empty()) {
+                break;
+            }
+
+            ++local[std::string_view(piece.data(), piece.size())];
+        }
+
+        std::hash<std::string_view> hasher;
+        for (const auto &[piece, cnt] : local) {
+            counts[hasher(piece) % counts.size()][piece] += cnt;
+        }
+    }
+
+    void _init() {
+        _tokens.clear();
+        _token_ids.clear();
+        for (std::size_t idx = 0; idx < BYTE_TOKENS; ++idx) {
+            _tokens.emplace_back(1, static_cast<char>(idx));
+            _token_ids.emplace(_tokens.back(), static_cast<uint32_t>(idx));
+        }
+
+        _words.clear();
+        for (auto &partition : _piece_counts) {
+            for (const auto &[piece, cnt] : partition) {
+                if (piece.size() < 2) {
+                    continue;
+                }
+
+                Word word;
+                word.count = static_cast<int64_t>(cnt);
+                for (auto c : piece) {
+                    word.symbols.push_back(static_cast<unsigned char>(c));
+                }
+                _words.push_back(std::move(word));
+            }
+        }
+
+        _pair_counts.clear();
+        _pair_words.clear();
+        for (std::size_t idx = 0; idx < _words.size(); ++idx) {
+            const auto &word = _words[idx];
+            for (std::size_t pos = 0; pos + 1 < word.symbols.size(); ++pos) {
+                auto pair = _pair(word.symbols[pos], word.symbols[pos + 1]);
+                _pair_counts[pair] += word.count;
+                _pair_words[pair].push_back(static_cast<uint32_t>(idx));
+            }
+        }
+
+        _queue = Queue{};
+        for (const auto &[pair, cnt] : _pair_counts) {
+            _queue.emplace(cnt, pair);
+        }
+    }
+
+    void _merge(uint64_t pair) {
+        auto left = static_cast<uint32_t>(pair >> 32);
+        auto right = static_cast<uint32_t>(pair);
+
+        // The same bytes might be merged from different pairs, e.g. "ab" + "c" and "a" + "bc".
+        // They share the same token.
+        auto bytes = _tokens[left] + _tokens[right];
+        auto [token_iter, inserted] = _token_ids.emplace(bytes, static_cast<uint32_t>(_tokens.size()));
+        if (inserted) {
+            _tokens.push_back(std::move(bytes));
+        }
+        auto merged = token_iter->second;
+
+        auto words = std::move(_pair_words[pair]);
+        _pair_words.erase(pair);
+        _pair_counts.erase(pair);
+
+        std::sort(words.begin(), words.end());
+        words.erase(std::unique(words.begin(), words.end()), words.end());
+
+        // Pairs with the merged token, whose counts have increased.
+        std::vector<uint64_t> changed;
+        auto update = [this, &changed, merged](uint32_t first, uint32_t second, int64_t delta, uint32_t word_idx) {
+            auto key = _pair(first, second);
+            _pair_counts[key] += delta;
+            if (delta > 0 && (first == merged || second == merged)) {
+                auto &pair_words = _pair_words[key];
+                if (pair_words.empty() || pair_words.back() != word_idx) {
+                    pair_words.push_back(word_idx);
+                }
+                changed.push_back(key);
+            }
+        };
+
+        for (auto word_idx : words) {
+            auto &word = _words[word_idx];
+            auto &symbols = word.symbols;
+            for (std::size_t pos = 0; pos + 1 < symbols.size(); ++pos) {
+                if (symbols[pos] != left || symbols[pos + 1] != right) {
+                    continue;
+                }
+
+                if (pos > 0) {
+                    update(symbols[pos - 1], left, -word.count, word_idx);
+                    update(symbols[pos - 1], merged, word.count, word_idx);
+                }
+
+                if (pos + 2 < symbols.size()) {
+                    update(right, symbols[pos + 2], -word.count, word_idx);
+                    update(merged, symbols[pos + 2], word.count, word_idx);
+                }
+
+                symbols[pos] = merged;
+                symbols.erase(symbols.begin() + pos + 1);
+            }
+        }
+
+        // Counts of the merged pair have been decreased by overlapping occurrences, e.g. "aaa".
+        _pair_counts.erase(pair);
+
+        std::sort(changed.begin(), changed.end());
+        changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+        for (auto key : changed) {
+            _queue.emplace(_pair_counts[key], key);
+        }
+    }
+
+    TrainerOptions _opts;
+
+    std::unique_ptr<re2::RE2> _regex;
+
+    // Piece counts partitioned by hash, so that they can be merged in parallel.
+    std::vector<std::unordered_map<std::string, uint64_t>> _piece_counts;
+
+    // Tokens in rank order.
+    std::vector<std::string> _tokens;
+    std::unordered_map<std::string, uint32_t> _token_ids;
+
+    std::vector<Word> _words;
+
+    std::unordered_map<uint64_t, int64_t> _pair_counts;
+
+    // Words which might contain the pair. Words which no longer do are skipped when merging.
+    std::unordered_map<uint64_t, std::vector<uint32_t>> _pair_words;
+
+    // (count, pair), the most frequent pair first, and the smaller pair wins a tie.
+    struct QueueCompare {
+        bool operator()(const std::pair<int64_t, uint64_t> &lhs, const std::pair<int64_t, uint64_t> &rhs) const {
+            return lhs.first < rhs.first || (lhs.first == rhs.first && lhs.second > rhs.second);
+        }
+    };
+
+    using Queue = std::priority_queue<std::pair<int64_t, uint64_t>,
+                                        std::vector<std::pair<int64_t, uint64_t>>,
+                                        QueueCompare>;
+
+    Queue _queue;
+};
+
+}
+
+#endif // end SEWENEW_TOKENIZER_TRAINER_H
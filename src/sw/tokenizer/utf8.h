@@ -0,0 +1,291 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+#ifndef SEWENEW_TOKENIZER_UTF8_H
+#define SEWENEW_TOKENIZER_UTF8_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include "sw/tokenizer/errors.h"
+#include "sw/tokenizer/simd.h"
+
+namespace sw::tokenizer::utf8 {
+
+// How to handle invalid UTF-8, the same as the `errors` argument of Python's `bytes.decode`.
+enum class ErrorMode {
+    // Throw Utf8Error with the offset of the first invalid sequence.
+    STRICT = 0,
+
+    // Replace each maximal invalid subpart with U+FFFD.
+    REPLACE,
+
+    // Drop invalid subparts.
+    IGNORE
+};
+
+inline constexpr char REPLACEMENT_CHARACTER[] = "\xEF\xBF\xBD";
+
+namespace detail {
+
+using IsValidFunc = bool (*)(const char *, std::size_t);
+
+// Returns the size of the valid character at the beginning of `data`, or 0 if it's invalid.
+// In the latter case, `invalid` is set to the size of the maximal subpart of an ill-formed
+// sequence, see Unicode Standard 3.9, which is what Python replaces with one U+FFFD.
+inline std::size_t next_char(const unsigned char *data, std::size_t size, std::size_t &invalid) {
+    auto c = data[0];
+    if (c < 0x80) {
+        return 1;
+    }
+
+    // Number of continuation bytes, and the range of the first one.
+    std::size_t cnt = 0;
+    unsigned char lower = 0x80;
+    unsigned char upper = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) {
+        cnt = 1;
+    } else if (c == 0xE0) {
+        cnt = 2;
+        lower = 0xA0;
+    } else if ((c >= 0xE1 && c <= 0xEC) || c == 0xEE || c == 0xEF) {
+        cnt = 2;
+    } else if (c == 0xED) {
+        // Surrogates are invalid.
+        cnt = 2;
+        upper = 0x9F;
+    } else if (c == 0xF0) {
+        cnt = 3;
+        lower = 0x90;
+    } else if (c >= 0xF1 && c <= 0xF3) {
+        cnt = 3;
+    } else if (c == 0xF4) {
+        cnt = 3;
+        upper = 0x8F;
+    } else {
+        invalid = 1;
+        return 0;
+    }
+
+    for (std::size_t idx = 1; idx <= cnt; ++idx) {
+        if (idx >= size || data[idx] < lower || data[idx] > upper) {
+            invalid = idx;
+            return 0;
+        }
+
+        lower = 0x80;
+        upper = 0xBF;
+    }
+
+    return cnt + 1;
+}
+
+inline bool is_valid_scalar(const char *data, std::size_t size) {
+    const auto *bytes = reinterpret_cast<const unsigned char *>(data);
+    std::size_t pos = 0;
+    std::size_t invalid = 0;
+    while (pos < size) {
+        auto len = next_char(bytes + pos, size - pos, invalid);
+        if (len == 0) {
+            return false;
+        }
+        pos += len;
+    }
+
+    return true;
+}
+
+#ifdef SEWENEW_TOKENIZER_X86_SIMD
+
+// Lookup tables of "Validating UTF-8 In Less Than One Instruction Per Byte" by John Keiser
+// and Daniel Lemire. Each bit is an error, which is reported only if all three nibbles,
+// i.e. high and low nibbles of the previous byte, and high nibble of the current byte,
+// agree on it.
+struct Utf8Tables {
+    static constexpr uint8_t TOO_SHORT = 1 << 0;
+    static constexpr uint8_t TOO_LONG = 1 << 1;
+    static constexpr uint8_t OVERLONG_3 = 1 << 2;
+    static constexpr uint8_t TOO_LARGE = 1 << 3;
+    static constexpr uint8_t SURROGATE = 1 << 4;
+    static constexpr uint8_t OVERLONG_2 = 1 << 5;
+    static constexpr uint8_t TOO_LARGE_1000 = 1 << 6;
+    static constexpr uint8_t OVERLONG_4 = 1 << 6;
+    static constexpr uint8_t TWO_CONTS = 1 << 7;
+    static constexpr uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+};
+
+__attribute__((target("ssse3")))
+inline void check_block_ssse3(__m128i input, __m128i &prev_input, __m128i &prev_incomplete, __m128i &error) {
+    if (_mm_movemask_epi8(input) == 0) {
+        // ASCII only, and the previous block must not end with an incomplete character.
+        error = _mm_or_si128(error, prev_incomplete);
+        prev_incomplete = _mm_setzero_si128();
+        prev_input = input;
+        return;
+    }
+
+    using T = Utf8Tables;
+    const auto byte_1_high = _mm_setr_epi8(
+            T::TOO_LONG, T::TOO_LONG, T::TOO_LONG, T::TOO_LONG,
+            T::TOO_LONG, T::TOO_LONG, T::TOO_LONG, T::TOO_LONG,
+            static_cast<char>(T::TWO_CONTS), static_cast<char>(T::TWO_CONTS),
+            static_cast<char>(T::TWO_CONTS), static_cast<char>(T::TWO_CONTS),
+            T::TOO_SHORT | T::OVERLONG_2,
+            T::TOO_SHORT,
+            T::TOO_SHORT | T::OVERLONG_3 | T::SURROGATE,
+            T::TOO_SHORT | T::TOO_LARGE | T::TOO_LARGE_1000 | T::OVERLONG_4);
+    const auto byte_1_low = _mm_setr_epi8(
+            static_cast<char>(T::CARRY | T::OVERLONG_3 | T::OVERLONG_2 | T::OVERLONG_4),
+            static_cast<char>(T::CARRY | T::OVERLONG_2),
+            static_cast<char>(T::CARRY),
+            static_cast<char>(T::CARRY),
+            static_cast<char>(T::CARRY | T::TOO_LARGE),
+            static_cast<char>(T::CARRY | T::TOO_LARGE | T::TOO_LARGE_1000),
+            static_cast<char>(T::CARRY | T::TOO_LARGE | T::TOO_LARGE_1000),
+            static_cast<char>(T::CARRY | T::TOO_LARGE | T::TOO_LARGE_1000),
+            static_cast<char>(T::CARRY | T::TOO_LARGE | T::TOO_LARGE_1000),
+            static_cast<char>(T::CARRY | T::TOO_LARGE | T::TOO_LARGE_1000),
+            static_cast<char>(T::CARRY | T::TOO_LARGE | T::TOO_LARGE_1000),
+            static_cast<char>(T::CARRY | T::TOO_LARGE | T::TOO_LARGE_1000),
+            static_cast<char>(T::CARRY | T::TOO_LARGE | T::TOO_LARGE_1000),
+            static_cast<char>(T::CARRY | T::TOO_LARGE | T::TOO_LARGE_1000 | T::SURROGATE),
+            static_cast<char>(T::CARRY | T::TOO_LARGE | T::TOO_LARGE_1000),
+            static_cast<char>(T::CARRY | T::TOO_LARGE | T::TOO_LARGE_1000));
+    const auto byte_2_high = _mm_setr_epi8(
+            T::TOO_SHORT, T::TOO_SHORT, T::TOO_SHORT, T::TOO_SHORT,
+            T::TOO_SHORT, T::TOO_SHORT, T::TOO_SHORT, T::TOO_SHORT,
+            static_cast<char>(T::TOO_LONG | T::OVERLONG_2 | T::TWO_CONTS | T::OVERLONG_3
+                | T::TOO_LARGE_1000 | T::OVERLONG_4),
+            static_cast<char>(T::TOO_LONG | T::OVERLONG_2 | T::TWO_CONTS | T::OVERLONG_3 | T::TOO_LARGE),
+            static_cast<char>(T::TOO_LONG | T::OVERLONG_2 | T::TWO_CONTS | T::SURROGATE | T::TOO_LARGE),
+            static_cast<char>(T::TOO_LONG | T::OVERLONG_2 | T::TWO_CONTS | T::SURROGATE | T::TOO_LARGE),
+            T::TOO_SHORT, T::TOO_SHORT, T::TOO_SHORT, T::TOO_SHORT);
+
+    const auto nibble = _mm_set1_epi8(0x0F);
+    auto prev1 = _mm_alignr_epi8(input, prev_input, 15);
+    auto special_cases = _mm_and_si128(
+            _mm_and_si128(
+                _mm_shuffle_epi8(byte_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, nibble))),
+            _mm_shuffle_epi8(byte_2_high, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+    // The 2nd and 3rd continuation bytes, i.e. 2 bytes after a 3 or 4-byte lead byte,
+    // or 3 bytes after a 4-byte lead byte. They're the only allowed TWO_CONTS.
+    auto prev2 = _mm_alignr_epi8(input, prev_input, 14);
+    auto prev3 = _mm_alignr_epi8(input, prev_input, 13);
+    auto must_be_continuation = _mm_and_si128(
+            _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8(static_cast<char>(0xE0 - 0x80))),
+                _mm_subs_epu8(prev3, _mm_set1_epi8(static_cast<char>(0xF0 - 0x80)))),
+            _mm_set1_epi8(static_cast<char>(0x80)));
+
+    error = _mm_or_si128(error, _mm_xor_si128(must_be_continuation, special_cases));
+
+    // Lead bytes in the last 3 bytes which need more bytes than the block has.
+    const auto max_value = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            static_cast<char>(0xF0 - 1), static_cast<char>(0xE0 - 1), static_cast<char>(0xC0 - 1));
+    prev_incomplete = _mm_subs_epu8(input, max_value);
+    prev_input = input;
+}
+
+__attribute__((target("ssse3")))
+inline bool is_valid_ssse3(const char *data, std::size_t size) {
+    auto prev_input = _mm_setzero_si128();
+    auto prev_incomplete = _mm_setzero_si128();
+    auto error = _mm_setzero_si128();
+
+    std::size_t pos = 0;
+    for (; pos + 16 <= size; pos += 16) {
+        auto input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+        check_block_ssse3(input, prev_input, prev_incomplete, error);
+    }
+
+    if (pos < size) {
+        // Pad the tail with ASCII, so that an incomplete character is reported as TOO_SHORT.
+        char tail[16] = {};
+        std::memcpy(tail, data + pos, size - pos);
+        check_block_ssse3(_mm_loadu_si128(reinterpret_cast<const __m128i *>(tail)),
+                prev_input, prev_incomplete, error);
+    }
+
+    error = _mm_or_si128(error, prev_incomplete);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF;
+}
+
+#endif
+
+inline IsValidFunc select_is_valid() {
+#ifdef SEWENEW_TOKENIZER_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        return is_valid_ssse3;
+    }
+#endif
+
+    return is_valid_scalar;
+}
+
+}
+
+// Whether `data` is valid UTF-8. The kernel is chosen at runtime according to the CPU,
+// and ASCII blocks take a fast path.
+inline bool is_valid(const char *data, std::size_t size) {
+    static const auto func = detail::select_is_valid();
+
+    return func(data, size);
+}
+
+// Check `str` from `pos`, which must be a character boundary, and handle invalid sequences
+// according to `mode`. Offset of Utf8Error is relative to the beginning of `str`.
+inline void check(std::string &str, std::size_t pos, ErrorMode mode) {
+    if (is_valid(str.data() + pos, str.size() - pos)) {
+        return;
+    }
+
+    // Slow path, only taken with invalid sequences.
+    const auto *bytes = reinterpret_cast<const unsigned char *>(str.data());
+    auto begin = pos;
+    auto start = pos;
+    std::string fixed;
+    std::size_t invalid = 0;
+    while (pos < str.size()) {
+        auto len = detail::next_char(bytes + pos, str.size() - pos, invalid);
+        if (len > 0) {
+            pos += len;
+            continue;
+        }
+
+        if (mode == ErrorMode::STRICT) {
+            throw Utf8Error("invalid utf-8 sequence at offset " + std::to_string(pos), pos);
+        }
+
+        fixed.append(str, start, pos - start);
+        if (mode == ErrorMode::REPLACE) {
+            fixed += REPLACEMENT_CHARACTER;
+        }
+        pos += invalid;
+        start = pos;
+    }
+
+    fixed.append(str, start, std::string::npos);
+    str.replace(begin, std::string::npos, fixed);
+}
+
+}
+
+#endif // end SEWENEW_TOKENIZER_UTF8_H
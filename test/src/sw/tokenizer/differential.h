@@ -0,0 +1,293 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+#ifndef SEWENEW_TOKENIZER_TEST_DIFFERENTIAL_H
+#define SEWENEW_TOKENIZER_TEST_DIFFERENTIAL_H
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <memory_resource>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "sw/tokenizer/base64.h"
+#include "sw/tokenizer/hf_tokenizer.h"
+#include "sw/tokenizer/tiktoken.h"
+#include "sw/tokenizer/toml.h"
+
+namespace sw::tokenizer::test {
+
+// Special tokens of an encoding in the config.
+inline std::vector<std::string> special_tokens(const std::string &config, const std::string &encoding) {
+    std::vector<std::string> tokens;
+    auto conf = Toml::parse(config);
+    const auto &encodings = conf["encodings"];
+    if (encodings.contains(encoding) && encodings[encoding].contains("special_tokens")) {
+        for (const auto &ele : encodings[encoding]["special_tokens"].items()) {
+            tokens.push_back(ele.first);
+        }
+    }
+    return tokens;
+}
+
+// Bytes of all tokens of an encoding in the config, including special tokens. They're read
+// from the ranks file, or tokenizer.json, instead of the decoder of Tiktoken, so that
+// decoding is checked against concatenating bytes of tokens.
+inline std::unordered_map<uint64_t, std::string> vocabulary(const std::string &config, const std::string &encoding) {
+    std::unordered_map<uint64_t, std::string> vocab;
+    auto conf = Toml::parse(config);
+    const auto &value = conf["encodings"][encoding];
+    if (value.contains("tokenizer_json")) {
+        auto model = HfBpeLoader::load(value["tokenizer_json"].get<std::string>());
+        for (const auto &[token, rank] : model.ranks) {
+            vocab[rank] = token;
+        }
+        for (const auto &[token, rank] : model.special_tokens) {
+            vocab[rank] = token;
+        }
+    } else {
+        auto path = value["ranks"].get<std::string>();
+        std::ifstream file(path);
+        if (!file) {
+            throw Error("failed to open ranks: " + path);
+        }
+
+        std::string token;
+        uint64_t rank = 0;
+        while (file >> token >> rank) {
+            vocab[rank] = base64::decode(token);
+        }
+    }
+
+    if (value.contains("special_tokens")) {
+        for (const auto &[token, rank] : value["special_tokens"].get<std::unordered_map<std::string, uint64_t>>()) {
+            vocab[rank] = token;
+        }
+    }
+
+    return vocab;
+}
+
+// Random texts, which are likely to take different paths in optimized engines: invalid
+// UTF-8, long repeats, fragments of special tokens, mixed scripts, and pieces around the
+// size limits of short pieces.
+class InputGenerator {
+public:
+    InputGenerator(uint64_t seed, std::vector<std::string> special_tokens) :
+        _rng(seed), _special_tokens(std::move(special_tokens)) {}
+
+    std::string next(std::size_t max_size = 2048) {
+        std::string text;
+        auto size = _uniform(max_size + 1);
+        while (text.size() < size) {
+            _append_fragment(text);
+        }
+        return text;
+    }
+
+private:
+    std::size_t _uniform(std::size_t n) {
+        return std::uniform_int_distribution<std::size_t>(0, n - 1)(_rng);
+    }
+
+    void _append_fragment(std::string &text) {
+        static const std::vector<std::string> words = {
+            "the", " quick", " brown", "fox", "'s", "'LL", "'ve", "don't", " ", "  ", "\t", "\n",
+            "\r\n", "\n\n   ", "123", "4567890", "3.14", "0x1F", "(x, y)", "!=", "// comment",
+            "Ünïcödé", "中文", "日本語", "한국어", "Привет", "مرحبا", "שלום", "ελληνικά",
+            "😀", "👍🏽", "🇨🇳", "e\xcc\x81", "\xe2\x80\x8b", "\xef\xbb\xbf"
+        };
+
+        switch (_uniform(8)) {
+        case 0:
+        case 1:
+        case 2:
+            text += words[_uniform(words.size())];
+            break;
+
+        case 3: {
+            // Random bytes, i.e. mostly invalid UTF-8.
+            auto cnt = 1 + _uniform(8);
+            for (std::size_t idx = 0; idx < cnt; ++idx) {
+                text.push_back(static_cast<char>(_uniform(256)));
+            }
+            break;
+        }
+
+        case 4: {
+            // Truncated multi-byte characters.
+            const auto &word = words[_uniform(words.size())];
+            text += word.substr(0, word.size() - (word.size() > 1 ? 1 : 0));
+            break;
+        }
+
+        case 5: {
+            // Long repeats of a short unit.
+            const auto &unit = _uniform(2) == 0 ? words[_uniform(words.size())] : std::string(1, 'a' + _uniform(3));
+            auto cnt = 1 + _uniform(_uniform(4) == 0 ? 512 : 32);
+            for (std::size_t idx = 0; idx < cnt; ++idx) {
+                text += unit;
+            }
+            break;
+        }
+
+        case 6: {
+            // Special tokens and their fragments.
+            if (_special_tokens.empty()) {
+                text += "<|";
+                break;
+            }
+            const auto &special = _special_tokens[_uniform(_special_tokens.size())];
+            text += _uniform(2) == 0 ? special : special.substr(0, _uniform(special.size()));
+            break;
+        }
+
+        default: {
+            // Letters without spaces, i.e. long pieces.
+            auto cnt = 1 + _uniform(40);
+            for (std::size_t idx = 0; idx < cnt; ++idx) {
+                text.push_back(static_cast<char>('a' + _uniform(26)));
+            }
+            break;
+        }
+        }
+    }
+
+    std::mt19937_64 _rng;
+
+    std::vector<std::string> _special_tokens;
+};
+
+// Check optimized engines and paths against BpeEngine::REFERENCE, and decoding against
+// concatenating bytes of tokens.
+class DifferentialChecker {
+public:
+    DifferentialChecker(const std::string &config, const std::string &encoding) :
+        _vocab(vocabulary(config, encoding)) {
+        TiktokenFactory factory(config);
+        _reference = std::make_unique<Tiktoken>(factory.create(encoding, BpeEngine::REFERENCE));
+        for (auto engine : {BpeEngine::MERGE, BpeEngine::BACKTRACK}) {
+            _engines.push_back(std::make_unique<Tiktoken>(factory.create(encoding, engine)));
+        }
+
+        // No special token is allowed, or only the first one, so that the others are text.
+        _allowed.emplace_back();
+        auto specials = special_tokens(config, encoding);
+        if (!specials.empty()) {
+            _allowed.push_back({specials.front()});
+        }
+    }
+
+    // Returns an empty string if all agree, or else which check fails.
+    std::string check(const std::string &text) const {
+        auto expected = _reference->encode(text);
+        auto expected_ordinary = _reference->encode(text, false);
+
+        // Invalid UTF-8 bytes might be skipped by the pre-tokenizer, so only valid texts
+        // are expected to survive a roundtrip.
+        auto expected_text = _decode(expected);
+        if (utf8::is_valid(text.data(), text.size()) && expected_text != text) {
+            return "reference roundtrip";
+        }
+
+        std::string joined;
+        for (auto view : _reference->decode_views(expected)) {
+            joined += view;
+        }
+        if (_reference->decode(expected) != expected_text || joined != expected_text) {
+            return "reference decode";
+        }
+
+        // The estimate doesn't depend on the engine.
+        auto estimate = _reference->estimate_tokens(text);
+        if (estimate.upper_bound < expected_ordinary.size() || estimate.estimate > estimate.upper_bound) {
+            return "token estimate";
+        }
+
+        for (std::size_t idx = 0; idx < _engines.size(); ++idx) {
+            const auto &tiktoken = *_engines[idx];
+            auto engine = std::string(idx == 0 ? "merge" : "backtrack");
+            if (tiktoken.encode(text) != expected) {
+                return engine + " encode";
+            }
+
+            if (tiktoken.encode(text, false) != expected_ordinary) {
+                return engine + " encode without special tokens";
+            }
+
+            for (const auto &allowed : _allowed) {
+                if (tiktoken.encode(text, allowed) != _reference->encode(text, allowed)) {
+                    return engine + " encode with " + std::to_string(allowed.size()) + " allowed special tokens";
+                }
+            }
+
+            std::pmr::monotonic_buffer_resource arena;
+            auto arena_tokens = tiktoken.encode(text, &arena);
+            if (std::vector<uint64_t>(arena_tokens.begin(), arena_tokens.end()) != expected) {
+                return engine + " encode with memory resource";
+            }
+
+            if (tiktoken.encode_incremental(text).tokens != expected) {
+                return engine + " incremental encode";
+            }
+
+            if (tiktoken.count_tokens(text) != expected.size()) {
+                return engine + " count tokens";
+            }
+
+            auto decoded = tiktoken.decode(expected);
+            joined.clear();
+            for (auto view : tiktoken.decode_views(expected)) {
+                joined += view;
+            }
+            if (decoded != expected_text || joined != expected_text
+                    || tiktoken.decode(expected, &arena) != std::string_view(expected_text)) {
+                return engine + " decode";
+            }
+        }
+
+        return "";
+    }
+
+private:
+    std::string _decode(const std::vector<uint64_t> &tokens) const {
+        std::string text;
+        for (auto token : tokens) {
+            auto iter = _vocab.find(token);
+            if (iter == _vocab.end()) {
+                throw Error("unknown token: " + std::to_string(token));
+            }
+            text += iter->second;
+        }
+        return text;
+    }
+
+    std::unordered_map<uint64_t, std::string> _vocab;
+
+    std::unique_ptr<Tiktoken> _reference;
+
+    std::vector<std::unique_ptr<Tiktoken>> _engines;
+
+    std::vector<std::unordered_set<std::string>> _allowed;
+};
+
+}
+
+#endif // end SEWENEW_TOKENIZER_TEST_DIFFERENTIAL_H
@@ -0,0 +1,110 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+// Fuzz entry point, which checks optimized engines against the reference engine, e.g.
+//
+//   clang++ -std=c++17 -O1 -g -fsanitize=fuzzer,address -Isrc test/src/sw/tokenizer/fuzz.cpp -lre2
+//   TIKTOKEN_CONF=conf/tiktoken.toml ./a.out test/data/fuzz/cl100k_base
+//
+// TIKTOKEN_ENCODING limits the check to one encoding, otherwise all encodings in the
+// config, whose rank files exist, are checked. Define SW_TOKENIZER_FUZZ_MAIN to build
+// a driver without libFuzzer, which replays the files given as arguments.
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "differential.h"
+#include "sw/tokenizer/tiktoken.h"
+#include "sw/tokenizer/toml.h"
+
+namespace {
+
+struct Target {
+    std::string encoding;
+    std::unique_ptr<sw::tokenizer::test::DifferentialChecker> checker;
+};
+
+std::vector<Target> load_targets() {
+    const auto *env = std::getenv("TIKTOKEN_CONF");
+    std::string config = env != nullptr ? env : "conf/tiktoken.toml";
+    env = std::getenv("TIKTOKEN_ENCODING");
+    std::string only = env != nullptr ? env : "";
+
+    std::vector<Target> targets;
+    for (const auto &ele : sw::tokenizer::Toml::parse(config)["encodings"].items()) {
+        const auto &encoding = ele.first;
+        if (!only.empty() && encoding != only) {
+            continue;
+        }
+
+        try {
+            targets.push_back(Target{encoding,
+                    std::make_unique<sw::tokenizer::test::DifferentialChecker>(config, encoding)});
+        } catch (const sw::tokenizer::Error &e) {
+            std::cerr << "skip " << encoding << ": " << e.what() << std::endl;
+        }
+    }
+
+    if (targets.empty()) {
+        std::cerr << "no encoding to check" << std::endl;
+        std::abort();
+    }
+
+    return targets;
+}
+
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, std::size_t size) {
+    static const auto targets = load_targets();
+
+    std::string text(reinterpret_cast<const char *>(data), size);
+    for (const auto &target : targets) {
+        auto failure = target.checker->check(text);
+        if (!failure.empty()) {
+            std::cerr << target.encoding << ": " << failure << " mismatches the reference" << std::endl;
+            std::abort();
+        }
+    }
+
+    return 0;
+}
+
+#ifdef SW_TOKENIZER_FUZZ_MAIN
+
+int main(int argc, char **argv) {
+    for (auto idx = 1; idx < argc; ++idx) {
+        std::ifstream file(argv[idx], std::ios::binary);
+        if (!file) {
+            std::cerr << "failed to open " << argv[idx] << std::endl;
+            return -1;
+        }
+
+        std::stringstream ss;
+        ss << file.rdbuf();
+        auto input = ss.str();
+        LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t *>(input.data()), input.size());
+    }
+
+    return 0;
+}
+
+#endif
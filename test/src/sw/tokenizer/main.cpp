@@ -15,18 +15,49 @@
  *************************************************************************/
 
 #include <unistd.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <memory_resource>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include "sw/tokenizer/async_tiktoken.h"
+#include "sw/tokenizer/chunker.h"
+#include "sw/tokenizer/client.h"
+#include "sw/tokenizer/hf_tokenizer.h"
+#include "sw/tokenizer/json.h"
+#include "sw/tokenizer/packer.h"
+#include "sw/tokenizer/server.h"
+#include "sw/tokenizer/simd.h"
 #include "sw/tokenizer/tiktoken.h"
+#include "sw/tokenizer/trainer.h"
+#include "differential.h"
 
 int main(int argc, char **argv) {
     int opt = 0;
     std::string tiktoken_conf;
-    while ((opt = getopt(argc, argv, "t:")) != -1) {
+
+    // Paths of tiktoken_bench and tiktoken_corpus, which are smoke tested if they're given.
+    std::string tiktoken_bench;
+    std::string tiktoken_corpus;
+    while ((opt = getopt(argc, argv, "t:b:c:")) != -1) {
         switch (opt) {
         case 't':
             tiktoken_conf = optarg;
             break;
 
+        case 'b':
+            tiktoken_bench = optarg;
+            break;
+
+        case 'c':
+            tiktoken_corpus = optarg;
+            break;
+
         default:
             std::cerr << "unknown command option" << std::endl;
             return -1;
@@ -41,6 +72,801 @@ int main(int argc, char **argv) {
             std::cerr << "failed to test tiktoken encode and decode" << std::endl;
             return -1;
         }
+
+        if (tiktoken_factory.encoding_name_for_model("gpt-4") != "cl100k_base"
+                || tiktoken_factory.encoding_name_for_model("gpt-4-32k-0314") != "cl100k_base"
+                || tiktoken_factory.encoding_name_for_model("text-davinci-edit-001") != "p50k_edit") {
+            std::cerr << "failed to test model to encoding resolution" << std::endl;
+            return -1;
+        }
+
+        auto preloaded = tiktoken_factory.preload("cl100k_base").get();
+        if (preloaded != tiktoken_factory.get_for_model("gpt-3.5-turbo-0613")
+                || preloaded->encode("hello world") != tiktoken.encode("hello world")) {
+            std::cerr << "failed to test lazy loaded tiktoken" << std::endl;
+            return -1;
+        }
+
+        if (tiktoken.n_vocab() != 100277 || tiktoken.special_token("<|endoftext|>") != 100257) {
+            std::cerr << "failed to test vocabulary size and special token" << std::endl;
+            return -1;
+        }
+
+        {
+            // An outlier special id doesn't size the decoder table.
+            uint64_t outlier = 1ULL << 40;
+            sw::tokenizer::Tiktoken sparse({{"a", 0}, {"b", 1}, {"ab", 2}}, {{"<|end|>", outlier}}, "\\S+|\\s+");
+            if (sparse.n_vocab() != outlier + 1
+                    || sparse.encode("ab<|end|>") != std::vector<uint64_t>{2, outlier}
+                    || sparse.decode({2, outlier, 0}) != "ab<|end|>a") {
+                std::cerr << "failed to test special token with outlier id" << std::endl;
+                return -1;
+            }
+        }
+
+        {
+            // Everything comes from the buffer, since the upstream resource never allocates.
+            char buffer[64 * 1024];
+            std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer), std::pmr::null_memory_resource());
+            auto backtrack = tiktoken_factory.create("cl100k_base", sw::tokenizer::BpeEngine::BACKTRACK);
+            for (const auto &text : {std::string("hello <|endoftext|> world"), std::string(1000, 'a')}) {
+                auto arena_tokens = tiktoken.encode(text, &arena);
+                auto expected = tiktoken.encode(text);
+                if (std::vector<uint64_t>(arena_tokens.begin(), arena_tokens.end()) != expected
+                        || backtrack.encode(text, &arena) != arena_tokens
+                        || tiktoken.decode(arena_tokens, &arena) != std::string_view(text)) {
+                    std::cerr << "failed to test encode with memory resource" << std::endl;
+                    return -1;
+                }
+            }
+        }
+
+        {
+            std::vector<std::string> texts = {"hello world", "", "a <|endoftext|> b c d e f"};
+            auto batch = tiktoken.encode_batch(texts);
+            std::vector<uint64_t> lengths;
+            auto matrix = batch.pad(0, lengths, 4);
+            if (batch.size() != 3 || batch.get(0) != tiktoken.encode(texts[0])
+                    || batch.length(1) != 0 || batch.get(2) != tiktoken.encode(texts[2])
+                    || batch.max_length() != tiktoken.encode(texts[2]).size()
+                    || matrix.size() != 12 || lengths != std::vector<uint64_t>{2, 0, 4}
+                    || matrix[2] != 0 || matrix[8] != batch.data(2)[0]) {
+                std::cerr << "failed to test batch encoding" << std::endl;
+                return -1;
+            }
+        }
+
+        {
+            std::string content(5000, 'x');
+            std::vector<sw::tokenizer::ChatMessage> messages = {
+                {"system", "You are a helpful assistant.", ""},
+                {"user", "hello <|endoftext|> world", "alice"},
+                {"assistant", content, ""}
+            };
+            std::vector<std::size_t> expected;
+            for (const auto &message : messages) {
+                expected.push_back(3 + tiktoken.encode(std::string(message.role), false).size()
+                        + tiktoken.encode(std::string(message.content), false).size()
+                        + (message.name.empty() ? 0 : 1 + tiktoken.encode(std::string(message.name), false).size()));
+            }
+            auto count = tiktoken_factory.count_chat_tokens("gpt-4-0613", messages, 3);
+            auto legacy = tiktoken_factory.count_chat_tokens("gpt-3.5-turbo-0301", messages);
+            if (count.messages != expected
+                    || count.total != expected[0] + expected[1] + expected[2] + 3
+                    || legacy.total != count.total + 3 - 2
+                    || tiktoken.count_chat_tokens(messages).total != count.total) {
+                std::cerr << "failed to test chat token counting" << std::endl;
+                return -1;
+            }
+        }
+
+        auto tokens = tiktoken.encode("views <|endoftext|> of tokens");
+        std::string joined;
+        for (auto view : tiktoken.decode_views(tokens)) {
+            joined += view;
+        }
+        if (joined != tiktoken.decode(tokens) || joined != "views <|endoftext|> of tokens") {
+            std::cerr << "failed to test decode views" << std::endl;
+            return -1;
+        }
+
+        // The last token of "😀" is cut off.
+        auto broken_tokens = tiktoken.encode("hi ");
+        auto emoji_tokens = tiktoken.encode("😀");
+        broken_tokens.insert(broken_tokens.end(), emoji_tokens.begin(), emoji_tokens.end() - 1);
+        auto there_tokens = tiktoken.encode(" there");
+        broken_tokens.insert(broken_tokens.end(), there_tokens.begin(), there_tokens.end());
+        auto strict_offset = std::string::npos;
+        try {
+            tiktoken.decode(broken_tokens, sw::tokenizer::utf8::ErrorMode::STRICT);
+        } catch (const sw::tokenizer::Utf8Error &e) {
+            strict_offset = e.offset();
+        }
+        if (strict_offset != 3
+                || tiktoken.decode(broken_tokens, sw::tokenizer::utf8::ErrorMode::REPLACE) != "hi \uFFFD there"
+                || tiktoken.decode(broken_tokens, sw::tokenizer::utf8::ErrorMode::IGNORE) != "hi  there"
+                || tiktoken.decode(tokens, sw::tokenizer::utf8::ErrorMode::STRICT) != tiktoken.decode(tokens)) {
+            std::cerr << "failed to test utf-8 decode modes" << std::endl;
+            return -1;
+        }
+
+        {
+            // Every kernel the CPU supports returns the first minimum, as the scalar one does.
+            // Values are drawn from a small range with UINT32_MAX, so that there're ties, and
+            // the array is padded with UINT32_MAX as `argmin` requires.
+            std::vector<std::pair<std::string, sw::tokenizer::simd::detail::ArgminFunc>> kernels;
+#ifdef SEWENEW_TOKENIZER_X86_SIMD
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) {
+                kernels.emplace_back("avx2", sw::tokenizer::simd::detail::argmin_avx2);
+            }
+            if (__builtin_cpu_supports("sse4.1")) {
+                kernels.emplace_back("sse4.1", sw::tokenizer::simd::detail::argmin_sse41);
+            }
+#endif
+            std::mt19937 rng(20231018);
+            for (std::size_t size = 1; size <= 4 * sw::tokenizer::simd::ARGMIN_ALIGNMENT + 1; ++size) {
+                auto padded = (size + sw::tokenizer::simd::ARGMIN_ALIGNMENT - 1)
+                    / sw::tokenizer::simd::ARGMIN_ALIGNMENT * sw::tokenizer::simd::ARGMIN_ALIGNMENT;
+                for (auto round = 0; round < 100; ++round) {
+                    std::vector<uint32_t> vals(padded, UINT32_MAX);
+                    for (std::size_t idx = 0; idx < size; ++idx) {
+                        auto val = static_cast<uint32_t>(rng() % 5);
+                        vals[idx] = (val == 4) ? UINT32_MAX : val;
+                    }
+                    auto expected = sw::tokenizer::simd::detail::argmin_scalar(vals.data(), size);
+                    for (const auto &[name, kernel] : kernels) {
+                        if (kernel(vals.data(), size) != expected) {
+                            std::cerr << "failed to test " << name << " argmin" << std::endl;
+                            return -1;
+                        }
+                    }
+                }
+            }
+        }
+
+        auto backtrack = tiktoken_factory.create("cl100k_base", sw::tokenizer::BpeEngine::BACKTRACK);
+        for (const auto &text : {std::string("hello world"),
+                                    std::string("  indented\n\tcode(x, y) != 0x1F; // comment"),
+                                    std::string("Ünïcödé 中文 日本語 한국어 😀😀😀"),
+                                    std::string(1000, 'a'),
+                                    std::string("\xff\xfe\x80 invalid utf8 \xc3")}) {
+            if (backtrack.encode(text) != tiktoken.encode(text)) {
+                std::cerr << "failed to test backtracking bpe engine" << std::endl;
+                return -1;
+            }
+        }
+
+        {
+            sw::tokenizer::test::DifferentialChecker checker(tiktoken_conf, "cl100k_base");
+            sw::tokenizer::test::InputGenerator generator(20231018,
+                    sw::tokenizer::test::special_tokens(tiktoken_conf, "cl100k_base"));
+            for (auto idx = 0; idx < 200; ++idx) {
+                auto text = generator.next();
+                auto failure = checker.check(text);
+                if (!failure.empty()) {
+                    std::cerr << "failed to test " << failure << " against the reference engine" << std::endl;
+                    return -1;
+                }
+            }
+        }
+
+        for (const auto &text : {std::string("hello world"),
+                                    std::string("  indented\n\tcode(x, y) != 0x1F; // comment"),
+                                    std::string("Ünïcödé 中文 日本語 한국어 😀😀😀"),
+                                    std::string("\xff\xfe\x80 invalid utf8 \xc3")}) {
+            auto estimate = tiktoken.estimate_tokens(text);
+            if (estimate.upper_bound < tiktoken.count_tokens(text, false)
+                    || estimate.estimate > estimate.upper_bound) {
+                std::cerr << "failed to test token estimate" << std::endl;
+                return -1;
+            }
+        }
+
+        for (auto pattern : {sw::tokenizer::PieceScanner::CL100K_PATTERN, sw::tokenizer::PieceScanner::GPT2_PATTERN}) {
+            // The same pattern spelled differently is not a bundled one, so that pieces are
+            // split with the regex, i.e. the hot path of encoding, instead of the byte scanner.
+            // The DFA is written by hand, and this catches it drifting from the pattern.
+            auto conf = "/tmp/tiktoken_regex_" + std::to_string(getpid()) + ".toml";
+            {
+                std::ofstream out(conf);
+                for (const auto &[name, prefix, suffix] : {std::make_tuple("scan", "", ""),
+                                                            std::make_tuple("regex", "(?:", ")")}) {
+                    out << "[encodings." << name << "]\n"
+                        << "pattern = '''" << prefix << pattern << suffix << "'''\n"
+                        << "ranks = './data/cl100k_base.tiktoken'\n"
+                        << "special_tokens = {'<|endoftext|>' = 100257}\n";
+                }
+            }
+            sw::tokenizer::TiktokenFactory regex_factory(conf);
+            std::remove(conf.c_str());
+            auto scan_tiktoken = regex_factory.create("scan");
+            auto regex_tiktoken = regex_factory.create("regex");
+            sw::tokenizer::test::InputGenerator generator(20261018, {"<|endoftext|>"});
+            for (auto idx = 0; idx < 200; ++idx) {
+                auto text = generator.next();
+                auto count = scan_tiktoken.count_tokens(text, false);
+                auto regex_estimate = regex_tiktoken.estimate_tokens(text);
+
+                // The pattern of conf/tiktoken.toml is the bundled one, so that it's scanned.
+                auto scan_estimate = scan_tiktoken.estimate_tokens(text);
+                auto conf_estimate = tiktoken.estimate_tokens(text);
+                auto bundled = pattern != sw::tokenizer::PieceScanner::CL100K_PATTERN
+                    || (conf_estimate.estimate == scan_estimate.estimate
+                            && conf_estimate.upper_bound == scan_estimate.upper_bound);
+
+                // The scanner estimates non-ASCII pieces from their size, and otherwise
+                // splits text the same way.
+                std::string ascii;
+                std::copy_if(text.begin(), text.end(), std::back_inserter(ascii),
+                        [](char c) { return static_cast<unsigned char>(c) < 0x80; });
+                auto ascii_estimate = scan_tiktoken.estimate_tokens(ascii);
+                auto regex_ascii_estimate = regex_tiktoken.estimate_tokens(ascii);
+                if (!bundled || regex_tiktoken.encode(text, false) != scan_tiktoken.encode(text, false)
+                        || regex_estimate.upper_bound < count
+                        || regex_ascii_estimate.estimate != ascii_estimate.estimate
+                        || regex_ascii_estimate.upper_bound != ascii_estimate.upper_bound) {
+                    std::cerr << "failed to test token estimate with regex split" << std::endl;
+                    return -1;
+                }
+            }
+        }
+
+        // Disallowed special tokens are plain text, and so is the text before them.
+        if (tiktoken.encode("hello <|endoftext|> world", std::unordered_set<std::string>{})
+                != tiktoken.encode("hello <|endoftext|> world", false)) {
+            std::cerr << "failed to test encode with allowed special tokens" << std::endl;
+            return -1;
+        }
+
+        {
+            // Estimating is timed by tiktoken_bench, see its -m option.
+            std::string text;
+            for (auto idx = 0; text.size() < 256 * 1024; ++idx) {
+                text += "The quick brown fox jumps over the lazy dog, doesn't it? " + std::to_string(idx) + "\n";
+                text += "    if (tokens.size() > max_tokens) { return Error(\"too many tokens\"); }\n";
+            }
+            auto count = tiktoken.count_tokens(text, false);
+            auto estimate = tiktoken.estimate_tokens(text);
+            if (estimate.upper_bound < count || estimate.estimate > estimate.upper_bound) {
+                std::cerr << "failed to test token estimate of long text" << std::endl;
+                return -1;
+            }
+        }
+
+        std::string document = "fn main() {\n    \n}\n<|fim_prefix|> hello world";
+        auto incremental = tiktoken.encode_incremental(document);
+        for (const auto &edit : {sw::tokenizer::TextEdit{document.find('}'), 0, "\n    return 0;"},
+                                    sw::tokenizer::TextEdit{document.find("<|fim_"), 3, "<|"},
+                                    sw::tokenizer::TextEdit{document.find("hello"), 5, "goodbye"}}) {
+            document.replace(edit.offset, edit.removed, edit.inserted);
+            tiktoken.reencode(incremental, edit, document);
+            if (incremental.tokens != tiktoken.encode(document)) {
+                std::cerr << "failed to test incremental encoding" << std::endl;
+                return -1;
+            }
+        }
+
+        {
+            sw::tokenizer::ChunkOptions chunk_opts;
+            chunk_opts.size = 8;
+            chunk_opts.overlap = 2;
+            chunk_opts.boundary = sw::tokenizer::ChunkBoundary::NEWLINE;
+            std::vector<uint64_t> chunked;
+            auto chunk_ok = true;
+            sw::tokenizer::Chunker chunker(tiktoken, chunk_opts,
+                    [&](const sw::tokenizer::Chunk &chunk) {
+                        auto skip = chunked.empty() ? 0 : chunk_opts.overlap;
+                        chunked.insert(chunked.end(), chunk.tokens.begin() + skip, chunk.tokens.end());
+                        chunk_ok = chunk_ok && tiktoken.decode(chunk.tokens)
+                            == document.substr(chunk.begin, chunk.end - chunk.begin);
+                    });
+            for (std::size_t pos = 0; pos < document.size(); pos += 5) {
+                chunker.feed(std::string_view(document).substr(pos, 5));
+            }
+            chunker.finish();
+            if (!chunk_ok || chunked != tiktoken.encode(document)) {
+                std::cerr << "failed to test chunker" << std::endl;
+                return -1;
+            }
+        }
+
+        {
+            // A single long piece fed in small slices, which is exact within `max_tail`,
+            // and cut at token boundaries beyond it.
+            std::string long_piece = "say " + std::string(16 * 1024, 'a') + " end\n";
+            for (auto max_tail : {std::size_t(0), std::size_t(1024)}) {
+                sw::tokenizer::ChunkOptions chunk_opts;
+                chunk_opts.size = 100;
+                chunk_opts.max_tail = max_tail;
+                std::vector<uint64_t> chunked;
+                std::string decoded;
+                auto chunk_ok = true;
+                sw::tokenizer::Chunker chunker(tiktoken, chunk_opts,
+                        [&](const sw::tokenizer::Chunk &chunk) {
+                            chunk_ok = chunk_ok && chunk.begin == decoded.size();
+                            chunked.insert(chunked.end(), chunk.tokens.begin(), chunk.tokens.end());
+                            decoded += tiktoken.decode(chunk.tokens);
+                            chunk_ok = chunk_ok && chunk.end == decoded.size();
+                        });
+                for (std::size_t pos = 0; pos < long_piece.size(); pos += 7) {
+                    chunker.feed(std::string_view(long_piece).substr(pos, 7));
+                }
+                chunker.finish();
+                if (!chunk_ok || decoded != long_piece
+                        || (max_tail == 0 && chunked != tiktoken.encode(long_piece))) {
+                    std::cerr << "failed to test chunker with a long piece" << std::endl;
+                    return -1;
+                }
+            }
+        }
+
+        {
+            sw::tokenizer::PackOptions pack_opts;
+            pack_opts.seq_len = 8;
+            pack_opts.policy = sw::tokenizer::PackPolicy::BEST_FIT;
+            pack_opts.separator = tiktoken.special_token("<|endoftext|>");
+            pack_opts.document_ids = true;
+            pack_opts.open_sequences = 2;
+            std::vector<uint64_t> packed;
+            std::vector<uint32_t> packed_ids;
+            sw::tokenizer::Packer packer(pack_opts, [&](const sw::tokenizer::PackedBatch &batch) {
+                        packed.insert(packed.end(), batch.tokens, batch.tokens + batch.rows * batch.seq_len);
+                        packed_ids.insert(packed_ids.end(), batch.document_ids,
+                                batch.document_ids + batch.rows * batch.seq_len);
+                    });
+            for (const auto &text : {"hello world", "a b c d e", "x", "one two three"}) {
+                packer.add(tiktoken.encode(text));
+            }
+            packer.finish();
+            // Sizes with separators are 3, 6, 2 and 4, so they fit into [6, 2], [3, 4].
+            const auto &pack_stats = packer.stats();
+            if (pack_stats.sequences != 2 || pack_stats.padding != 1 || packed.size() != 16
+                    || packed_ids[0] != 1 || packed_ids[6] != 2 || packed_ids[15] != 0) {
+                std::cerr << "failed to test packer" << std::endl;
+                return -1;
+            }
+        }
+
+        {
+            const std::string pattern = R"( ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+)";
+            sw::tokenizer::TrainerOptions trainer_opts;
+            trainer_opts.vocab_size = 300;
+            trainer_opts.threads = 2;
+            sw::tokenizer::BpeTrainer trainer(pattern, trainer_opts);
+            std::string corpus;
+            for (auto idx = 0; idx < 100; ++idx) {
+                corpus += "the quick brown fox jumps over the lazy dog " + std::to_string(idx) + "\n";
+            }
+            trainer.count(corpus);
+            auto encoder = trainer.train();
+            auto vocab_size = encoder.size();
+            sw::tokenizer::Tiktoken trained(std::move(encoder), {}, pattern);
+            auto trained_tokens = trained.encode(corpus);
+            if (vocab_size <= 256 || vocab_size > 300 || trained.decode(trained_tokens) != corpus
+                    || trained_tokens.size() * 3 > corpus.size()) {
+                std::cerr << "failed to test bpe trainer" << std::endl;
+                return -1;
+            }
+        }
+
+        sw::tokenizer::ServerOptions server_opts;
+        server_opts.path = "/tmp/sw_tokenizer_test_" + std::to_string(getpid()) + ".sock";
+        server_opts.workers = 2;
+        sw::tokenizer::TokenizerServer server(tiktoken_factory, server_opts);
+        std::thread server_thread([&server]() { server.run(); });
+        try {
+            sw::tokenizer::TokenizerClient client(server_opts.path);
+            auto remote_tokens = client.encode("cl100k_base", "hello <|endoftext|> world");
+            if (remote_tokens != tiktoken.encode("hello <|endoftext|> world")
+                    || client.decode("cl100k_base", remote_tokens) != "hello <|endoftext|> world"
+                    || client.count_tokens("cl100k_base", "hello world") != 2) {
+                std::cerr << "failed to test tokenizer server" << std::endl;
+                server.stop();
+                server_thread.join();
+                return -1;
+            }
+
+            // A small request whose response is larger than a frame fails, and the server
+            // keeps serving.
+            uint64_t long_token = 58040;
+            auto cnt = sw::tokenizer::protocol::MAX_FRAME_SIZE / tiktoken.decode({long_token}).size() + 1;
+            auto oversized = false;
+            try {
+                client.decode("cl100k_base", std::vector<uint64_t>(cnt, long_token));
+            } catch (const sw::tokenizer::Error &e) {
+                oversized = std::string(e.what()).find("response is too large") != std::string::npos;
+            }
+            if (!oversized || client.count_tokens("cl100k_base", "hello world") != 2) {
+                std::cerr << "failed to test tokenizer server with oversized response" << std::endl;
+                server.stop();
+                server_thread.join();
+                return -1;
+            }
+        } catch (...) {
+            server.stop();
+            server_thread.join();
+            throw;
+        }
+        server.stop();
+        server_thread.join();
+
+        {
+            // Limits are small, and responses are large and not read until many requests
+            // have been sent, so that the server stops reading, and its writes would block.
+            sw::tokenizer::ServerOptions opts;
+            opts.path = "/tmp/sw_tokenizer_test_limits_" + std::to_string(getpid()) + ".sock";
+            opts.workers = 2;
+            opts.max_queue = 2;
+            opts.max_connection_bytes = 1024;
+            sw::tokenizer::TokenizerServer limited_server(tiktoken_factory, opts);
+            std::thread limited_thread([&limited_server]() { limited_server.run(); });
+
+            std::string text;
+            while (text.size() < 64 * 1024) {
+                text += "hello world, " + std::to_string(text.size()) + " ";
+            }
+            auto expected = tiktoken.encode(text);
+            const std::size_t cnt = 32;
+            std::vector<bool> received(cnt, false);
+            bool ok = true;
+            try {
+                sw::tokenizer::TokenizerClient client(opts.path);
+
+                // Sending and receiving don't share any member of the client.
+                std::thread sender([&client, &text, cnt]() {
+                    try {
+                        for (std::size_t idx = 0; idx < cnt; ++idx) {
+                            client.send(sw::tokenizer::protocol::Op::ENCODE, "cl100k_base", text);
+                        }
+                    } catch (const sw::tokenizer::Error &) {
+                        // The server has stopped.
+                    }
+                });
+                try {
+                    for (std::size_t idx = 0; idx < cnt && ok; ++idx) {
+                        auto resp = client.receive();
+                        ok = resp.status == sw::tokenizer::protocol::Status::OK && resp.id < cnt
+                            && !received[resp.id]
+                            && sw::tokenizer::protocol::get_tokens(resp.payload) == expected;
+                        if (ok) {
+                            received[resp.id] = true;
+                        }
+                    }
+                } catch (const sw::tokenizer::Error &) {
+                    ok = false;
+                }
+                if (!ok) {
+                    // Close the connection, which the sender might be blocked on.
+                    limited_server.stop();
+                }
+                sender.join();
+            } catch (const sw::tokenizer::Error &) {
+                ok = false;
+            }
+            limited_server.stop();
+            limited_thread.join();
+            if (!ok) {
+                std::cerr << "failed to test tokenizer server limits" << std::endl;
+                return -1;
+            }
+        }
+
+        {
+            // Tokens "a" and "b" in base64, and a special token whose id doesn't fit in u32.
+            auto prefix = "/tmp/sw_tokenizer_test_outlier_" + std::to_string(getpid());
+            std::ofstream(prefix + ".tiktoken") << "YQ== 0\nYg== 1\n";
+            std::ofstream(prefix + ".toml") << "[encodings.tiny]\n"
+                << "pattern = '''\\S+|\\s+'''\n"
+                << "ranks = '" << prefix << ".tiktoken'\n"
+                << "special_tokens = {'<|end|>' = " << (1ULL << 33) << "}\n";
+            sw::tokenizer::TiktokenFactory outlier_factory(prefix + ".toml");
+            sw::tokenizer::ServerOptions opts;
+            opts.path = prefix + ".sock";
+            opts.workers = 1;
+            sw::tokenizer::TokenizerServer outlier_server(outlier_factory, opts);
+            std::thread outlier_thread([&outlier_server]() { outlier_server.run(); });
+            auto ok = false;
+            try {
+                sw::tokenizer::TokenizerClient client(opts.path);
+                try {
+                    client.encode("tiny", "ab<|end|>");
+                } catch (const sw::tokenizer::Error &e) {
+                    ok = std::string(e.what()).find("doesn't fit in u32") != std::string::npos;
+                }
+                ok = ok && client.encode("tiny", "ab") == std::vector<uint64_t>{0, 1};
+            } catch (const sw::tokenizer::Error &) {
+                ok = false;
+            }
+            outlier_server.stop();
+            outlier_thread.join();
+            for (const auto &suffix : {".toml", ".tiktoken"}) {
+                std::remove((prefix + suffix).c_str());
+            }
+            if (!ok) {
+                std::cerr << "failed to test tokenizer server with outlier token" << std::endl;
+                return -1;
+            }
+        }
+
+        {
+            sw::tokenizer::AsyncTiktoken async_tiktoken(preloaded);
+            auto small = async_tiktoken.submit("hello world");
+            auto bulk = async_tiktoken.try_submit(std::string(10000, 'x'), sw::tokenizer::Priority::LOW);
+            if (!bulk || small.get() != tiktoken.encode("hello world")
+                    || bulk->get() != tiktoken.encode(std::string(10000, 'x'))
+                    || async_tiktoken.metrics().submitted != 2) {
+                std::cerr << "failed to test async tiktoken" << std::endl;
+                return -1;
+            }
+        }
+
+        tiktoken_factory.reload();
+        if (tiktoken_factory.get("cl100k_base") != preloaded) {
+            std::cerr << "failed to test reload with unchanged config" << std::endl;
+            return -1;
+        }
+
+        {
+            // Tokens "a", "b", " " and "ab" in base64, and then the ranks and the pattern are
+            // changed, so that "ab" is no longer a token.
+            auto prefix = "/tmp/tiktoken_reload_" + std::to_string(getpid());
+            std::ofstream(prefix + ".v1.tiktoken") << "YQ== 0\nYg== 1\nIA== 2\nYWI= 3\n";
+            std::ofstream(prefix + ".v2.tiktoken") << "YQ== 0\nYg== 1\nIA== 2\n";
+            auto write_conf = [&prefix](const std::string &pattern, const std::string &version) {
+                std::ofstream(prefix + ".toml") << "[encodings.tiny]\n"
+                    << "pattern = '''" << pattern << "'''\n"
+                    << "ranks = '" << prefix << "." << version << ".tiktoken'\n"
+                    << "special_tokens = {'<|end|>' = 4}\n";
+            };
+            write_conf("\\S+|\\s+", "v1");
+            sw::tokenizer::TiktokenFactory reload_factory(prefix + ".toml");
+            auto old_tiny = reload_factory.get("tiny");
+            write_conf("[ab]|\\s+", "v2");
+            reload_factory.reload();
+            auto new_tiny = reload_factory.get("tiny");
+            auto same_tiny = (reload_factory.get("tiny") == new_tiny);
+
+            // Readers keep getting the encoding, while it's reloaded back and forth. Each of
+            // them should get either version, and keep using it after it's replaced.
+            const std::vector<uint64_t> v1_tokens = {3, 2, 3};
+            const std::vector<uint64_t> v2_tokens = {0, 1, 2, 0, 1};
+            std::atomic<bool> reloading{true};
+            std::atomic<std::size_t> gets{0};
+            std::atomic<std::size_t> failures{0};
+            std::vector<std::thread> readers;
+            for (auto idx = 0; idx < 4; ++idx) {
+                readers.emplace_back([&]() {
+                    while (reloading) {
+                        try {
+                            auto tiny = reload_factory.get("tiny");
+                            auto tokens = tiny->encode("ab ab");
+                            if ((tokens != v1_tokens && tokens != v2_tokens) || tiny->encode("ab ab") != tokens) {
+                                ++failures;
+                            }
+                        } catch (...) {
+                            ++failures;
+                        }
+                        ++gets;
+                    }
+                });
+            }
+            while (gets == 0) {
+                std::this_thread::yield();
+            }
+            for (auto idx = 0; idx < 100; ++idx) {
+                if (idx % 2 == 0) {
+                    write_conf("\\S+|\\s+", "v1");
+                } else {
+                    write_conf("[ab]|\\s+", "v2");
+                }
+                reload_factory.reload();
+            }
+            reloading = false;
+            for (auto &reader : readers) {
+                reader.join();
+            }
+            auto reloaded_tiny = reload_factory.get("tiny");
+
+            for (const auto &suffix : {".toml", ".v1.tiktoken", ".v2.tiktoken"}) {
+                std::remove((prefix + suffix).c_str());
+            }
+            if (new_tiny == old_tiny || !same_tiny
+                    || old_tiny->encode("ab ab") != v1_tokens
+                    || new_tiny->encode("ab ab") != v2_tokens) {
+                std::cerr << "failed to test reload with changed ranks and pattern" << std::endl;
+                return -1;
+            }
+
+            if (failures != 0 || reloaded_tiny->encode("ab ab") != v2_tokens) {
+                std::cerr << "failed to test reload with concurrent readers" << std::endl;
+                return -1;
+            }
+        }
+
+        {
+            // Lone surrogates are replaced with U+FFFD, and a high one doesn't eat the next escape.
+            std::string line = R"({"a": 1, "text": "😀\ud800A\udc00\n"})";
+            auto text = sw::tokenizer::Json::parse(line)["text"].get<std::string>();
+            std::size_t pos = line.find("\"text\": ") + 8;
+            auto str = sw::tokenizer::Json::parse_string(line, pos);
+            if (text != "\xF0\x9F\x98\x80\xEF\xBF\xBD" "A\xEF\xBF\xBD\n" || str != text || line.substr(pos) != "}") {
+                std::cerr << "failed to test json string" << std::endl;
+                return -1;
+            }
+        }
+
+        // `ids` are output by HuggingFace, i.e. merges of the lowest merge index. The loader
+        // drops `\s+(?!\S)`, so for 2 or more whitespaces followed by other text, pieces and
+        // ids differ from HuggingFace's, see HfBpeLoader. Such lines expect `tiktoken_ids`,
+        // and both ids decode to the text.
+        for (const auto &dir : {std::string("test/data/hf/cl100k_subset"), std::string("test/data/hf/gpt2_style")}) {
+            auto model = sw::tokenizer::HfBpeLoader::load(dir + "/tokenizer.json");
+            for (auto engine : {sw::tokenizer::BpeEngine::MERGE, sw::tokenizer::BpeEngine::BACKTRACK}) {
+                sw::tokenizer::Tiktoken hf_tiktoken(model.ranks, model.special_tokens, model.pattern, engine);
+                std::ifstream expected(dir + "/expected.jsonl");
+                std::string line;
+                std::size_t cnt = 0;
+                while (std::getline(expected, line)) {
+                    auto fixture = sw::tokenizer::Json::parse(line);
+                    auto text = fixture["text"].get<std::string>();
+                    auto parse_ids = [&fixture](const std::string &key) {
+                        std::vector<uint64_t> ids;
+                        for (const auto &id : fixture[key].elements()) {
+                            ids.push_back(id.get<uint64_t>());
+                        }
+                        return ids;
+                    };
+
+                    auto ids = parse_ids("ids");
+                    auto expected_ids = ids;
+                    if (fixture.contains("tiktoken_ids")) {
+                        expected_ids = parse_ids("tiktoken_ids");
+                        if (expected_ids == ids) {
+                            std::cerr << "failed to test huggingface divergence " << dir << ": " << text << std::endl;
+                            return -1;
+                        }
+                    }
+
+                    if (hf_tiktoken.encode(text) != expected_ids || hf_tiktoken.decode(ids) != text
+                            || hf_tiktoken.decode(expected_ids) != text) {
+                        std::cerr << "failed to test huggingface tokenizer " << dir << ": " << text << std::endl;
+                        return -1;
+                    }
+                    ++cnt;
+                }
+
+                if (cnt == 0) {
+                    std::cerr << "failed to load huggingface fixture " << dir << std::endl;
+                    return -1;
+                }
+            }
+        }
+
+        // Merges of "rero" end up with "r", "er", "o", so it's output as is only with
+        // `ignore_merges`, which in turn rejects vocabulary entries no merge produces.
+        {
+            std::ifstream file("test/data/hf/gpt2_style/tokenizer.json");
+            std::stringstream ss;
+            ss << file.rdbuf();
+            auto conf = ss.str();
+            auto replace = [&conf](const std::string &from, const std::string &to) {
+                auto pos = conf.find(from);
+                if (pos != std::string::npos) {
+                    conf.replace(pos, from.size(), to);
+                }
+            };
+            auto rejected = [&conf]() {
+                try {
+                    sw::tokenizer::HfBpeLoader::convert(sw::tokenizer::Json::parse(conf));
+                } catch (const sw::tokenizer::Error &) {
+                    return true;
+                }
+                return false;
+            };
+
+            replace("\"vocab\": {", "\"vocab\": {\"rero\": 1502, ");
+            replace("\"\xC4\xA0p ol\"", "\"\xC4\xA0p ol\", \"re ro\"");
+            auto self_merges_rejected = rejected();
+
+            replace("\"ignore_merges\": false", "\"ignore_merges\": true");
+            auto model = sw::tokenizer::HfBpeLoader::convert(sw::tokenizer::Json::parse(conf));
+            sw::tokenizer::Tiktoken hf_tiktoken(model.ranks, model.special_tokens, model.pattern);
+
+            replace("\"vocab\": {", "\"vocab\": {\"zqzq\": 1503, ");
+            if (!self_merges_rejected || hf_tiktoken.encode("rero") != std::vector<uint64_t>{1502} || !rejected()) {
+                std::cerr << "failed to test huggingface ignore_merges" << std::endl;
+                return -1;
+            }
+        }
+
+        if (!tiktoken_bench.empty()) {
+            // Plain timing mode, and with counters, which are null if perf events are
+            // unavailable, e.g. EACCES in a container, or ENOENT in a VM.
+            auto prefix = "/tmp/tiktoken_bench_" + std::to_string(getpid());
+            std::string corpus = "hello world, 你好 😀\n    if (x != 0x1F) { return; }\n";
+            std::ofstream(prefix + ".txt") << corpus;
+            for (auto profile : {false, true}) {
+                auto cmd = tiktoken_bench + " -t " + tiktoken_conf + " -r 2" + (profile ? " -p" : "")
+                    + " -o " + prefix + ".json " + prefix + ".txt 2>/dev/null";
+                auto ok = std::system(cmd.c_str()) == 0;
+                if (ok) {
+                    auto output = sw::tokenizer::Json::load(prefix + ".json");
+                    const auto &results = output["results"].elements();
+                    ok = results.size() == 4;
+                    for (const auto &result : results) {
+                        ok = ok && result["bytes"].get<std::size_t>() == corpus.size()
+                            && result["tokens"].get<std::size_t>() > 0
+                            && result["seconds"].get<double>() >= 0
+                            && result.contains("counters") == profile;
+                        if (ok && profile) {
+                            for (const auto &ele : result["counters"].items()) {
+                                ok = ok && (ele.second.is_null() || ele.second.contains("total"));
+                            }
+                        }
+                    }
+                }
+                std::remove((prefix + ".json").c_str());
+                if (!ok) {
+                    std::remove((prefix + ".txt").c_str());
+                    std::cerr << "failed to test tiktoken_bench" << (profile ? " with counters" : "") << std::endl;
+                    return -1;
+                }
+            }
+            std::remove((prefix + ".txt").c_str());
+        }
+
+        {
+            // The first piece which ends at or after the position, but never the last one.
+            std::string text = "hello world foo";
+            if (tiktoken.piece_end(text, 3) != 5 || tiktoken.piece_end(text, 6) != 11
+                    || tiktoken.piece_end(text, 12) != std::string_view::npos) {
+                std::cerr << "failed to test piece end" << std::endl;
+                return -1;
+            }
+        }
+
+        if (!tiktoken_corpus.empty()) {
+            // Segments are 4KB. Neither document has a newline followed by a letter or digit,
+            // so the first one is cut at piece boundaries, and the second one, which is a
+            // single piece, at character boundaries.
+            auto prefix = "/tmp/tiktoken_corpus_" + std::to_string(getpid());
+            std::string words;
+            while (words.size() < 64 * 1024) {
+                words += "lorem ipsum, dolor " + std::to_string(words.size()) + ";\n\n ";
+            }
+            std::string letters;
+            while (letters.size() < 16 * 1024) {
+                letters += "abÃ©";
+            }
+            std::ofstream(prefix + ".words.txt") << words;
+            std::ofstream(prefix + ".letters.txt") << letters;
+            auto cmd = tiktoken_corpus + " -t " + tiktoken_conf + " -e cl100k_base -b 4096 -j 2 -o "
+                + prefix + " " + prefix + ".words.txt " + prefix + ".letters.txt 2>/dev/null";
+            auto ok = std::system(cmd.c_str()) == 0;
+            if (ok) {
+                std::ifstream bin(prefix + ".bin", std::ios::binary);
+                std::vector<uint64_t> tokens;
+                uint32_t token = 0;
+                while (bin.read(reinterpret_cast<char *>(&token), sizeof(token))) {
+                    tokens.push_back(token);
+                }
+                auto expected = tiktoken.encode(words, false);
+                auto eot = tiktoken.special_token("<|endoftext|>");
+                auto first_end = expected.size() + 1;
+                ok = tokens.size() > first_end && tokens.back() == eot
+                    && std::vector<uint64_t>(tokens.begin(), tokens.begin() + expected.size()) == expected
+                    && tokens[expected.size()] == eot
+                    && tiktoken.decode(std::vector<uint64_t>(tokens.begin() + first_end, tokens.end() - 1)) == letters;
+            }
+            for (const auto &suffix : {".words.txt", ".letters.txt", ".bin", ".idx", ".state"}) {
+                std::remove((prefix + suffix).c_str());
+            }
+            if (!ok) {
+                std::cerr << "failed to test tiktoken_corpus with long lines" << std::endl;
+                return -1;
+            }
+        }
     } catch (const sw::tokenizer::Error &e) {
         std::cerr << "failed to do test: " << e.what() << std::endl;
         return -1;
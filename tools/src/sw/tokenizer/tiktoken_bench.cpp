@@ -0,0 +1,436 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+// Benchmark stages of the tokenizer on corpora, and write the results as JSON, so that
+// they can be compared across commits. With `-p`, hardware counters are read with
+// perf_event_open, and normalized per byte and per token.
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "sw/tokenizer/errors.h"
+#include "sw/tokenizer/str_utils.h"
+#include "sw/tokenizer/tiktoken.h"
+
+namespace {
+
+struct Options {
+    std::string conf;
+    std::string encoding = "cl100k_base";
+    std::vector<std::string> stages = {"estimate", "encode", "encode_ordinary", "decode"};
+    std::size_t repeat = 5;
+    bool profile = false;
+    std::string output;
+
+    // Free-form label of the results, e.g. a commit id.
+    std::string label;
+
+    // If it's not 0, fail unless the estimate stage is at least this many times faster than
+    // the count stage on every corpus.
+    double min_speedup = 0;
+};
+
+using Clock = std::chrono::steady_clock;
+
+void usage() {
+    std::cerr << "usage: tiktoken_bench -t tiktoken.toml [-e encoding] "
+        << "[-s estimate,count,encode,encode_ordinary,encode_backtrack,decode] [-r repeat] [-p] "
+        << "[-o output.json] [-l label] [-m min_speedup] corpus1 [corpus2 ...]" << std::endl;
+}
+
+struct CounterSpec {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+};
+
+constexpr uint64_t cache_config(uint64_t cache, uint64_t op, uint64_t result) {
+    return cache | (op << 8) | (result << 16);
+}
+
+const std::vector<CounterSpec>& counter_specs() {
+    static const std::vector<CounterSpec> specs = {
+        {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {"l1d_misses", PERF_TYPE_HW_CACHE, cache_config(PERF_COUNT_HW_CACHE_L1D,
+                PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+        {"llc_misses", PERF_TYPE_HW_CACHE, cache_config(PERF_COUNT_HW_CACHE_LL,
+                PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+        {"dtlb_misses", PERF_TYPE_HW_CACHE, cache_config(PERF_COUNT_HW_CACHE_DTLB,
+                PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)}
+    };
+    return specs;
+}
+
+// Hardware counters of the calling thread. Counters are opened separately instead of
+// as a group, so that the kernel can multiplex them if there're not enough hardware
+// counters, and the values are scaled by the time they actually ran.
+class PerfCounters {
+public:
+    PerfCounters() {
+        for (const auto &spec : counter_specs()) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = spec.type;
+            attr.config = spec.config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            auto fd = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+            if (fd < 0) {
+                std::cerr << "counter " << spec.name << " is unavailable: " << std::strerror(errno) << std::endl;
+            }
+            _fds.push_back(fd);
+        }
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters& operator=(const PerfCounters &) = delete;
+
+    ~PerfCounters() {
+        for (auto fd : _fds) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+    }
+
+    void start() {
+        for (auto fd : _fds) {
+            if (fd >= 0) {
+                ::ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ::ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    // Returns values in the order of `counter_specs()`, or nullopt if a counter is unavailable.
+    std::vector<std::optional<double>> stop() {
+        for (auto fd : _fds) {
+            if (fd >= 0) {
+                ::ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            }
+        }
+
+        std::vector<std::optional<double>> values;
+        for (auto fd : _fds) {
+            // value, time enabled, time running
+            uint64_t data[3] = {0, 0, 0};
+            if (fd < 0 || ::read(fd, data, sizeof(data)) != static_cast<ssize_t>(sizeof(data))
+                    || data[2] == 0) {
+                values.push_back(std::nullopt);
+                continue;
+            }
+
+            values.push_back(static_cast<double>(data[0]) * data[1] / data[2]);
+        }
+
+        return values;
+    }
+
+private:
+    std::vector<int> _fds;
+};
+
+struct Result {
+    std::string corpus;
+    std::string stage;
+    std::size_t bytes = 0;
+    std::size_t tokens = 0;
+
+    // Best of all runs.
+    double seconds = 0;
+
+    // Counters of the best run, if profiling.
+    std::vector<std::optional<double>> counters;
+};
+
+std::string read_file(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw sw::tokenizer::Error("failed to open corpus: " + path);
+    }
+
+    std::stringstream ss;
+    ss << file.rdbuf();
+    return ss.str();
+}
+
+std::string json_string(const std::string &str) {
+    std::string out = "\"";
+    for (auto c : str) {
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char buf[8];
+                std::snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned>(c));
+                out += buf;
+            } else {
+                out += c;
+            }
+        }
+    }
+    out += "\"";
+    return out;
+}
+
+std::string json_number(double value) {
+    std::ostringstream ss;
+    ss.precision(6);
+    ss << value;
+    return ss.str();
+}
+
+void write_json(std::ostream &out, const Options &opts, const std::vector<Result> &results) {
+    out << "{\n  \"label\": " << json_string(opts.label)
+        << ",\n  \"encoding\": " << json_string(opts.encoding)
+        << ",\n  \"repeat\": " << opts.repeat
+        << ",\n  \"results\": [";
+    for (std::size_t idx = 0; idx < results.size(); ++idx) {
+        const auto &result = results[idx];
+        out << (idx == 0 ? "\n" : ",\n")
+            << "    {\"corpus\": " << json_string(result.corpus)
+            << ", \"stage\": " << json_string(result.stage)
+            << ", \"bytes\": " << result.bytes
+            << ", \"tokens\": " << result.tokens
+            << ", \"seconds\": " << json_number(result.seconds)
+            << ", \"mb_per_second\": " << json_number(result.seconds == 0 ? 0 : result.bytes / result.seconds / 1e6);
+        if (opts.profile) {
+            out << ", \"counters\": {";
+            const auto &specs = counter_specs();
+            for (std::size_t cnt = 0; cnt < specs.size(); ++cnt) {
+                out << (cnt == 0 ? "" : ", ") << json_string(specs[cnt].name) << ": ";
+                const auto &value = result.counters[cnt];
+                if (!value) {
+                    out << "null";
+                    continue;
+                }
+
+                out << "{\"total\": " << json_number(*value)
+                    << ", \"per_byte\": " << json_number(result.bytes == 0 ? 0 : *value / result.bytes)
+                    << ", \"per_token\": " << json_number(result.tokens == 0 ? 0 : *value / result.tokens)
+                    << "}";
+            }
+            out << "}";
+        }
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+// Check that the estimate stage is at least `opts.min_speedup` times faster than the count
+// stage of the same corpus.
+void check_speedup(const Options &opts, const std::vector<Result> &results) {
+    for (const auto &estimate : results) {
+        if (estimate.stage != "estimate") {
+            continue;
+        }
+
+        auto iter = std::find_if(results.begin(), results.end(), [&estimate](const Result &result) {
+                return result.corpus == estimate.corpus && result.stage == "count";
+            });
+        if (iter == results.end()) {
+            throw sw::tokenizer::Error("-m needs both the estimate and the count stage");
+        }
+
+        if (estimate.seconds * opts.min_speedup > iter->seconds) {
+            throw sw::tokenizer::Error(estimate.corpus + ": estimate is only "
+                    + json_number(iter->seconds / estimate.seconds) + "x faster than count, expect "
+                    + json_number(opts.min_speedup) + "x");
+        }
+    }
+}
+
+// Run `stage` `repeat` times, and keep the fastest run, which is the least disturbed one.
+Result run(const Options &opts,
+        const std::string &corpus,
+        const std::string &stage,
+        std::size_t bytes,
+        const std::function<std::size_t ()> &func,
+        PerfCounters *counters) {
+    Result result;
+    result.corpus = corpus;
+    result.stage = stage;
+    result.bytes = bytes;
+
+    for (std::size_t idx = 0; idx < opts.repeat; ++idx) {
+        if (counters != nullptr) {
+            counters->start();
+        }
+        auto start = Clock::now();
+        auto tokens = func();
+        auto seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        std::vector<std::optional<double>> values;
+        if (counters != nullptr) {
+            values = counters->stop();
+        }
+
+        if (idx == 0 || seconds < result.seconds) {
+            result.seconds = seconds;
+            result.tokens = tokens;
+            result.counters = std::move(values);
+        }
+    }
+
+    return result;
+}
+
+}
+
+int main(int argc, char **argv) {
+    Options opts;
+    int opt = 0;
+    try {
+        while ((opt = getopt(argc, argv, "t:e:s:r:po:l:m:")) != -1) {
+            switch (opt) {
+            case 't':
+                opts.conf = optarg;
+                break;
+
+            case 'e':
+                opts.encoding = optarg;
+                break;
+
+            case 's':
+                opts.stages.clear();
+                sw::tokenizer::str::split(optarg, ",", std::back_inserter(opts.stages));
+                break;
+
+            case 'r':
+                opts.repeat = std::max<std::size_t>(1, std::stoul(optarg));
+                break;
+
+            case 'p':
+                opts.profile = true;
+                break;
+
+            case 'o':
+                opts.output = optarg;
+                break;
+
+            case 'l':
+                opts.label = optarg;
+                break;
+
+            case 'm':
+                opts.min_speedup = std::stod(optarg);
+                break;
+
+            default:
+                usage();
+                return -1;
+                break;
+            }
+        }
+    } catch (const std::exception &) {
+        usage();
+        return -1;
+    }
+
+    if (opts.conf.empty() || optind >= argc) {
+        usage();
+        return -1;
+    }
+
+    try {
+        sw::tokenizer::TiktokenFactory factory(opts.conf);
+        auto tiktoken = factory.get(opts.encoding);
+        sw::tokenizer::TiktokenSPtr backtrack;
+
+        std::unique_ptr<PerfCounters> counters;
+        if (opts.profile) {
+            counters = std::make_unique<PerfCounters>();
+        }
+
+        std::vector<Result> results;
+        for (auto idx = optind; idx < argc; ++idx) {
+            std::string corpus = argv[idx];
+            auto text = read_file(corpus);
+            auto tokens = tiktoken->encode(text);
+
+            for (const auto &stage : opts.stages) {
+                std::function<std::size_t ()> func;
+                if (stage == "estimate") {
+                    // The pre-tokenizer and the lookup of whole pieces, i.e. encode without BPE.
+                    func = [&]() { return tiktoken->estimate_tokens(text).estimate; };
+                } else if (stage == "count") {
+                    func = [&]() { return tiktoken->count_tokens(text, false); };
+                } else if (stage == "encode") {
+                    func = [&]() { return tiktoken->encode(text).size(); };
+                } else if (stage == "encode_ordinary") {
+                    func = [&]() { return tiktoken->encode(text, false).size(); };
+                } else if (stage == "encode_backtrack") {
+                    if (!backtrack) {
+                        backtrack = std::make_shared<sw::tokenizer::Tiktoken>(
+                                factory.create(opts.encoding, sw::tokenizer::BpeEngine::BACKTRACK));
+                    }
+                    func = [&]() { return backtrack->encode(text).size(); };
+                } else if (stage == "decode") {
+                    func = [&]() { tiktoken->decode(tokens); return tokens.size(); };
+                } else {
+                    throw sw::tokenizer::Error("unknown stage: " + stage);
+                }
+
+                results.push_back(run(opts, corpus, stage, text.size(), func, counters.get()));
+                const auto &result = results.back();
+                std::cerr << corpus << " " << stage << ": " << result.seconds << "s, "
+                    << result.bytes / result.seconds / 1e6 << "MB/s" << std::endl;
+            }
+        }
+
+        if (opts.output.empty()) {
+            write_json(std::cout, opts, results);
+        } else {
+            std::ofstream file(opts.output);
+            if (!file) {
+                throw sw::tokenizer::Error("failed to open output: " + opts.output);
+            }
+            write_json(file, opts, results);
+        }
+
+        if (opts.min_speedup > 0) {
+            check_speedup(opts, results);
+        }
+    } catch (const sw::tokenizer::Error &e) {
+        std::cerr << "failed to benchmark: " << e.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
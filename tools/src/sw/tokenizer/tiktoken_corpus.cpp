@@ -0,0 +1,785 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+// Tokenize corpora into a flat binary token file for training.
+//
+// Outputs, with `-o prefix`:
+//  - prefix.bin: tokens of all documents, each followed by <|endoftext|>, as uint16
+//    if all tokens fit, otherwise uint32, in native byte order.
+//  - prefix.idx: uint64 token offset of the end of each document in prefix.bin.
+//  - prefix.state: progress, which is updated after each batch is written, so that
+//    an interrupted run can be resumed with `-r`.
+//
+// Inputs are plain text, i.e. one document per file, or JSONL, i.e. one document per
+// line, whose text is the string value of a key of the top level object.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "sw/tokenizer/errors.h"
+#include "sw/tokenizer/json.h"
+#include "sw/tokenizer/tiktoken.h"
+
+namespace {
+
+enum class Format {
+    TEXT = 0,
+    JSONL
+};
+
+struct Options {
+    std::string conf;
+    std::string encoding;
+    std::string output;
+    Format format = Format::TEXT;
+
+    // Key of the text in a JSONL object.
+    std::string key = "text";
+
+    std::size_t threads = 0;
+
+    // Number of bytes encoded by a task.
+    std::size_t batch_size = 16 * 1024 * 1024;
+
+    bool resume = false;
+};
+
+// Large documents are encoded in segments, so that memory usage is bounded.
+constexpr std::size_t SEGMENT_SIZE = 1024 * 1024;
+
+// A JSONL document is decoded as a whole, and never split across batches, so that progress
+// is saved at line ends. Larger lines fail, instead of taking unbounded memory.
+constexpr std::size_t MAX_LINE_SIZE = 256 * 1024 * 1024;
+
+using Clock = std::chrono::steady_clock;
+
+void usage() {
+    std::cerr << "usage: tiktoken_corpus -t tiktoken.toml -e encoding -o output_prefix "
+        << "[-f text|jsonl] [-k json_key] [-j threads] [-b batch_size] [-r] "
+        << "input1 [input2 ...]" << std::endl;
+}
+
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &path) {
+        auto fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw sw::tokenizer::Error("failed to open " + path + ": " + std::strerror(errno));
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            auto err = std::string(std::strerror(errno));
+            ::close(fd);
+            throw sw::tokenizer::Error("failed to stat " + path + ": " + err);
+        }
+
+        _size = static_cast<std::size_t>(st.st_size);
+        if (_size > 0) {
+            _data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);
+
+        if (_data == MAP_FAILED) {
+            throw sw::tokenizer::Error("failed to mmap " + path + ": " + std::strerror(errno));
+        }
+
+        if (_size > 0) {
+            ::madvise(_data, _size, MADV_SEQUENTIAL);
+        }
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile& operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+        if (_size > 0) {
+            ::munmap(_data, _size);
+        }
+    }
+
+    std::string_view data() const {
+        if (_size == 0) {
+            return {};
+        }
+
+        return std::string_view(static_cast<const char *>(_data), _size);
+    }
+
+private:
+    void *_data = nullptr;
+    std::size_t _size = 0;
+};
+
+using MappedFileSPtr = std::shared_ptr<const MappedFile>;
+
+// Where to resume, i.e. everything before it has been written.
+struct Progress {
+    std::size_t file = 0;
+    std::size_t offset = 0;
+    uint64_t tokens = 0;
+    uint64_t documents = 0;
+    std::string dtype;
+};
+
+Progress load_progress(const std::string &path) {
+    Progress progress;
+    std::ifstream file(path);
+    if (!file) {
+        return progress;
+    }
+
+    std::string key;
+    while (file >> key) {
+        if (key == "file") {
+            file >> progress.file;
+        } else if (key == "offset") {
+            file >> progress.offset;
+        } else if (key == "tokens") {
+            file >> progress.tokens;
+        } else if (key == "documents") {
+            file >> progress.documents;
+        } else if (key == "dtype") {
+            file >> progress.dtype;
+        } else {
+            throw sw::tokenizer::Error("invalid state file: " + path);
+        }
+    }
+
+    return progress;
+}
+
+void sync(std::FILE *file, const std::string &path) {
+    if (std::fflush(file) != 0 || ::fsync(::fileno(file)) != 0) {
+        throw sw::tokenizer::Error("failed to sync " + path + ": " + std::strerror(errno));
+    }
+}
+
+// Write to a temporary file and rename it, so that the state file is never partially written.
+void save_progress(const std::string &path, const Progress &progress) {
+    auto tmp = path + ".tmp";
+    auto *file = std::fopen(tmp.c_str(), "w");
+    if (file == nullptr) {
+        throw sw::tokenizer::Error("failed to open " + tmp + ": " + std::strerror(errno));
+    }
+
+    std::fprintf(file, "file %zu\noffset %zu\ntokens %llu\ndocuments %llu\ndtype %s\n",
+            progress.file, progress.offset,
+            static_cast<unsigned long long>(progress.tokens),
+            static_cast<unsigned long long>(progress.documents),
+            progress.dtype.c_str());
+    try {
+        sync(file, tmp);
+    } catch (...) {
+        std::fclose(file);
+        throw;
+    }
+    std::fclose(file);
+
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+        throw sw::tokenizer::Error("failed to rename " + tmp + ": " + std::strerror(errno));
+    }
+}
+
+// A minimal scanner of a JSON object, which only decodes the value of one key.
+class JsonLine {
+public:
+    explicit JsonLine(std::string_view line) : _line(line) {}
+
+    // Returns false if the object doesn't have a string value for `key`.
+    bool find(const std::string &key, std::string &value) {
+        _skip_spaces();
+        _expect('{');
+        _skip_spaces();
+        if (_peek() == '}') {
+            return false;
+        }
+
+        while (true) {
+            _skip_spaces();
+            auto name = sw::tokenizer::Json::parse_string(_line, _pos);
+            _skip_spaces();
+            _expect(':');
+            _skip_spaces();
+            if (name == key && _peek() == '"') {
+                value = sw::tokenizer::Json::parse_string(_line, _pos);
+                return true;
+            }
+
+            _skip_value();
+            _skip_spaces();
+            if (_peek() == '}') {
+                return false;
+            }
+            _expect(',');
+        }
+    }
+
+private:
+    char _peek() const {
+        if (_pos >= _line.size()) {
+            throw sw::tokenizer::Error("unexpected end of json line");
+        }
+
+        return _line[_pos];
+    }
+
+    void _expect(char c) {
+        if (_peek() != c) {
+            throw sw::tokenizer::Error(std::string("invalid json line, expect: ") + c);
+        }
+        ++_pos;
+    }
+
+    void _skip_spaces() {
+        while (_pos < _line.size() && std::isspace(static_cast<unsigned char>(_line[_pos]))) {
+            ++_pos;
+        }
+    }
+
+    void _skip_value() {
+        auto c = _peek();
+        if (c == '"') {
+            sw::tokenizer::Json::parse_string(_line, _pos);
+            return;
+        }
+
+        if (c != '{' && c != '[') {
+            // Number, true, false or null.
+            while (_pos < _line.size() && _line[_pos] != ',' && _line[_pos] != '}'
+                    && _line[_pos] != ']' && !std::isspace(static_cast<unsigned char>(_line[_pos]))) {
+                ++_pos;
+            }
+            return;
+        }
+
+        std::size_t depth = 0;
+        do {
+            c = _peek();
+            if (c == '"') {
+                sw::tokenizer::Json::parse_string(_line, _pos);
+                continue;
+            }
+
+            if (c == '{' || c == '[') {
+                ++depth;
+            } else if (c == '}' || c == ']') {
+                --depth;
+            }
+            ++_pos;
+        } while (depth > 0);
+    }
+
+    std::string_view _line;
+    std::size_t _pos = 0;
+};
+
+// Pre-tokenized pieces never span "\n" followed by an ASCII letter or digit, so a
+// document can be encoded in segments split there, with the same result. A segment is
+// no larger than `2 * size`. Without such a newline in it, e.g. a minified document, it
+// ends at a piece boundary of the pre-tokenizer instead. Only a single piece larger than
+// `size`, which BPE could hardly encode anyway, is cut at a UTF-8 character boundary,
+// which might change the tokens around the cut.
+std::size_t segment_end(const sw::tokenizer::Tiktoken &tiktoken,
+        std::string_view text,
+        std::size_t begin,
+        std::size_t size) {
+    if (text.size() - begin <= size) {
+        return text.size();
+    }
+
+    auto limit = std::min(text.size(), begin + 2 * size);
+    for (auto end = begin + size; end < limit; ++end) {
+        if (text[end - 1] == '\n' && std::isalnum(static_cast<unsigned char>(text[end]))) {
+            return end;
+        }
+    }
+
+    if (limit == text.size()) {
+        return text.size();
+    }
+
+    auto end = tiktoken.piece_end(text.substr(begin, limit - begin), size);
+    if (end != std::string_view::npos) {
+        return begin + end;
+    }
+
+    end = limit;
+    while (end > begin + size && (static_cast<unsigned char>(text[end]) & 0xC0) == 0x80) {
+        --end;
+    }
+
+    return end;
+}
+
+struct Segment {
+    std::string_view text;
+
+    // Whether it's the last segment of a document.
+    bool document_end;
+};
+
+struct Batch {
+    std::vector<Segment> segments;
+
+    // Decoded JSONL texts, which segments refer to.
+    std::deque<std::string> texts;
+
+    MappedFileSPtr file;
+
+    // Input position after this batch.
+    std::size_t file_idx = 0;
+    std::size_t offset = 0;
+
+    std::size_t bytes = 0;
+};
+
+struct Encoded {
+    std::vector<uint64_t> tokens;
+
+    // End of each document in `tokens`.
+    std::vector<uint64_t> document_ends;
+
+    std::size_t file_idx = 0;
+    std::size_t offset = 0;
+    std::size_t bytes = 0;
+};
+
+Encoded encode_batch(const sw::tokenizer::Tiktoken &tiktoken, uint64_t eot, const Batch &batch) {
+    Encoded encoded;
+    encoded.file_idx = batch.file_idx;
+    encoded.offset = batch.offset;
+    encoded.bytes = batch.bytes;
+
+    std::string text;
+    for (const auto &segment : batch.segments) {
+        text.assign(segment.text.data(), segment.text.size());
+
+        // Special tokens in the corpus are taken as plain text.
+        auto tokens = tiktoken.encode(text, false);
+        encoded.tokens.insert(encoded.tokens.end(), tokens.begin(), tokens.end());
+        if (segment.document_end) {
+            encoded.tokens.push_back(eot);
+            encoded.document_ends.push_back(encoded.tokens.size());
+        }
+    }
+
+    return encoded;
+}
+
+class Writer {
+public:
+    Writer(const std::string &prefix, const Progress &progress, std::size_t token_width) :
+        _bin_path(prefix + ".bin"),
+        _idx_path(prefix + ".idx"),
+        _state_path(prefix + ".state"),
+        _progress(progress),
+        _token_width(token_width) {
+        // Drop anything written after the last saved state.
+        _bin = _open(_bin_path, _progress.tokens * _token_width);
+        _idx = _open(_idx_path, _progress.documents * sizeof(uint64_t));
+    }
+
+    Writer(const Writer &) = delete;
+    Writer& operator=(const Writer &) = delete;
+
+    ~Writer() {
+        std::fclose(_bin);
+        std::fclose(_idx);
+    }
+
+    void write(const Encoded &encoded) {
+        if (_token_width == sizeof(uint16_t)) {
+            _write_tokens<uint16_t>(encoded.tokens);
+        } else {
+            _write_tokens<uint32_t>(encoded.tokens);
+        }
+
+        for (auto end : encoded.document_ends) {
+            auto offset = _progress.tokens + end;
+            _write(_idx, &offset, sizeof(offset), _idx_path);
+        }
+
+        _progress.tokens += encoded.tokens.size();
+        _progress.documents += encoded.document_ends.size();
+        _progress.file = encoded.file_idx;
+        _progress.offset = encoded.offset;
+
+        // Data must be durable before the state refers to it.
+        sync(_bin, _bin_path);
+        sync(_idx, _idx_path);
+        save_progress(_state_path, _progress);
+    }
+
+    const Progress& progress() const {
+        return _progress;
+    }
+
+private:
+    static std::FILE* _open(const std::string &path, uint64_t size) {
+        auto fd = ::open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+        if (fd < 0) {
+            throw sw::tokenizer::Error("failed to open " + path + ": " + std::strerror(errno));
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < size
+                || ::ftruncate(fd, static_cast<off_t>(size)) != 0
+                || ::lseek(fd, 0, SEEK_END) < 0) {
+            ::close(fd);
+            throw sw::tokenizer::Error("failed to resume " + path + ", which is shorter than its state");
+        }
+
+        auto *file = ::fdopen(fd, "w");
+        if (file == nullptr) {
+            ::close(fd);
+            throw sw::tokenizer::Error("failed to open " + path + ": " + std::strerror(errno));
+        }
+
+        return file;
+    }
+
+    template <typename T>
+    void _write_tokens(const std::vector<uint64_t> &tokens) {
+        _buffer.resize(tokens.size() * sizeof(T));
+        auto *out = reinterpret_cast<T *>(_buffer.data());
+        for (std::size_t idx = 0; idx < tokens.size(); ++idx) {
+            out[idx] = static_cast<T>(tokens[idx]);
+        }
+        _write(_bin, _buffer.data(), _buffer.size(), _bin_path);
+    }
+
+    static void _write(std::FILE *file, const void *data, std::size_t size, const std::string &path) {
+        if (size > 0 && std::fwrite(data, 1, size, file) != size) {
+            throw sw::tokenizer::Error("failed to write " + path + ": " + std::strerror(errno));
+        }
+    }
+
+    std::string _bin_path;
+    std::string _idx_path;
+    std::string _state_path;
+
+    Progress _progress;
+
+    std::size_t _token_width;
+
+    std::FILE *_bin = nullptr;
+    std::FILE *_idx = nullptr;
+
+    std::vector<char> _buffer;
+};
+
+// Read batches in order, encode them in parallel, and write them in order. At most
+// 2 * threads batches are in flight, so memory usage doesn't depend on the input size.
+class Pipeline {
+public:
+    Pipeline(const Options &opts, const sw::tokenizer::Tiktoken &tiktoken, Writer &writer) :
+        _opts(opts),
+        _tiktoken(tiktoken),
+        _eot(tiktoken.special_token("<|endoftext|>")),
+        _writer(writer),
+        _max_in_flight(2 * opts.threads),
+        _segment_size(std::min(SEGMENT_SIZE, opts.batch_size)),
+        _start(Clock::now()),
+        _last_report(_start) {}
+
+    void run(const std::vector<std::string> &inputs) {
+        const auto &progress = _writer.progress();
+        for (auto file_idx = progress.file; file_idx < inputs.size(); ++file_idx) {
+            auto file = std::make_shared<const MappedFile>(inputs[file_idx]);
+            auto offset = file_idx == progress.file ? progress.offset : 0;
+            if (_opts.format == Format::TEXT) {
+                _read_text(file, file_idx, offset);
+            } else {
+                _read_jsonl(file, file_idx, offset, inputs[file_idx]);
+            }
+        }
+
+        while (!_in_flight.empty()) {
+            _write_front();
+        }
+
+        _report(true);
+    }
+
+private:
+    void _read_text(const MappedFileSPtr &file, std::size_t file_idx, std::size_t offset) {
+        auto text = file->data();
+        auto batch = _new_batch(file, file_idx);
+        while (offset < text.size()) {
+            auto end = segment_end(_tiktoken, text, offset, _segment_size);
+            batch.segments.push_back(Segment{text.substr(offset, end - offset), end == text.size()});
+            batch.bytes += end - offset;
+            batch.offset = end;
+            offset = end;
+
+            if (batch.bytes >= _opts.batch_size && offset < text.size()) {
+                _submit(std::move(batch));
+                batch = _new_batch(file, file_idx);
+            }
+        }
+
+        _submit_last(std::move(batch));
+    }
+
+    void _read_jsonl(const MappedFileSPtr &file, std::size_t file_idx, std::size_t offset,
+            const std::string &path) {
+        auto data = file->data();
+        auto batch = _new_batch(file, file_idx);
+        batch.offset = offset;
+        while (offset < data.size()) {
+            auto end = data.find('\n', offset);
+            end = (end == std::string_view::npos) ? data.size() : end + 1;
+            auto line = data.substr(offset, end - offset);
+            auto blank = std::all_of(line.begin(), line.end(),
+                    [](char c) { return std::isspace(static_cast<unsigned char>(c)); });
+            if (!blank) {
+                std::string text;
+                try {
+                    if (line.size() > MAX_LINE_SIZE) {
+                        throw sw::tokenizer::Error("line is larger than " + std::to_string(MAX_LINE_SIZE)
+                                + " bytes, split the document, or use -f text");
+                    }
+
+                    if (!JsonLine(line).find(_opts.key, text)) {
+                        throw sw::tokenizer::Error("no string value of key: " + _opts.key);
+                    }
+                } catch (const sw::tokenizer::Error &e) {
+                    throw sw::tokenizer::Error(path + " at offset " + std::to_string(offset) + ": " + e.what());
+                }
+
+                // A document is never split across batches, so that a batch ends at a line end.
+                const auto &doc = batch.texts.emplace_back(std::move(text));
+                for (std::size_t pos = 0; pos < doc.size() || pos == 0; ) {
+                    auto seg_end = segment_end(_tiktoken, doc, pos, _segment_size);
+                    batch.segments.push_back(Segment{std::string_view(doc).substr(pos, seg_end - pos),
+                                                        seg_end == doc.size()});
+                    pos = seg_end;
+                    if (doc.empty()) {
+                        break;
+                    }
+                }
+                batch.bytes += line.size();
+            }
+
+            batch.offset = end;
+            offset = end;
+            if (batch.bytes >= _opts.batch_size && offset < data.size()) {
+                _submit(std::move(batch));
+                batch = _new_batch(file, file_idx);
+                batch.offset = offset;
+            }
+        }
+
+        _submit_last(std::move(batch));
+    }
+
+    Batch _new_batch(const MappedFileSPtr &file, std::size_t file_idx) const {
+        Batch batch;
+        batch.file = file;
+        batch.file_idx = file_idx;
+        return batch;
+    }
+
+    // The last batch of a file moves the progress to the next file, even if it's empty,
+    // so that a finished file is never encoded again.
+    void _submit_last(Batch batch) {
+        ++batch.file_idx;
+        batch.offset = 0;
+        _submit(std::move(batch));
+    }
+
+    void _submit(Batch batch) {
+        while (_in_flight.size() >= _max_in_flight) {
+            _write_front();
+        }
+
+        auto task = [this, batch = std::move(batch)]() {
+            return encode_batch(_tiktoken, _eot, batch);
+        };
+        _in_flight.push_back(std::async(std::launch::async, std::move(task)));
+    }
+
+    void _write_front() {
+        auto encoded = _in_flight.front().get();
+        _in_flight.pop_front();
+
+        _writer.write(encoded);
+        _bytes += encoded.bytes;
+        _tokens += encoded.tokens.size();
+        _report(false);
+    }
+
+    void _report(bool done) {
+        auto now = Clock::now();
+        if (!done && now - _last_report < std::chrono::seconds(5)) {
+            return;
+        }
+        _last_report = now;
+
+        auto elapsed = std::chrono::duration<double>(now - _start).count();
+        const auto &progress = _writer.progress();
+        std::cerr << (done ? "done: " : "progress: ")
+            << "documents: " << progress.documents
+            << ", tokens: " << progress.tokens
+            << ", MB/s: " << (elapsed > 0 ? _bytes / elapsed / 1e6 : 0)
+            << ", tokens/s: " << (elapsed > 0 ? _tokens / elapsed : 0)
+            << std::endl;
+    }
+
+    const Options &_opts;
+
+    const sw::tokenizer::Tiktoken &_tiktoken;
+
+    uint64_t _eot;
+
+    Writer &_writer;
+
+    std::size_t _max_in_flight;
+
+    // A segment is no larger than a batch, so that a large document is encoded in parallel.
+    std::size_t _segment_size;
+
+    std::deque<std::future<Encoded>> _in_flight;
+
+    // Bytes and tokens of this run, excluding resumed ones.
+    std::size_t _bytes = 0;
+    uint64_t _tokens = 0;
+
+    Clock::time_point _start;
+    Clock::time_point _last_report;
+};
+
+}
+
+int main(int argc, char **argv) {
+    Options opts;
+    int opt = 0;
+    try {
+        while ((opt = getopt(argc, argv, "t:e:o:f:k:j:b:r")) != -1) {
+            switch (opt) {
+            case 't':
+                opts.conf = optarg;
+                break;
+
+            case 'e':
+                opts.encoding = optarg;
+                break;
+
+            case 'o':
+                opts.output = optarg;
+                break;
+
+            case 'f':
+                if (std::string(optarg) == "text") {
+                    opts.format = Format::TEXT;
+                } else if (std::string(optarg) == "jsonl") {
+                    opts.format = Format::JSONL;
+                } else {
+                    usage();
+                    return -1;
+                }
+                break;
+
+            case 'k':
+                opts.key = optarg;
+                break;
+
+            case 'j':
+                opts.threads = std::stoul(optarg);
+                break;
+
+            case 'b':
+                opts.batch_size = std::max<std::size_t>(1, std::stoul(optarg));
+                break;
+
+            case 'r':
+                opts.resume = true;
+                break;
+
+            default:
+                usage();
+                return -1;
+                break;
+            }
+        }
+    } catch (const std::exception &) {
+        usage();
+        return -1;
+    }
+
+    if (opts.conf.empty() || opts.encoding.empty() || opts.output.empty() || optind >= argc) {
+        usage();
+        return -1;
+    }
+
+    if (opts.threads == 0) {
+        opts.threads = std::max(1U, std::thread::hardware_concurrency());
+    }
+
+    std::vector<std::string> inputs(argv + optind, argv + argc);
+
+    try {
+        sw::tokenizer::TiktokenFactory factory(opts.conf);
+        auto tiktoken = factory.create(opts.encoding);
+
+        if (tiktoken.n_vocab() > (1ULL << 32)) {
+            throw sw::tokenizer::Error("tokens do not fit in uint32");
+        }
+        auto token_width = tiktoken.n_vocab() <= 65536 ? sizeof(uint16_t) : sizeof(uint32_t);
+        auto dtype = std::string(token_width == sizeof(uint16_t) ? "uint16" : "uint32");
+
+        Progress progress;
+        if (opts.resume) {
+            progress = load_progress(opts.output + ".state");
+            if (!progress.dtype.empty() && progress.dtype != dtype) {
+                throw sw::tokenizer::Error("cannot resume " + progress.dtype + " output with " + dtype + " tokens");
+            }
+            if (progress.file > inputs.size()) {
+                throw sw::tokenizer::Error("state doesn't match inputs");
+            }
+        }
+        progress.dtype = dtype;
+
+        Writer writer(opts.output, progress, token_width);
+        Pipeline pipeline(opts, tiktoken, writer);
+        pipeline.run(inputs);
+
+        std::cerr << "dtype: " << dtype << std::endl;
+    } catch (const sw::tokenizer::Error &e) {
+        std::cerr << "failed to tokenize corpus: " << e.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
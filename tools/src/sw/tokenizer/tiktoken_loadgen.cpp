@@ -0,0 +1,236 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "sw/tokenizer/client.h"
+
+namespace {
+
+struct Options {
+    std::string path;
+    std::string encoding = "cl100k_base";
+    std::string input;
+    sw::tokenizer::protocol::Op op = sw::tokenizer::protocol::Op::ENCODE;
+    std::size_t connections = 4;
+    std::size_t requests = 10000;
+
+    // Number of outstanding requests per connection.
+    std::size_t depth = 1;
+
+    // Size of each request text in bytes, taken from the input in turn.
+    std::size_t request_size = 1024;
+};
+
+using Clock = std::chrono::steady_clock;
+
+void usage() {
+    std::cerr << "usage: tiktoken_loadgen -s socket_path -f input_file [-e encoding] "
+        << "[-o encode|decode|count] [-c connections] [-n requests_per_connection] "
+        << "[-d pipeline_depth] [-l request_size]" << std::endl;
+}
+
+std::vector<std::string> split_texts(const std::string &input, std::size_t size) {
+    std::vector<std::string> texts;
+    for (std::size_t pos = 0; pos < input.size(); pos += size) {
+        texts.push_back(input.substr(pos, size));
+    }
+    return texts;
+}
+
+// Returns latencies in microseconds.
+std::vector<double> run(const Options &opts, const std::vector<std::string> &payloads, std::size_t offset) {
+    sw::tokenizer::TokenizerClient client(opts.path);
+
+    std::vector<double> latencies;
+    latencies.reserve(opts.requests);
+    std::unordered_map<uint32_t, Clock::time_point> pending;
+    std::size_t sent = 0;
+    while (latencies.size() < opts.requests) {
+        while (sent < opts.requests && pending.size() < opts.depth) {
+            const auto &payload = payloads[(offset + sent) % payloads.size()];
+            auto id = client.send(opts.op, opts.encoding, payload);
+            pending.emplace(id, Clock::now());
+            ++sent;
+        }
+
+        auto resp = client.receive();
+        auto iter = pending.find(resp.id);
+        if (iter == pending.end()) {
+            throw sw::tokenizer::Error("unknown response id: " + std::to_string(resp.id));
+        }
+
+        if (resp.status != sw::tokenizer::protocol::Status::OK) {
+            throw sw::tokenizer::Error("server error: " + resp.payload);
+        }
+
+        latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - iter->second).count());
+        pending.erase(iter);
+    }
+
+    return latencies;
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+
+    auto idx = static_cast<std::size_t>(p * (sorted.size() - 1));
+    return sorted[idx];
+}
+
+}
+
+int main(int argc, char **argv) {
+    Options opts;
+    int opt = 0;
+    try {
+        while ((opt = getopt(argc, argv, "s:f:e:o:c:n:d:l:")) != -1) {
+            switch (opt) {
+            case 's':
+                opts.path = optarg;
+                break;
+
+            case 'f':
+                opts.input = optarg;
+                break;
+
+            case 'e':
+                opts.encoding = optarg;
+                break;
+
+            case 'o':
+                if (std::string(optarg) == "encode") {
+                    opts.op = sw::tokenizer::protocol::Op::ENCODE;
+                } else if (std::string(optarg) == "decode") {
+                    opts.op = sw::tokenizer::protocol::Op::DECODE;
+                } else if (std::string(optarg) == "count") {
+                    opts.op = sw::tokenizer::protocol::Op::COUNT;
+                } else {
+                    usage();
+                    return -1;
+                }
+                break;
+
+            case 'c':
+                opts.connections = std::stoul(optarg);
+                break;
+
+            case 'n':
+                opts.requests = std::stoul(optarg);
+                break;
+
+            case 'd':
+                opts.depth = std::max<std::size_t>(1, std::stoul(optarg));
+                break;
+
+            case 'l':
+                opts.request_size = std::max<std::size_t>(1, std::stoul(optarg));
+                break;
+
+            default:
+                usage();
+                return -1;
+                break;
+            }
+        }
+    } catch (const std::exception &) {
+        usage();
+        return -1;
+    }
+
+    if (opts.path.empty() || opts.input.empty()) {
+        usage();
+        return -1;
+    }
+
+    try {
+        std::ifstream file(opts.input);
+        if (!file) {
+            throw sw::tokenizer::Error("failed to open input file: " + opts.input);
+        }
+        std::stringstream ss;
+        ss << file.rdbuf();
+
+        auto payloads = split_texts(ss.str(), opts.request_size);
+        if (payloads.empty()) {
+            throw sw::tokenizer::Error("empty input file: " + opts.input);
+        }
+
+        if (opts.op == sw::tokenizer::protocol::Op::DECODE) {
+            // Decode requests take tokens, so encode the texts first.
+            sw::tokenizer::TokenizerClient client(opts.path);
+            for (auto &payload : payloads) {
+                auto tokens = client.encode(opts.encoding, payload);
+                payload.clear();
+                sw::tokenizer::protocol::put_tokens(payload, tokens);
+            }
+        }
+
+        std::vector<std::vector<double>> results(opts.connections);
+        std::vector<std::string> errors(opts.connections);
+        std::vector<std::thread> threads;
+        auto start = Clock::now();
+        for (std::size_t idx = 0; idx < opts.connections; ++idx) {
+            threads.emplace_back([&, idx]() {
+                        try {
+                            results[idx] = run(opts, payloads, idx * opts.requests);
+                        } catch (const std::exception &e) {
+                            errors[idx] = e.what();
+                        }
+                    });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+        for (const auto &err : errors) {
+            if (!err.empty()) {
+                throw sw::tokenizer::Error(err);
+            }
+        }
+
+        std::vector<double> latencies;
+        for (auto &result : results) {
+            latencies.insert(latencies.end(), result.begin(), result.end());
+        }
+        std::sort(latencies.begin(), latencies.end());
+
+        std::cout << "requests: " << latencies.size()
+            << ", elapsed: " << elapsed << "s"
+            << ", qps: " << latencies.size() / elapsed
+            << ", latency us p50: " << percentile(latencies, 0.5)
+            << ", p99: " << percentile(latencies, 0.99)
+            << ", p999: " << percentile(latencies, 0.999)
+            << ", max: " << percentile(latencies, 1.0)
+            << std::endl;
+    } catch (const sw::tokenizer::Error &e) {
+        std::cerr << "failed to generate load: " << e.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+#include <signal.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "sw/tokenizer/server.h"
+#include "sw/tokenizer/str_utils.h"
+
+namespace {
+
+sw::tokenizer::TokenizerServer *server = nullptr;
+
+void on_signal(int) {
+    if (server != nullptr) {
+        server->stop();
+    }
+}
+
+void usage() {
+    std::cerr << "usage: tiktoken_server -t tiktoken.toml -s socket_path "
+        << "[-w workers] [-b max_batch] [-q max_queue] [-c max_connection_bytes] "
+        << "[-p encoding1,encoding2]" << std::endl;
+}
+
+}
+
+int main(int argc, char **argv) {
+    int opt = 0;
+    std::string tiktoken_conf;
+    sw::tokenizer::ServerOptions opts;
+    std::string preload;
+    try {
+        while ((opt = getopt(argc, argv, "t:s:w:b:q:c:p:")) != -1) {
+            switch (opt) {
+            case 't':
+                tiktoken_conf = optarg;
+                break;
+
+            case 's':
+                opts.path = optarg;
+                break;
+
+            case 'w':
+                opts.workers = std::stoul(optarg);
+                break;
+
+            case 'b':
+                opts.max_batch = std::stoul(optarg);
+                break;
+
+            case 'q':
+                opts.max_queue = std::stoul(optarg);
+                break;
+
+            case 'c':
+                opts.max_connection_bytes = std::stoul(optarg);
+                break;
+
+            case 'p':
+                preload = optarg;
+                break;
+
+            default:
+                usage();
+                return -1;
+                break;
+            }
+        }
+    } catch (const std::exception &) {
+        usage();
+        return -1;
+    }
+
+    if (tiktoken_conf.empty() || opts.path.empty()) {
+        usage();
+        return -1;
+    }
+
+    try {
+        sw::tokenizer::TiktokenFactory tiktoken_factory(tiktoken_conf);
+
+        // Start serving while the preloaded encodings are still loading.
+        std::vector<std::string> encodings;
+        sw::tokenizer::str::split(preload, ",", std::back_inserter(encodings));
+        for (const auto &encoding : encodings) {
+            tiktoken_factory.preload(encoding);
+        }
+
+        sw::tokenizer::TokenizerServer tokenizer_server(tiktoken_factory, opts);
+        server = &tokenizer_server;
+
+        signal(SIGINT, on_signal);
+        signal(SIGTERM, on_signal);
+
+        std::cerr << "serving on " << opts.path << std::endl;
+
+        tokenizer_server.run();
+
+        server = nullptr;
+    } catch (const sw::tokenizer::Error &e) {
+        std::cerr << "failed to run server: " << e.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
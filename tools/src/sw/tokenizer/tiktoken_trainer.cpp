@@ -0,0 +1,158 @@
+/**************************************************************************
+   Copyright (c) 2023 sewenew
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ *************************************************************************/
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "sw/tokenizer/errors.h"
+#include "sw/tokenizer/toml.h"
+#include "sw/tokenizer/trainer.h"
+
+namespace {
+
+void usage() {
+    std::cerr << "usage: tiktoken_trainer -t tiktoken.toml -e encoding -o output.tiktoken "
+        << "[-v vocab_size] [-m min_frequency] [-j threads] corpus1 [corpus2 ...]" << std::endl;
+}
+
+// Count pieces of a file, which is mapped into memory instead of being read into a buffer.
+void count_file(sw::tokenizer::BpeTrainer &trainer, const std::string &path) {
+    auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw sw::tokenizer::Error("failed to open " + path + ": " + std::strerror(errno));
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        auto err = std::string(std::strerror(errno));
+        ::close(fd);
+        throw sw::tokenizer::Error("failed to stat " + path + ": " + err);
+    }
+
+    auto size = static_cast<std::size_t>(st.st_size);
+    if (size == 0) {
+        ::close(fd);
+        return;
+    }
+
+    auto *data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        throw sw::tokenizer::Error("failed to mmap " + path + ": " + std::strerror(errno));
+    }
+
+    ::madvise(data, size, MADV_SEQUENTIAL);
+
+    try {
+        trainer.count(std::string_view(static_cast<const char *>(data), size));
+    } catch (...) {
+        ::munmap(data, size);
+        throw;
+    }
+
+    ::munmap(data, size);
+}
+
+}
+
+int main(int argc, char **argv) {
+    int opt = 0;
+    std::string tiktoken_conf;
+    std::string encoding;
+    std::string output;
+    sw::tokenizer::TrainerOptions opts;
+    try {
+        while ((opt = getopt(argc, argv, "t:e:o:v:m:j:")) != -1) {
+            switch (opt) {
+            case 't':
+                tiktoken_conf = optarg;
+                break;
+
+            case 'e':
+                encoding = optarg;
+                break;
+
+            case 'o':
+                output = optarg;
+                break;
+
+            case 'v':
+                opts.vocab_size = std::stoul(optarg);
+                break;
+
+            case 'm':
+                opts.min_frequency = std::stoull(optarg);
+                break;
+
+            case 'j':
+                opts.threads = std::stoul(optarg);
+                break;
+
+            default:
+                usage();
+                return -1;
+                break;
+            }
+        }
+    } catch (const std::exception &) {
+        usage();
+        return -1;
+    }
+
+    if (tiktoken_conf.empty() || encoding.empty() || output.empty() || optind >= argc) {
+        usage();
+        return -1;
+    }
+
+    try {
+        // Split texts with the same pattern as the encoding.
+        auto conf = sw::tokenizer::Toml::parse(tiktoken_conf);
+        auto pattern = conf["encodings"][encoding]["pattern"].get<std::string>();
+
+        sw::tokenizer::BpeTrainer trainer(pattern, opts);
+
+        using Clock = std::chrono::steady_clock;
+        auto start = Clock::now();
+        for (auto idx = optind; idx < argc; ++idx) {
+            count_file(trainer, argv[idx]);
+            std::cerr << "counted " << argv[idx] << std::endl;
+        }
+        auto counted = Clock::now();
+
+        auto encoder = trainer.train();
+        auto trained = Clock::now();
+
+        sw::tokenizer::BpeTrainer::save(encoder, output);
+
+        std::cerr << "vocab size: " << encoder.size()
+            << ", count: " << std::chrono::duration<double>(counted - start).count() << "s"
+            << ", train: " << std::chrono::duration<double>(trained - counted).count() << "s"
+            << std::endl;
+    } catch (const sw::tokenizer::Error &e) {
+        std::cerr << "failed to train: " << e.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}